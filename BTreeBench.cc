@@ -0,0 +1,143 @@
+/**
+ * Counts the page reads of index lookups with a small buffer pool:
+ * locate() one key at a time, locateBatch() for all of them, and locate()
+ * with the non-leaf levels kept in memory. The tree has 3 levels with the
+ * default 1KB pages. Then counts the page writes of as many inserts, into
+ * that tree and into one whose non-leaf nodes count entries, which has 4.
+ * usage: btreebench [cache_pages] [probes]
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <unistd.h>
+#include "Bruinbase.h"
+#include "BTreeIndex.h"
+
+using namespace std;
+
+static const char* INDEX_FILE = "btreebench.idx";
+static const char* COUNTED_FILE = "btreebench-counted.idx";
+static const int PAIRS = 600000;
+static const int RANGE = 10000000;
+
+// the height of the tree, from the header page of the index
+static int treeHeight()
+{
+  PageFile pf(INDEX_FILE, 'r');
+  vector<char> page(pf.getPageSize());
+  int height = 0;
+  if (pf.read(0, &page[0]) == 0) memcpy(&height, &page[0] + sizeof(PageId), sizeof(height));
+  return height;
+}
+
+// look up every key with locate(), and return the # of pages read
+static int probeOneByOne(const vector<int>& keys, bool pin)
+{
+  BTreeIndex index;
+  IndexCursor cursor;
+
+  BTreeIndex::setPinInnerLevels(pin);
+  index.open(INDEX_FILE, 'r');
+  int before = PageFile::getPageReadCount();
+  for (size_t i = 0; i < keys.size(); i++) index.locate(keys[i], cursor);
+  int reads = PageFile::getPageReadCount() - before;
+  index.close();
+  return reads;
+}
+
+// look up all keys with one locateBatch(), and return the # of pages read
+static int probeBatch(const vector<int>& keys)
+{
+  BTreeIndex index;
+  vector<IndexCursor> cursors(keys.size());
+
+  BTreeIndex::setPinInnerLevels(false);
+  index.open(INDEX_FILE, 'r');
+  int before = PageFile::getPageReadCount();
+  index.locateBatch(&keys[0], keys.size(), &cursors[0]);
+  int reads = PageFile::getPageReadCount() - before;
+  index.close();
+  return reads;
+}
+
+// build an index with random inserts, the same ones every time
+static bool build(const char* name, bool counts)
+{
+  BTreeIndex index;
+
+  unlink(name);
+  srand(1);
+  BTreeIndex::setCountEntries(counts);
+  if (index.open(name, 'w') < 0) {
+    fprintf(stderr, "cannot open %s\n", name);
+    return false;
+  }
+  for (int i = 0; i < PAIRS; i++) {
+    RecordId rid = { i / 10, i % 10 };
+    index.insert(rand() % RANGE, rid);
+  }
+  index.close();
+  return true;
+}
+
+// insert every key, and return the # of pages written until the index is closed
+static int insertAll(const char* name, const vector<int>& keys)
+{
+  BTreeIndex index;
+
+  BTreeIndex::setPinInnerLevels(false);
+  index.open(name, 'w');
+  int before = PageFile::getPageWriteCount();
+  for (size_t i = 0; i < keys.size(); i++) {
+    RecordId rid = { PAIRS / 10 + (int)i, 0 };
+    index.insert(keys[i], rid);
+  }
+  index.close();
+  return PageFile::getPageWriteCount() - before;
+}
+
+int main(int argc, char* argv[])
+{
+  int cachePages = (argc > 1) ? atoi(argv[1]) : 10;
+  int probes = (argc > 2) ? atoi(argv[2]) : 20000;
+  if (cachePages <= 0 || probes <= 0) {
+    fprintf(stderr, "usage: %s [cache_pages] [probes]\n", argv[0]);
+    return 1;
+  }
+
+  if (!build(INDEX_FILE, false) || !build(COUNTED_FILE, true)) return 1;
+
+  vector<int> keys(probes);
+  for (int i = 0; i < probes; i++) keys[i] = rand() % RANGE;
+
+  // every run starts with the pages of the index out of the pool
+  PageFile::setCacheSize(cachePages);
+  printf("%d pairs, %d levels, %d-page cache, %d probes\n",
+         PAIRS, treeHeight(), cachePages, probes);
+
+  PageFile::setCacheSize(cachePages);
+  int single = probeOneByOne(keys, false);
+  printf("locate():                    %7d page reads, %.2f per probe\n", single, (double)single / probes);
+
+  PageFile::setCacheSize(cachePages);
+  int batch = probeBatch(keys);
+  printf("locateBatch():               %7d page reads, %.2f per probe\n", batch, (double)batch / probes);
+
+  PageFile::setCacheSize(cachePages);
+  int pinned = probeOneByOne(keys, true);
+  printf("locate(), non-leaf in memory: %6d page reads, %.2f per probe\n", pinned, (double)pinned / probes);
+
+  PageFile::setCacheSize(cachePages);
+  int writes = insertAll(INDEX_FILE, keys);
+  printf("insert():                    %7d page writes, %.2f per insert\n", writes, (double)writes / probes);
+
+  PageFile::setCacheSize(cachePages);
+  int counted = insertAll(COUNTED_FILE, keys);
+  printf("insert(), counted entries:   %7d page writes, %.2f per insert\n", counted, (double)counted / probes);
+
+  unlink(INDEX_FILE);
+  unlink(COUNTED_FILE);
+  return 0;
+}
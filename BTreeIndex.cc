@@ -10,38 +10,101 @@
 #include "BTreeIndex.h"
 #include "BTreeNode.h"
 #include <string.h>
+#include <vector>
+#include <utility>
+#include <thread>
+#include <algorithm>
+#include <climits>
 //#include <iostream> //for test
 
 using namespace std;
 
+  const int sorpid = sizeof(PageId);  //size of rootPid
+  const int sotreeh = sizeof(int);  //size of treeHeight
+  const int soheader = 5*sizeof(int);  //rootPid, treeHeight and three unused ints (the old insert state) come first in page 0
+  const int INDEX_MAGIC = 0x58495442;  //"BTIX", marks a header page that records the node format
+  const int INDEX_PREV_LINKS = 1;  //header flag: every leaf node points to the previous one
+  const int INDEX_NO_DEAD_TAILS = 2;  //header flag: no non-leaf node ends with a pointer left over by a split
+  const int INDEX_COUNTS = 4;  //header flag: non-leaf nodes count the entries under each child
+
+  const RC RESTART = 1;  //descend() read a node while it was changed and has to start over
+  const unsigned NO_VERSION = 1;  //odd, the IndexCursor version of a leaf node whose version is not known
+  const int SCAN_RUN = 64;  //the # of pairs readForward() decodes from a leaf node at a time
+
+NodeFormat BTreeIndex::defaultFormat = NODE_INTERLEAVED;
+bool BTreeIndex::defaultPinInner = false;
+bool BTreeIndex::defaultCounts = false;
+
+/*
+ * Wait until no writer holds the latch and return its version.
+ */
+static unsigned readLatch(const atomic<unsigned>& latch)
+{
+	unsigned version;
+	while((version=latch.load(memory_order_acquire))&1)
+		this_thread::yield();
+	return version;
+}
+
+/*
+ * Check that nothing guarded by the latch changed since version was read.
+ */
+static bool validate(const atomic<unsigned>& latch, unsigned version)
+{
+	atomic_thread_fence(memory_order_acquire);
+	return latch.load(memory_order_relaxed)==version;
+}
+
+/*
+ * The latches a writer holds on the nodes it modifies.
+ * They are all released when the insert or remove returns.
+ */
+class LatchSet {
+ public:
+  ~LatchSet()
+  {
+	for(size_t i=0;i<held.size();i++)
+		held[i]->fetch_add(1,memory_order_release);  //even again, with the new content
+  }
+
+  void add(atomic<unsigned>& latch)
+  {
+	for(size_t i=0;i<held.size();i++)  //nodes may share a latch
+		if(held[i]==&latch)
+			return;
+	latch.fetch_add(1,memory_order_relaxed);  //odd, readers of the node start over
+	atomic_thread_fence(memory_order_release);
+	held.push_back(&latch);
+  }
+
+ private:
+  vector<atomic<unsigned>*> held;
+};
+
 /*
- * BTreeIndex constructor
- */
- 
-  PageId   rootPid;    /// the PageId of the root node
-  int      treeHeight; /// the height of the tree
-  int level;
-  PageId parentpid;
-  PageId currentpid;
-  const int sorpid = sizeof(rootPid);  //size of rootPid
-  const int sotreeh = sizeof(treeHeight);  //size of treeHeight
-  const int sotreebuf = sorpid+sotreeh;  //size of treeHeight used to store rootPid and treeHeight
-  const int max_key_num = floor((PageFile::PAGE_SIZE - soi - sopid)/soent);  //the maximum number of keys in a node
-  const int max_key_num_non = floor((PageFile::PAGE_SIZE - soi - sopid)/(soi + sopid));  //the maximum number of keys in a non-leaf node
- 
+ * BTreeIndex constructor.
+ * Nothing is written until an index file is opened.
+ */
 BTreeIndex::BTreeIndex()
 {
     rootPid = -1;   //-1 means that the tree is empty
     treeHeight = 0;//0 means that the tree is empty
-    level=1;    //the current level of tree during insert, stored in page with pid=0 and after treeHeight
-    parentpid=-1; //pid of upper level node
-    currentpid=rootPid; //pid of current node, which should start from rootPid
-    for(int i=0;i<sotreebuf;i++)   //clear up tree_buffer, which is used to store rootPid, treeHeight, level, parentpid and currentpid
-    tree_buffer[i]=0;
-	memcpy(tree_buffer+sorpid+sotreeh, &level, sizeof(level));
- 	memcpy(tree_buffer+sorpid+sotreeh+sizeof(level), &parentpid, sizeof(parentpid));
- 	memcpy(tree_buffer+sorpid+sotreeh+sizeof(level)+sizeof(parentpid), &currentpid, sizeof(currentpid));
-	pf.write(0, tree_buffer);
+    nodeFormat=defaultFormat;
+    prevLinks=false;
+    deadTails=false;
+    counted=false;
+    for(int i=0;i<LATCH_STRIPES;i++)
+    latches[i]=0;
+    rootLatch=0;
+    countLatch=0;
+    pinInner=defaultPinInner;
+    innerRoot=NULL;
+    pageSize=PageFile::PAGE_SIZE;  //tree_buffer, which is used to store rootPid, treeHeight and the node format, is made by open()
+}
+
+BTreeIndex::~BTreeIndex()
+{
+    freeInnerLevels();
 }
 
 /*
@@ -56,315 +119,2080 @@ RC BTreeIndex::open(const string& indexname, char mode)
 		int result;
 		if((result = pf.open(indexname, mode))<0)   //open the index file and return the error code if possible
 			return result;
+		if((mode == 'w')||(mode == 'W'))  //keep modified nodes and page 0 in the buffer pool until close
+			pf.setWriteBack(true);
+		if((mode == 'm')||(mode == 'M'))  //index probes jump around the mapped file
+			pf.advise(PageFile::RANDOM);
 
 		//read the information of the tree, including rootPid and treeheight, from pid=0
+		//the nodes and the header take a page of the file each
 		int readresult;
-		readresult=pf.read(0,tree_buffer);
+		pageSize=pf.getPageSize();
+		tree_buffer.assign(pageSize,0);
+		readresult=pf.read(0,&tree_buffer[0]);
 		
 		if((readresult<0)&&(pf.endPid()!=0)) //cannot read the page with pid=0, but the page is not empty
 			return readresult;   //return the error code
-		memcpy(&rootPid, tree_buffer, sorpid);
-		memcpy(&treeHeight, tree_buffer + sorpid, sotreeh);
-		memcpy(&currentpid, tree_buffer+sorpid+sotreeh+sizeof(level)+sizeof(parentpid), sizeof(currentpid));
-		currentpid=rootPid; //During insert, pid shall start from rootPid
-		memcpy(tree_buffer+sorpid+sotreeh+sizeof(level)+sizeof(parentpid), &currentpid, sizeof(currentpid));
 
-		if(treeHeight == 0)  //the tree is empty
-			rootPid = -1;
+		//the node format and the flags follow the tree information. files written before
+		//there was a choice have no magic number and use the interleaved format
+		int magic;
+		memcpy(&magic,&tree_buffer[0]+soheader,sizeof(magic));
+		if(pf.endPid()==0)
+		{
+			nodeFormat=defaultFormat;
+			prevLinks=true;
+			deadTails=false;
+			counted=defaultCounts;
+		}
+		else if(magic==INDEX_MAGIC)
+		{
+			int format, flags;
+			memcpy(&format,&tree_buffer[0]+soheader+sizeof(magic),sizeof(format));
+			memcpy(&flags,&tree_buffer[0]+soheader+sizeof(magic)+sizeof(format),sizeof(flags));
+			if((format!=NODE_INTERLEAVED)&&(format!=NODE_SOA)&&(format!=NODE_PACKED))
+			{
+				pf.close();
+				return RC_INVALID_FILE_FORMAT;
+			}
+			nodeFormat=(NodeFormat)format;
+			prevLinks=((flags&INDEX_PREV_LINKS)!=0);
+			deadTails=((flags&INDEX_NO_DEAD_TAILS)==0);
+			counted=((flags&INDEX_COUNTS)!=0);
+		}
+		else
+		{
+			nodeFormat=NODE_INTERLEAVED;
+			prevLinks=false;
+			deadTails=true;
+			counted=false;
+		}
+		PageId root;
+		int height;
+		memcpy(&root, &tree_buffer[0], sorpid);
+		memcpy(&height, &tree_buffer[0] + sorpid, sotreeh);
+
+		if(height == 0)  //the tree is empty
+			root = -1;
+		rootPid = root;
+		treeHeight = height;
+
+		if(height == 0)  //a new tree links its leaf nodes both ways, and counts entries if chosen
+		{
+			prevLinks=true;
+			deadTails=false;
+			counted=defaultCounts;
+			if(((mode == 'w')||(mode == 'W'))&&(pf.endPid()==0)&&((result=writeHeader())<0))  //new pages go after page 0
+			{
+				close();
+				return result;
+			}
+		}
+		else if((mode == 'w')||(mode == 'W'))  //bring the tree of an older file up to date
+		{
+			if((!prevLinks)&&((result=linkPrevLeaves())<0))
+			{
+				close();
+				return result;
+			}
+			if((!counted)&&defaultCounts&&((result=rebuildInnerLevels())<0))
+			{
+				close();
+				return result;
+			}
+			if(deadTails&&((result=trimDeadTails())<0))
+			{
+				close();
+				return result;
+			}
+		}
+
+		pinInner=defaultPinInner;
+		if(pinInner&&((result=loadInnerLevels())<0))
+		{
+			close();
+			return result;
+		}
     return 0;
 }
 
+/*
+ * Choose the node format of the trees created from now on.
+ * @param format[IN] the layout of the nodes
+ */
+void BTreeIndex::setDefaultFormat(NodeFormat format)
+{
+	defaultFormat=format;
+}
+
+/*
+ * Choose whether the indexes opened from now on keep their non-leaf nodes in memory.
+ * @param pin[IN] true to keep the non-leaf nodes in memory
+ */
+void BTreeIndex::setPinInnerLevels(bool pin)
+{
+	defaultPinInner=pin;
+}
+
+/*
+ * Choose whether the trees created from now on count the entries under
+ * each child in their non-leaf nodes.
+ * @param count[IN] true to count the entries
+ */
+void BTreeIndex::setCountEntries(bool count)
+{
+	defaultCounts=count;
+}
+
+/*
+ * Return the node format of the open index.
+ * @return the layout of the nodes
+ */
+NodeFormat BTreeIndex::getFormat() const
+{
+	return nodeFormat;
+}
+
 /*
  * Close the index file.
+ * The header page is written whenever the root or the height changes,
+ * so there is nothing left to save here.
  * @return error code. 0 if no error
  */
 RC BTreeIndex::close()
 {
-    //save the rootPid and treeHeight to tree_buffer, then save it to page with pid=0
-    memcpy(tree_buffer, &rootPid, sorpid);
-    memcpy(tree_buffer + sorpid, &treeHeight, sotreeh);
-    pf.write(0, tree_buffer);
+    //forget the tree, it belongs to the file
+    rootPid = -1;
+    treeHeight = 0;
+    nodeFormat = defaultFormat;
+    freeInnerLevels();
     return pf.close();
 }
 
 /*
- * Insert (key, RecordId) pair to the index.
- * @param key[IN] the key for the value inserted into the index
- * @param rid[IN] the RecordId for the record being inserted into the index
+ * Load all non-leaf nodes into memory, one level at a time,
+ * and link every node to the copies of its children.
  * @return error code. 0 if no error
  */
-RC BTreeIndex::insert(int key, const RecordId& rid)
+RC BTreeIndex::loadInnerLevels()
 {
-		int result;
-		int temp_siblingKey;
-		if(treeHeight == 0)  //the tree is empty
+	RC result;
+	vector<PageId> level(1,rootPid);
+	for(int h=1;h<treeHeight;h++)  //the levels above the leaf nodes
+	{
+		vector<PageId> below;
+		pf.prefetch(&level[0],level.size());
+		for(size_t i=0;i<level.size();i++)
+		{
+			BTNonLeafNode nln(nodeFormat,counted,pageSize);
+			if((result=nln.read(level[i],pf))<0)
+				return result;
+			cacheInner(level[i],nln);
+			for(int c=0;c<=nln.getKeyCount();c++)
 			{
-				memcpy(tree_buffer, &rootPid, sorpid);
-				memcpy(tree_buffer + sorpid, &treeHeight, sotreeh);
-				if((result=pf.write(pf.endPid(),tree_buffer))<0)
+				PageId child;
+				if((result=nln.readChildPtr(c,child))<0)
 					return result;
-				BTLeafNode ln; // create the first node
-				if((result=ln.insert(key,rid))<0)
+				below.push_back(child);
+			}
+		}
+		level.swap(below);
+	}
+
+	unordered_map<PageId,InnerNode*>::iterator it;
+	for(it=innerNodes.begin();it!=innerNodes.end();it++)  //every child is in memory now
+		linkChildren(it->second);
+	it=innerNodes.find(rootPid);
+	innerRoot=(it!=innerNodes.end()) ? it->second : NULL;
+	return 0;
+}
+
+/*
+ * Drop the non-leaf nodes kept in memory.
+ */
+void BTreeIndex::freeInnerLevels()
+{
+	innerRoot=NULL;
+	unordered_map<PageId,InnerNode*>::iterator it;
+	for(it=innerNodes.begin();it!=innerNodes.end();it++)
+		delete it->second;
+	innerNodes.clear();
+	for(size_t i=0;i<retired.size();i++)
+		delete retired[i];
+	retired.clear();
+}
+
+/*
+ * Stop keeping a non-leaf node that left the tree in memory.
+ * Its copy is deleted by close(), after the readers are gone.
+ * @param pid[IN] the node
+ */
+void BTreeIndex::retireInner(PageId pid)
+{
+	unordered_map<PageId,InnerNode*>::iterator it=innerNodes.find(pid);
+	if(it==innerNodes.end())
+		return;
+	retired.push_back(it->second);
+	innerNodes.erase(it);
+}
+
+/*
+ * Read a non-leaf node for an insert, from memory if it is kept there.
+ * @param pid[IN] the node to read
+ * @param nln[OUT] the node
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::readInner(PageId pid, BTNonLeafNode& nln)
+{
+	unordered_map<PageId,InnerNode*>::iterator it=innerNodes.find(pid);
+	if(it!=innerNodes.end())
+	{
+		nln.view(it->second->page);
+		return 0;
+	}
+	return nln.read(pid,pf);
+}
+
+/*
+ * Copy a non-leaf node that was just written to memory.
+ * A new node gets a new copy. The children of the node that are not
+ * in memory yet are linked when they are cached themselves, or by
+ * loadInnerLevels().
+ * @param pid[IN] the node
+ * @param nln[IN] its new content
+ * @return the copy in memory. NULL if the nodes are not kept in memory
+ */
+BTreeIndex::InnerNode* BTreeIndex::cacheInner(PageId pid, const BTNonLeafNode& nln)
+{
+	if(!pinInner)
+		return NULL;
+	InnerNode*& node=innerNodes[pid];
+	if(node==NULL)
+	{
+		node=new InnerNode(pageSize);
+	}
+	nln.copyTo(node->page);
+	linkChildren(node);
+	return node;
+}
+
+/*
+ * Point the children of a node in memory to their copies.
+ * A child that is not in memory, such as a leaf node, gets NULL.
+ * @param node[IN] the node
+ */
+void BTreeIndex::linkChildren(InnerNode* node)
+{
+	BTNonLeafNode nln(nodeFormat,counted,pageSize);
+	nln.view(node->page);
+	for(int i=0;i<=nln.getKeyCount();i++)
+	{
+		PageId child;
+		nln.readChildPtr(i,child);
+		unordered_map<PageId,InnerNode*>::iterator it=innerNodes.find(child);
+		node->children[i].store((it!=innerNodes.end()) ? it->second : NULL,memory_order_relaxed);
+	}
+}
+
+/*
+ * Point every leaf node of a tree written before leaf nodes had
+ * previous pointers to the previous one, in one pass over the leaf nodes.
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::linkPrevLeaves()
+{
+	RC result;
+
+	//the first leaf node is under the first pointer of every level
+	PageId pid=rootPid;
+	for(int i=1;i<treeHeight;i++)
+	{
+		BTNonLeafNode nln(nodeFormat,counted,pageSize);
+		if((result=nln.read(pid,pf))<0)
+			return result;
+		if((result=nln.readChildPtr(0,pid))<0)
+			return result;
+	}
+
+	PageId prev=0;
+	while(pid!=0)
+	{
+		BTLeafNode ln(nodeFormat,pageSize);
+		if((result=ln.read(pid,pf))<0)
+			return result;
+		ln.setPrevNodePtr(prev);
+		if((result=ln.write(pid,pf))<0)
+			return result;
+		prev=pid;
+		pid=ln.getNextNodePtr();
+	}
+	prevLinks=true;
+	return writeHeader();
+}
+
+/*
+ * Drop the last key and pointer that a split by older versions left in
+ * the non-leaf nodes. The key is the one that moved up, and the pointer
+ * is also the first pointer of the node after it on the same level, so
+ * the level is read from left to right and each node is compared with
+ * the next one.
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::trimDeadTails()
+{
+	RC result;
+	vector<PageId> level(1,rootPid);
+	for(int h=1;h<treeHeight;h++)  //the levels above the leaf nodes
+	{
+		vector<PageId> below;
+		pf.prefetch(&level[0],level.size());
+		for(size_t i=0;i<level.size();i++)
+		{
+			BTNonLeafNode nln(nodeFormat,counted,pageSize);
+			if((result=nln.read(level[i],pf))<0)
+				return result;
+			int count=nln.getKeyCount();
+			if((i+1<level.size())&&(count>0))
+			{
+				BTNonLeafNode next(nodeFormat,counted,pageSize);
+				PageId last, first;
+				if((result=next.read(level[i+1],pf))<0)
 					return result;
-				rootPid=1;
-				if((result=ln.write(rootPid,pf))<0)  //write the first node back to page
+				nln.readChildPtr(count,last);
+				next.readChildPtr(0,first);
+				if(last==first)
 				{
-					return result;
+					nln.remove(--count);
+					if((result=nln.write(level[i],pf))<0)
+						return result;
 				}
-				treeHeight = 1; //update treeHeight and rootPid in page
-				memcpy(tree_buffer, &rootPid, sorpid);
-                memcpy(tree_buffer + sorpid, &treeHeight, sotreeh);
-				currentpid=rootPid; //During insert, pid shall start from rootPid
-				memcpy(tree_buffer+sorpid+sotreeh+sizeof(level)+sizeof(parentpid), &currentpid, sizeof(currentpid));
-                pf.write(0, tree_buffer);
-
 			}
-		else if (treeHeight == 1) // there is only one leaf node(root node)
+			for(int c=0;c<=count;c++)
 			{
-				BTLeafNode ln;
-				ln.read(1,pf);   //read the root node
-				if(ln.getKeyCount()<max_key_num)   //there is enough space for this (key, RecordId) pair
-					{
-						if((result=ln.insert(key,rid))<0)
-							return result;
-						if((result=ln.write(1,pf))<0)  //write back to page
-							return result;
-					}
-				else
-					{
-						BTLeafNode sibling; //create the sibling node
-						int siblingKey;
-						if((result=ln.insertAndSplit(key,rid,sibling,siblingKey))<0)
-							return result;
-						int siblingpid=2; //pid of the sibling node
-						ln.setNextNodePtr(siblingpid);  //the last pointer in original leaf node points to its sibling node
-						if((result=ln.write(1,pf))<0)  //write original leaf node back to page
-							return result;
-						if((result=sibling.write(siblingpid,pf))<0)  //write sibling node back to page
-							return result;
-						rootPid=3;
-						treeHeight=2; //update treeHeight and rootPid in page
-                        memcpy(tree_buffer, &rootPid, sorpid);
-                        memcpy(tree_buffer + sorpid, &treeHeight, sotreeh);
-						currentpid=rootPid; //During insert, pid shall start from rootPid
-				        memcpy(tree_buffer+sorpid+sotreeh+sizeof(level)+sizeof(parentpid), &currentpid, sizeof(currentpid));
-                        pf.write(0, tree_buffer);
-						//create new root
-						BTNonLeafNode nln;
-						nln.initializeRoot(1,siblingKey,siblingpid);
-						if((result=nln.write(rootPid,pf))<0)  //write new rootNode back to page
-							return result;
-					}
+				PageId child;
+				if((result=nln.readChildPtr(c,child))<0)
+					return result;
+				below.push_back(child);
+			}
+		}
+		level.swap(below);
+	}
+	deadTails=false;
+	return writeHeader();
+}
 
-				}
-		else
-			//treeHight more than 2, need recursion
+struct BTreeIndex::LevelNode {
+  int    key;    // the first key under the node
+  PageId pid;    // the node
+  int    count;  // the # of entries under the node
+};
+
+/*
+ * Write the non-leaf levels of a tree whose non-leaf nodes do not
+ * count entries again, with the counts. The old non-leaf nodes are
+ * freed level by level, the leaf nodes are read in one pass from the
+ * first one on and stay where they are, and the new levels are built on
+ * them by buildInnerLevels() over the freed pages. A key and pointer left
+ * over by a split of older versions goes away with the old nodes.
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::rebuildInnerLevels()
+{
+	RC result;
+	vector<PageId> level(1,rootPid);
+	for(int h=1;h<treeHeight;h++)  //the levels above the leaf nodes
+	{
+		vector<PageId> below;
+		pf.prefetch(&level[0],level.size());
+		for(size_t i=0;i<level.size();i++)
+		{
+			BTNonLeafNode nln(nodeFormat,false,pageSize);
+			if((result=nln.read(level[i],pf))<0)
+				return result;
+			for(int c=0;c<=nln.getKeyCount();c++)
 			{
-				//read the current level, parentpid and currentpid from page with pid=0
-				int readresult;
-                readresult=pf.read(0,tree_buffer);
-                memcpy(&level, tree_buffer+sorpid+sotreeh, sizeof(level));
-                memcpy(&parentpid, tree_buffer+sorpid+sotreeh+sizeof(level), sizeof(parentpid));
-                memcpy(&currentpid, tree_buffer+sorpid+sotreeh+sizeof(level)+sizeof(parentpid), sizeof(currentpid));
-				//when reach the leaf node level
-				if(level == treeHeight)
-					{
-						BTLeafNode ln;
-						ln.read(currentpid,pf);   //read node with the currentpid
-						if(ln.getKeyCount()<max_key_num)   //there is enough space for this (key, RecordId) pair
-						{
-							if((result=ln.insert(key,rid))<0)
-								return result;
-							if((result=ln.write(currentpid,pf))<0)  //write back to page
-								return result;
-							currentpid=rootPid;
-							//write the current level, parentpid and currentpid to page with pid=0
-							memcpy(tree_buffer+sorpid+sotreeh+sizeof(level)+sizeof(parentpid), &currentpid, sizeof(currentpid));
-							pf.write(0, tree_buffer);
-							return 0;
-						}
-						else // the node is full
-						{
-							BTLeafNode sibling;
-							PageId temp_pid;
-							int siblingKey;
-							if((result=ln.insertAndSplit(key,rid,sibling,siblingKey))<0)  //need
-								return result;
-                            int siblingpid=pf.endPid();
-							temp_pid=ln.getNextNodePtr();
-							ln.setNextNodePtr(siblingpid);  //set the pointer in current leaf node to point to its sibling node
-							sibling.setNextNodePtr(temp_pid);  // set the pointer in sibling leaf node
-							if((result=ln.write(currentpid,pf))<0)  //write current leaf node back to page
-								return result;
-							if((result=sibling.write(siblingpid,pf))<0)  //write sibling node back to page
-								return result;
-							currentpid=rootPid;
-							memcpy(tree_buffer+sorpid+sotreeh+sizeof(level)+sizeof(parentpid), &currentpid, sizeof(currentpid));
-							pf.write(0, tree_buffer);
-							return siblingKey; //return the siblingKey to update the non-leaf node
-						}
-					}
-				else
-					{
-						BTNonLeafNode nln;
-						PageId childpid;
-						if((result=nln.read(currentpid,pf))<0)
-							return result;
-						if((result=nln.locateChildPtr(key,childpid))<0)
-							return result;
-						level=level+1;
-						parentpid=currentpid;
-						currentpid=childpid;
-						//write the current level, parentpid and currentpid to page with pid=0
-						memcpy(tree_buffer+sorpid+sotreeh, &level, sizeof(level));
- 						memcpy(tree_buffer+sorpid+sotreeh+sizeof(level), &parentpid, sizeof(parentpid));
- 						memcpy(tree_buffer+sorpid+sotreeh+sizeof(level)+sizeof(parentpid), &currentpid, sizeof(currentpid));
-                        pf.write(0, tree_buffer);
-                        if((temp_siblingKey = insert(key,rid))<0)//recursion and temp_siblingKey is siblingKey from lower level
-                            return -1;
-						level=level-1;
-						memcpy(tree_buffer+sorpid+sotreeh, &level, sizeof(level));
-						pf.write(0, tree_buffer);
-						if(temp_siblingKey!=0)
-						{	
-						
-							if(nln.getKeyCount()<max_key_num_non) //there is enough space for this temp_siblingKey
-							{
-								if((result=nln.insert(temp_siblingKey,pf.endPid()-1))<0)
-									return result;
-								if((result=nln.write(parentpid,pf))<0)  //write back to page
-									return result;
-								return 0;
-							}
-							else //when the non-leaf node with currentpid is full
-							{
-								BTNonLeafNode siblingnln;
-									int siblingKeynln;
-								if((result=nln.insertAndSplit(temp_siblingKey,pf.endPid()-1,siblingnln,siblingKeynln))<0)
-									return result;
-								if((result=nln.write(parentpid,pf))<0)  //write original node back to page
-									return result;
-								int siblingnlnpid=pf.endPid();
-								if((result=siblingnln.write(siblingnlnpid,pf))<0)  //write sibling back to page
-									return result;
-								if(level>1)
-								{
-									return siblingKeynln;
-								}
-								else // when it is root node
-								{
-									//create new root
-									BTNonLeafNode nln;
-									nln.initializeRoot(parentpid,siblingKeynln,siblingnlnpid);
-									rootPid=pf.endPid();
-									if((result=nln.write(rootPid,pf))<0)  //write new rootNode back to page
-										return result;
-									treeHeight=treeHeight+1; //update treeHeight and rootPid in page
-									memcpy(tree_buffer, &rootPid, sorpid);
-									memcpy(tree_buffer + sorpid, &treeHeight, sotreeh);
-									return 0;
-								}
-							}
-						}
-					}
+				PageId child;
+				if((result=nln.readChildPtr(c,child))<0)
+					return result;
+				below.push_back(child);
 			}
+			if((result=pf.freePage(level[i]))<0)
+				return result;
+		}
+		level.swap(below);
+	}
 
-    return 0;
+	//the first key and the # of entries of every leaf node. an empty
+	//leaf node goes under the last key before it
+	vector<LevelNode> nodes;
+	PageId pid=level[0], prev=0;
+	int key=INT_MIN;
+	while(pid!=0)
+	{
+		BTLeafNode ln(nodeFormat,pageSize);
+		LevelNode node;
+		RecordId rid;
+		if((result=ln.read(pid,pf))<0)
+			return result;
+		if(ln.getKeyCount()>0)
+			ln.readEntry(0,key,rid);
+		node.key=key;
+		node.pid=pid;
+		node.count=ln.getKeyCount();
+		nodes.push_back(node);
+		if(ln.getKeyCount()>0)
+			ln.readEntry(ln.getKeyCount()-1,key,rid);
+		prev=pid;
+		pid=ln.getNextNodePtr();
+	}
+
+	PageId root;
+	int height=1;
+	counted=true;
+	if((result=buildInnerLevels(nodes,BTNonLeafNode::getMaxKeyCount(counted,pageSize),prev,root,height))<0)
+		return result;
+	rootPid=root;
+	treeHeight=height;
+	deadTails=false;
+	return writeHeader();
 }
 
-/**
- * Run the standard B+Tree key search algorithm and identify the
- * leaf node where searchKey may exist. If an index entry with
- * searchKey exists in the leaf node, set IndexCursor to its location
- * (i.e., IndexCursor.pid = PageId of the leaf node, and
- * IndexCursor.eid = the searchKey index entry number.) and return 0.
- * If not, set IndexCursor.pid = PageId of the leaf node and
- * IndexCursor.eid = the index entry immediately after the largest
- * index key that is smaller than searchKey, and return the error
- * code RC_NO_SUCH_RECORD.
- * Using the returned "IndexCursor", you will have to call readForward()
- * to retrieve the actual (key, rid) pair from the index.
- * @param key[IN] the key to find
- * @param cursor[OUT] the cursor pointing to the index entry with
- *                    searchKey or immediately behind the largest key
- *                    smaller than searchKey.
- * @return 0 if searchKey is found. Othewise an error code
+/*
+ * Save rootPid, treeHeight, the node format and the flags to the page with pid=0.
+ * @return error code. 0 if no error
  */
-RC BTreeIndex::locate(int searchKey, IndexCursor& cursor)
+RC BTreeIndex::writeHeader()
 {
-		int result;
-		if(treeHeight == 0)  //empty tree
+    int magic=INDEX_MAGIC;
+    int format=nodeFormat;
+    int flags=(prevLinks ? INDEX_PREV_LINKS : 0)|(deadTails ? 0 : INDEX_NO_DEAD_TAILS)|(counted ? INDEX_COUNTS : 0);
+    PageId root=rootPid;
+    int height=treeHeight;
+    memcpy(&tree_buffer[0], &root, sorpid);
+    memcpy(&tree_buffer[0] + sorpid, &height, sotreeh);
+    memcpy(&tree_buffer[0] + soheader, &magic, sizeof(magic));
+    memcpy(&tree_buffer[0] + soheader + sizeof(magic), &format, sizeof(format));
+    memcpy(&tree_buffer[0] + soheader + sizeof(magic) + sizeof(format), &flags, sizeof(flags));
+    return pf.write(0, &tree_buffer[0]);
+}
+
+/*
+ * Return the version latch of a node.
+ * @param pid[IN] the node
+ * @return the latch guarding the node
+ */
+atomic<unsigned>& BTreeIndex::latchOf(PageId pid)
+{
+    return latches[(unsigned)pid%LATCH_STRIPES];  //pid may come from a node read while it changed
+}
+
+/*
+ * Insert (key, RecordId) pair to the index.
+ * The non-leaf nodes on the way from the root to the leaf are remembered,
+ * so that a split can be carried up without reading them again. If the
+ * tree counts entries, every one of them counts one more entry under the
+ * child taken and is written; otherwise only the leaf is written, unless
+ * it splits. The header page is written only when the tree grows a new root.
+ * Before a node is written, it is latched if its keys or pointers change,
+ * and so is the root information if the root will be split. The counts
+ * alone change under the count latch, which lookups do not check.
+ * @param key[IN] the key for the value inserted into the index
+ * @param rid[IN] the RecordId for the record being inserted into the index
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::insert(int key, const RecordId& rid)
+{
+		RC result;
+		lock_guard<mutex> guard(writeLock);
+		LatchSet latched;
+		if(treeHeight == 0)  //the tree is empty
 		{
-			return RC_NO_SUCH_RECORD;
+			BTLeafNode ln(nodeFormat,pageSize); // create the first node
+			PageId firstpid;
+			if((result=ln.insert(key,rid))<0)
+				return result;
+			if((result=pf.allocatePage(firstpid,1))<0)  //page 1 in a new file, page 0 keeps rootPid and treeHeight
+				return result;
+			if((result=ln.write(firstpid,pf))<0)  //write the first node back to page
+				return result;
+			latched.add(rootLatch);
+			rootPid=firstpid;
+			treeHeight = 1; //update treeHeight and rootPid in page
+			prevLinks=true;
+			deadTails=false;
+			return writeHeader();
+		}
+
+		//go down to the leaf node, remembering the path and whether every node on it is full
+		vector<PageId> path;
+		vector<int> slots;  //the child pointer taken in each node on the path
+		bool full=true;
+		PageId pid=rootPid;
+		for(int i=1;i<treeHeight;i++)
+		{
+			BTNonLeafNode nln(nodeFormat,counted,pageSize);
+			int slot;
+			if((result=readInner(pid,nln))<0)
+				return result;
+			path.push_back(pid);
+			full=full&&(nln.getKeyCount()>=nln.getMaxKeyCount());
+			if((result=nln.locateChildPtr(key,pid,slot))<0)
+				return result;
+			slots.push_back(slot);
+		}
+
+		BTLeafNode ln(nodeFormat,pageSize);
+		if((result=ln.read(pid,pf))<0)
+			return result;
+		latched.add(latchOf(pid));
+		if(counted)
+			latched.add(countLatch);
+
+		bool split=false;  //whether the node below the one carried up to was split
+		PageId siblingpid;
+		int siblingKey;
+		int leftCount, siblingCount;  //the # of entries in the node split and in its sibling
+		if((result=ln.insert(key,rid))==0)   //there is enough space for this (key, RecordId) pair
+		{
+			if((result=ln.write(pid,pf))<0)  //write back to page
+				return result;
 		}
-		else if(treeHeight == 1)  //when root node is the leaf node
+		else if(result!=RC_NODE_FULL)
+			return result;
+		else
+		{
+			if(full)  //the split reaches up to the root
+				latched.add(rootLatch);
+
+			//the leaf node is full, split it and link the sibling after it
+			BTLeafNode sibling(nodeFormat,pageSize);
+			if((result=ln.insertAndSplit(key,rid,sibling,siblingKey))<0)
+				return result;
+			if((result=pf.allocatePage(siblingpid,pid))<0)  //next to the leaf node, for scans
+				return result;
+			PageId nextpid=ln.getNextNodePtr();
+			sibling.setNextNodePtr(nextpid);
+			sibling.setPrevNodePtr(pid);
+			ln.setNextNodePtr(siblingpid);
+			if((result=sibling.write(siblingpid,pf))<0)  //write sibling node back to page
+				return result;
+			if(nextpid!=0)  //the leaf node after the sibling points back to it
 			{
-				BTLeafNode ln;
-				if((result=ln.read(rootPid,pf))<0)  //read page file
+				BTLeafNode next(nodeFormat,pageSize);
+				latched.add(latchOf(nextpid));
+				if((result=next.read(nextpid,pf))<0)
+					return result;
+				next.setPrevNodePtr(siblingpid);
+				if((result=next.write(nextpid,pf))<0)
 					return result;
-				if((result=ln.locate(searchKey,cursor.eid))<0)   //locate searchKey
+			}
+			if((result=ln.write(pid,pf))<0)  //write current leaf node back to page
+				return result;
+			split=true;
+			leftCount=ln.getKeyCount();
+			siblingCount=sibling.getKeyCount();
+		}
+
+		//count the entry in every parent. after a split, insert (siblingKey, siblingpid) into
+		//the parent right after the node split, splitting the parents as long as they are full.
+		//the key alone may not tell where among equal keys
+		PageId leftpid=pid;
+		while(!path.empty()&&(split||counted))
+		{
+			PageId parentpid=path.back();
+			int slot=slots.back();
+			path.pop_back();
+			slots.pop_back();
+			BTNonLeafNode nln(nodeFormat,counted,pageSize);
+			if((result=readInner(parentpid,nln))<0)
+				return result;
+			if(!split)  //one more entry under the child taken
+			{
+				int count;
+				nln.readChildCount(slot,count);
+				nln.setChildCount(slot,count+1);
+			}
+			else if(nln.getKeyCount()<nln.getMaxKeyCount()) //there is enough space for this siblingKey
+			{
+				latched.add(latchOf(parentpid));
+				nln.setChildCount(slot,leftCount);
+				if((result=nln.insert(siblingKey,siblingpid,slot,siblingCount))<0)
 					return result;
-				cursor.pid=rootPid;
+				split=false;
 			}
-		else  //when treeHeight is larger than 1, start from root node
+			else
 			{
-				BTNonLeafNode nln;
-				int pid=rootPid;
-				for(int i=1;i<treeHeight;i++)   //travesal the tree to leaf node
-				{
-					if((result=nln.read(pid,pf))<0)  //read page file
+				BTNonLeafNode siblingnln(nodeFormat,counted,pageSize);
+				int midKey;
+				latched.add(latchOf(parentpid));
+				nln.setChildCount(slot,leftCount);
+				if((result=nln.insertAndSplit(siblingKey,siblingpid,slot,siblingCount,siblingnln,midKey))<0)
 					return result;
-					if((result=nln.locateChildPtr(searchKey,pid))<0)   //locate searchKey
+				nln.remove(nln.getKeyCount()-1);  //midKey moves up, and the pointer after it is the first of the sibling
+				if((result=nln.write(parentpid,pf))<0)  //write original node back to page
 					return result;
-				}
-				BTLeafNode ln;   //when reach leaf node
-				if((result=ln.read(pid,pf))<0)  //read page file
+				if((result=pf.allocatePage(siblingpid,parentpid))<0)
 					return result;
-				if((result=ln.locate(searchKey,cursor.eid))<0)   //locate searchKey
+				if((result=siblingnln.write(siblingpid,pf))<0)  //write sibling back to page
 					return result;
-				cursor.pid=pid;
-				
+				cacheInner(siblingpid,siblingnln);
+				cacheInner(parentpid,nln);
+				siblingKey=midKey;
+				leftpid=parentpid;
+				leftCount=nln.getEntryCount();
+				siblingCount=siblingnln.getEntryCount();
+				continue;
 			}
-    return 0;
+			if((result=nln.write(parentpid,pf))<0)  //write back to page
+				return result;
+			cacheInner(parentpid,nln);
+		}
+		if(!split)
+			return 0;
+
+		//the root was split, create new root
+		BTNonLeafNode root(nodeFormat,counted,pageSize);
+		PageId newroot;
+		root.initializeRoot(leftpid,siblingKey,siblingpid);
+		root.setChildCount(0,leftCount);
+		root.setChildCount(1,siblingCount);
+		if((result=pf.allocatePage(newroot,leftpid))<0)
+			return result;
+		if((result=root.write(newroot,pf))<0)  //write new rootNode back to page
+			return result;
+		rootPid=newroot;
+		innerRoot=cacheInner(newroot,root);
+		treeHeight=treeHeight+1; //update treeHeight and rootPid in page
+		return writeHeader();
 }
 
 /*
- * Read the (key, rid) pair at the location specified by the index cursor,
- * and move foward the cursor to the next entry.
- * @param cursor[IN/OUT] the cursor pointing to an leaf-node index entry in the b+tree
- * @param key[OUT] the key stored at the index cursor location.
- * @param rid[OUT] the RecordId stored at the index cursor location.
+ * Insert all (key, RecordId) pairs of entries to the index.
+ * If the index is empty, the tree is built bottom-up in a single
+ * sequential write pass. Otherwise the pairs are inserted in key order.
+ * @param entries[IN] the pairs to insert. sort() must not have been called.
  * @return error code. 0 if no error
  */
-RC BTreeIndex::readForward(IndexCursor& cursor, int& key, RecordId& rid)
+RC BTreeIndex::bulkLoad(EntrySorter& entries)
 {
-	  int result;
-	  BTLeafNode ln;
-      if((result=ln.read(cursor.pid,pf))<0)  //read page file specified by the index cursor
-          return result;
-      if(cursor.eid<ln.getKeyCount())   //the entry is in this node
-          {
-              if((result=ln.readEntry(cursor.eid,key,rid))<0)  //read the (key, rid) pair
-				  return result;
-              cursor.eid++;   //move foward the cursor to the next entry
-              return 0;
-          }
-		//cursor.eid=ln.getKeyCount(), which means the entry is not in this node, move the cursor to next one
-      else //the entry is not in this node
-      {
-        if(ln.getNextNodePtr()==0) //reach the last leaf node in the tree
-          return RC_END_OF_TREE;
-		cursor.pid=ln.getNextNodePtr();  // move the cursor to next one in next page
-		cursor.eid=0;
-		if((result=ln.read(cursor.pid,pf))<0)  //read page file specified by the index cursor
-          return result;
-		if((result=ln.readEntry(cursor.eid,key,rid))<0)  //read the (key, rid) pair
-				  return result;
-		cursor.eid++;   //move foward the cursor to the next entry 
-		return 0;
-      }
-}
+	RC result;
+	int key;
+	RecordId rid;
+
+	if((result=entries.sort())<0)
+		return result;
 
+	//the tree already has entries, insert the new ones in key order
+	unique_lock<mutex> guard(writeLock);
+	if(treeHeight != 0)
+	{
+		guard.unlock();
+		while((result=entries.next(key,rid)) == 0)
+		{
+			if((result=insert(key,rid))<0)
+				return result;
+		}
+		return (result == RC_END_OF_ENTRIES) ? 0 : result;
+	}
+
+	PageId root;
+	int height;
+	if((result=buildTree(entries,BTLeafNode::getMaxKeyCount(nodeFormat,pageSize),
+	                     BTNonLeafNode::getMaxKeyCount(counted,pageSize),root,height))<0)
+		return result;
+	if(height == 0)  //nothing to load
+		return 0;
+
+	//update rootPid and treeHeight in page with pid=0
+	LatchSet latched;
+	latched.add(rootLatch);
+	rootPid=root;
+	treeHeight=height;
+	prevLinks=true;
+	deadTails=false;
+	if((result=writeHeader())<0)
+		return result;
+	return pinInner ? loadInnerLevels() : 0;
+}
+
+/*
+ * Build a tree bottom-up from sorted pairs: the leaf nodes first, each
+ * pointing to the next and to the previous one, and then each non-leaf
+ * level. Every page is taken next to the one written before it, so the
+ * tree is written from page 1 on in a new file, and over the free pages
+ * closest to the start otherwise. The header page is not written.
+ * @param entries[IN] the pairs, sort() already called
+ * @param leafKeys[IN] the # of pairs in a leaf node, except the last one
+ * @param nonLeafKeys[IN] the maximum # of keys in a non-leaf node
+ * @param root[OUT] the root of the tree
+ * @param height[OUT] the height of the tree. 0 if there is no pair
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::buildTree(EntrySorter& entries, int leafKeys, int nonLeafKeys,
+                         PageId& root, int& height)
+{
+	RC result, wresult;
+	int key;
+	RecordId rid;
+
+	vector<LevelNode> nodes;  //the leaf nodes
+	PageId pid, prev=0;   //page 0 keeps rootPid and treeHeight
+	height=0;
+
+	//pack the sorted pairs into leaf nodes. the page of the next leaf node
+	//is taken before a leaf node is written, to point to it
+	result=entries.next(key,rid);
+	if((result == 0)&&((wresult=pf.allocatePage(pid,1))<0))
+		return wresult;
+	while(result == 0)
+	{
+		BTLeafNode ln(nodeFormat,pageSize);
+		PageId next=0;  //0 marks the last leaf node
+		LevelNode node;
+		node.key=key;
+		node.pid=pid;
+		while((result == 0)&&(ln.getKeyCount()<leafKeys))
+		{
+			//a packed leaf node may fill up early, the pair then starts the next one
+			if((wresult=ln.insert(key,rid))==RC_NODE_FULL)
+				break;
+			if(wresult<0)
+				return wresult;
+			result=entries.next(key,rid);
+		}
+		if((result<0)&&(result!=RC_END_OF_ENTRIES))
+			return result;
+		if((result == 0)&&((wresult=pf.allocatePage(next,pid))<0))
+			return wresult;
+		ln.setNextNodePtr(next);
+		ln.setPrevNodePtr(prev);  //the first leaf node gets 0 as well
+		if((wresult=ln.write(pid,pf))<0)
+			return wresult;
+		node.count=ln.getKeyCount();
+		nodes.push_back(node);
+		prev=pid;
+		pid=next;
+	}
+	if(result != RC_END_OF_ENTRIES)
+		return result;
+	if(nodes.empty())  //nothing to load
+		return 0;
+
+	height=1;
+	return buildInnerLevels(nodes,nonLeafKeys,prev,root,height);
+}
+
+/*
+ * Build the non-leaf levels on top of a level until only the root is
+ * left. Children are spread evenly over the nodes so that every node has
+ * at least two of them, and each node counts the entries under them.
+ * @param nodes[IN] the nodes of the level, in key order. It is used up
+ * @param nonLeafKeys[IN] the maximum # of keys in a non-leaf node
+ * @param prev[IN] the page written last, the nodes are written next to it
+ * @param root[OUT] the root of the tree
+ * @param height[IN/OUT] the height of the level, then of the tree
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::buildInnerLevels(vector<LevelNode>& nodes, int nonLeafKeys,
+                                PageId prev, PageId& root, int& height)
+{
+	RC result;
+	PageId pid;
+	while(nodes.size()>1)
+	{
+		vector<LevelNode> upper;
+		int n=nodes.size();
+		int max_keys=nonLeafKeys;
+		int count=(n+max_keys)/(max_keys+1);  //# nodes needed on this level
+		int i=0;
+		for(int j=0;j<count;j++)
+		{
+			int children=n/count+((j<n%count) ? 1 : 0);
+			BTNonLeafNode nln(nodeFormat,counted,pageSize);
+			LevelNode node;
+			nln.initializeRoot(nodes[i].pid,nodes[i+1].key,nodes[i+1].pid);
+			for(int c=2;c<children;c++)
+			{
+				if((result=nln.insert(nodes[i+c].key,nodes[i+c].pid,c-1))<0)
+					return result;
+			}
+			node.count=0;
+			for(int c=0;c<children;c++)
+			{
+				nln.setChildCount(c,nodes[i+c].count);
+				node.count+=nodes[i+c].count;
+			}
+			if((result=pf.allocatePage(pid,prev))<0)
+				return result;
+			if((result=nln.write(pid,pf))<0)
+				return result;
+			node.key=nodes[i].key;
+			node.pid=pid;
+			upper.push_back(node);
+			prev=pid;
+			i=i+children;
+		}
+		nodes.swap(upper);
+		height++;
+	}
+	root=nodes[0].pid;
+	return 0;
+}
+
+struct BTreeIndex::PathStep {
+  PageId pid;   // the non-leaf node
+  int    slot;  // the position of the child pointer taken
+};
+
+/*
+ * Remove the (key, rid) pair from the index.
+ * The path from the root is remembered as by insert(). Pairs with the
+ * same key may lie in several leaf nodes, so the path moves on to the
+ * next leaf node until the pair is found. A leaf node left less than
+ * half full takes a pair from the sibling before it or after it under
+ * the same parent, or is merged with one of them if both are at half.
+ * The nodes that change are latched before anything is written, except
+ * for those whose counts alone change, as by insert().
+ * @param key[IN] the key of the pair to remove
+ * @param rid[IN] the RecordId of the pair to remove
+ * @return error code. RC_NO_SUCH_RECORD if the pair is not in the index
+ */
+RC BTreeIndex::remove(int key, const RecordId& rid)
+{
+	RC result;
+	lock_guard<mutex> guard(writeLock);
+	LatchSet latched;
+	if(treeHeight == 0)  //the tree is empty
+		return RC_NO_SUCH_RECORD;
+
+	//go down to the first leaf node that may hold key
+	vector<PathStep> path;
+	PageId pid=rootPid;
+	for(int i=1;i<treeHeight;i++)
+	{
+		BTNonLeafNode nln(nodeFormat,counted,pageSize);
+		PathStep step;
+		if((result=readInner(pid,nln))<0)
+			return result;
+		step.pid=pid;
+		if((result=nln.locateFirstChildPtr(key,pid,step.slot))<0)
+			return result;
+		path.push_back(step);
+	}
+
+	//look for rid among the pairs with key
+	BTLeafNode ln(nodeFormat,pageSize);
+	int eid;
+	for(;;)
+	{
+		int k;
+		RecordId r;
+		if((result=ln.read(pid,pf))<0)
+			return result;
+		ln.locate(key,eid);
+		for(;eid<ln.getKeyCount();eid++)
+		{
+			if((result=ln.readEntry(eid,k,r))<0)
+				return result;
+			if(k!=key)
+				return RC_NO_SUCH_RECORD;
+			if(r==rid)
+				break;
+		}
+		if(eid<ln.getKeyCount())
+			break;
+		if((result=nextLeaf(path,pid))<0)
+			return result;
+		if(pid==0)
+			return RC_NO_SUCH_RECORD;
+	}
+
+	latched.add(latchOf(pid));
+	if(counted)  //every node on the path counts one entry less
+		latched.add(countLatch);
+	if((result=ln.remove(eid))<0)
+		return result;
+	int minKeys=ln.getMaxKeyCount()/2;
+	if(path.empty()||(ln.getKeyCount()>=minKeys))  //the root may hold any # of pairs
+	{
+		if((result=ln.write(pid,pf))<0)
+			return result;
+		return uncount(path);
+	}
+
+	//the leaf node is less than half full, look at its siblings
+	PathStep& up=path.back();
+	BTNonLeafNode parent(nodeFormat,counted,pageSize);
+	if((result=readInner(up.pid,parent))<0)
+		return result;
+	latched.add(latchOf(up.pid));
+	BTLeafNode left(nodeFormat,pageSize), right(nodeFormat,pageSize);
+	PageId leftpid=0, rightpid=0;
+	if(up.slot>0)
+	{
+		if((result=parent.readChildPtr(up.slot-1,leftpid))<0)
+			return result;
+		if((result=left.read(leftpid,pf))<0)
+			return result;
+	}
+	if(up.slot<parent.getKeyCount())
+	{
+		if((result=parent.readChildPtr(up.slot+1,rightpid))<0)
+			return result;
+		if((result=right.read(rightpid,pf))<0)
+			return result;
+	}
+
+	int k;
+	RecordId r;
+	if((leftpid!=0)&&(left.getKeyCount()>minKeys))  //move the last pair of the left sibling over
+	{
+		latched.add(latchOf(leftpid));
+		left.readEntry(left.getKeyCount()-1,k,r);
+		left.remove(left.getKeyCount()-1);
+		ln.insert(k,r);
+		parent.setKey(up.slot-1,k);
+		parent.setChildCount(up.slot-1,left.getKeyCount());
+		parent.setChildCount(up.slot,ln.getKeyCount());
+		if(((result=left.write(leftpid,pf))<0)||((result=ln.write(pid,pf))<0))
+			return result;
+	}
+	else if((rightpid!=0)&&(right.getKeyCount()>minKeys))  //move the first pair of the right sibling over
+	{
+		latched.add(latchOf(rightpid));
+		right.readEntry(0,k,r);
+		right.remove(0);
+		ln.append(k,r);  //after the pairs with the same key
+		right.readEntry(0,k,r);
+		parent.setKey(up.slot,k);
+		parent.setChildCount(up.slot,ln.getKeyCount());
+		parent.setChildCount(up.slot+1,right.getKeyCount());
+		if(((result=right.write(rightpid,pf))<0)||((result=ln.write(pid,pf))<0))
+			return result;
+	}
+	else if((leftpid!=0)||(rightpid!=0))
+	{
+		//merge the right one of the two nodes into the left one, and drop it from the parent
+		BTLeafNode& into=(leftpid!=0) ? left : ln;
+		BTLeafNode& from=(leftpid!=0) ? ln : right;
+		PageId intopid=(leftpid!=0) ? leftpid : pid;
+		PageId frompid=(leftpid!=0) ? pid : rightpid;
+		int sep=(leftpid!=0) ? up.slot-1 : up.slot;
+		latched.add(latchOf(intopid));
+		latched.add(latchOf(frompid));
+		if((result=into.merge(from))==RC_NODE_FULL)
+		{
+			//packed leaf nodes may not fit in one, they are left as they are
+			if((result=ln.write(pid,pf))<0)
+				return result;
+			parent.setChildCount(up.slot,ln.getKeyCount());
+		}
+		else if(result<0)
+			return result;
+		else
+		{
+			PageId nextpid=from.getNextNodePtr();
+			into.setNextNodePtr(nextpid);
+			if(nextpid!=0)  //the leaf node after the two points back to the left one
+			{
+				BTLeafNode next(nodeFormat,pageSize);
+				latched.add(latchOf(nextpid));
+				if((result=next.read(nextpid,pf))<0)
+					return result;
+				next.setPrevNodePtr(intopid);
+				if((result=next.write(nextpid,pf))<0)
+					return result;
+			}
+			if((result=into.write(intopid,pf))<0)
+				return result;
+			if((result=pf.freePage(frompid))<0)
+				return result;
+			parent.setChildCount(sep,into.getKeyCount());
+			parent.remove(sep);
+		}
+	}
+	else  //the only child of its parent, left as it is
+	{
+		if((result=ln.write(pid,pf))<0)
+			return result;
+		parent.setChildCount(up.slot,ln.getKeyCount());
+	}
+
+	if((result=parent.write(up.pid,pf))<0)
+		return result;
+	cacheInner(up.pid,parent);
+	return rebalanceInner(path,latched);
+}
+
+/*
+ * Take a removed entry off the count of every node on the path, under
+ * the child pointer it took, if the tree counts entries. remove() holds
+ * the count latch.
+ * @param path[IN] the nodes whose counts are left to change
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::uncount(const vector<PathStep>& path)
+{
+	RC result;
+	if(!counted)
+		return 0;
+	for(size_t i=0;i<path.size();i++)
+	{
+		BTNonLeafNode nln(nodeFormat,counted,pageSize);
+		int count;
+		if((result=readInner(path[i].pid,nln))<0)
+			return result;
+		nln.readChildCount(path[i].slot,count);
+		nln.setChildCount(path[i].slot,count-1);
+		if((result=nln.write(path[i].pid,pf))<0)
+			return result;
+		cacheInner(path[i].pid,nln);
+	}
+	return 0;
+}
+
+/*
+ * Move the path to the leaf node after the one it leads to: up to the
+ * first node with a child after the one taken, and down along the first
+ * pointers from that child.
+ * @param path[IN/OUT] the path to a leaf node
+ * @param pid[OUT] the next leaf node. 0 if there is none
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::nextLeaf(vector<PathStep>& path, PageId& pid)
+{
+	RC result;
+	BTNonLeafNode nln(nodeFormat,counted,pageSize);
+	for(;;)
+	{
+		if(path.empty())
+		{
+			pid=0;
+			return 0;
+		}
+		if((result=readInner(path.back().pid,nln))<0)
+			return result;
+		if(path.back().slot<nln.getKeyCount())
+			break;
+		path.pop_back();
+	}
+
+	PathStep step;
+	if((result=nln.readChildPtr(++path.back().slot,pid))<0)
+		return result;
+	while((int)path.size()<treeHeight-1)
+	{
+		if((result=readInner(pid,nln))<0)
+			return result;
+		step.pid=pid;
+		step.slot=0;
+		path.push_back(step);
+		if((result=nln.readChildPtr(0,pid))<0)
+			return result;
+	}
+	return 0;
+}
+
+/*
+ * Refill the non-leaf node at the end of the path if it has fewer than
+ * half of its keys, as remove() does for leaf nodes. A key moves between
+ * siblings through their parent; a merge pulls the key between them down
+ * from the parent, which may then be refilled in turn. A root without
+ * keys is replaced by its only child. The parent counts the entries
+ * under the nodes changed anew, and once no node is left to refill, the
+ * nodes above count one entry less.
+ * @param path[IN] the path to the node, the node last
+ * @param latched[IN/OUT] the latches of the nodes changed so far
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::rebalanceInner(vector<PathStep>& path, LatchSet& latched)
+{
+	RC result;
+	while(!path.empty())
+	{
+		PathStep step=path.back();
+		path.pop_back();
+		BTNonLeafNode node(nodeFormat,counted,pageSize);
+		if((result=readInner(step.pid,node))<0)
+			return result;
+
+		if(path.empty())  //the root
+		{
+			if(node.getKeyCount()>0)
+				return 0;
+			//the root has a single child left, which becomes the root
+			PageId child;
+			if((result=node.readChildPtr(0,child))<0)
+				return result;
+			latched.add(rootLatch);
+			latched.add(latchOf(step.pid));
+			unordered_map<PageId,InnerNode*>::iterator it=innerNodes.find(child);
+			innerRoot=(it!=innerNodes.end()) ? it->second : NULL;
+			rootPid=child;
+			treeHeight=treeHeight-1;
+			retireInner(step.pid);
+			if((result=pf.freePage(step.pid))<0)
+				return result;
+			return writeHeader();
+		}
+
+		int minKeys=node.getMaxKeyCount()/2;
+		if(node.getKeyCount()>=minKeys)  //the nodes above only count one entry less
+			return uncount(path);
+
+		PathStep& up=path.back();
+		BTNonLeafNode parent(nodeFormat,counted,pageSize), left(nodeFormat,counted,pageSize), right(nodeFormat,counted,pageSize);
+		PageId leftpid=0, rightpid=0;
+		int leftsep, rightsep;
+		if((result=readInner(up.pid,parent))<0)
+			return result;
+		latched.add(latchOf(up.pid));
+		latched.add(latchOf(step.pid));
+		if(up.slot>0)
+		{
+			parent.readKey(up.slot-1,leftsep);
+			if((result=parent.readChildPtr(up.slot-1,leftpid))<0)
+				return result;
+			if((result=readInner(leftpid,left))<0)
+				return result;
+		}
+		if(up.slot<parent.getKeyCount())
+		{
+			parent.readKey(up.slot,rightsep);
+			if((result=parent.readChildPtr(up.slot+1,rightpid))<0)
+				return result;
+			if((result=readInner(rightpid,right))<0)
+				return result;
+		}
+
+		PageId p;
+		int k, c;
+		if((leftpid!=0)&&(left.getKeyCount()>minKeys))  //rotate the last pointer of the left sibling over
+		{
+			latched.add(latchOf(leftpid));
+			left.readChildPtr(left.getKeyCount(),p);
+			left.readChildCount(left.getKeyCount(),c);
+			left.readKey(left.getKeyCount()-1,k);
+			left.remove(left.getKeyCount()-1);
+			node.insertFirst(p,leftsep,c);
+			parent.setKey(up.slot-1,k);
+			parent.setChildCount(up.slot-1,left.getEntryCount());
+			parent.setChildCount(up.slot,node.getEntryCount());
+			if(((result=left.write(leftpid,pf))<0)||((result=node.write(step.pid,pf))<0))
+				return result;
+			cacheInner(leftpid,left);
+			cacheInner(step.pid,node);
+		}
+		else if((rightpid!=0)&&(right.getKeyCount()>minKeys))  //rotate the first pointer of the right sibling over
+		{
+			latched.add(latchOf(rightpid));
+			right.readChildPtr(0,p);
+			right.readChildCount(0,c);
+			right.readKey(0,k);
+			right.removeFirst();
+			node.insert(rightsep,p,node.getKeyCount(),c);
+			parent.setKey(up.slot,k);
+			parent.setChildCount(up.slot,node.getEntryCount());
+			parent.setChildCount(up.slot+1,right.getEntryCount());
+			if(((result=right.write(rightpid,pf))<0)||((result=node.write(step.pid,pf))<0))
+				return result;
+			cacheInner(rightpid,right);
+			cacheInner(step.pid,node);
+		}
+		else if((leftpid!=0)||(rightpid!=0))
+		{
+			//merge the right one of the two nodes into the left one, with the key between them
+			BTNonLeafNode& into=(leftpid!=0) ? left : node;
+			BTNonLeafNode& from=(leftpid!=0) ? node : right;
+			PageId intopid=(leftpid!=0) ? leftpid : step.pid;
+			PageId frompid=(leftpid!=0) ? step.pid : rightpid;
+			int sep=(leftpid!=0) ? up.slot-1 : up.slot;
+			int sepkey=(leftpid!=0) ? leftsep : rightsep;
+			latched.add(latchOf(intopid));
+			latched.add(latchOf(frompid));
+			from.readChildPtr(0,p);
+			from.readChildCount(0,c);
+			if((result=into.insert(sepkey,p,into.getKeyCount(),c))<0)
+				return result;
+			for(int i=0;i<from.getKeyCount();i++)
+			{
+				from.readKey(i,k);
+				from.readChildPtr(i+1,p);
+				from.readChildCount(i+1,c);
+				if((result=into.insert(k,p,into.getKeyCount(),c))<0)
+					return result;
+			}
+			if((result=into.write(intopid,pf))<0)
+				return result;
+			cacheInner(intopid,into);
+			retireInner(frompid);
+			if((result=pf.freePage(frompid))<0)
+				return result;
+			parent.setChildCount(sep,into.getEntryCount());
+			parent.remove(sep);
+		}
+		else  //the only child of its parent
+			parent.setChildCount(up.slot,node.getEntryCount());
+
+		if((result=parent.write(up.pid,pf))<0)
+			return result;
+		cacheInner(up.pid,parent);
+	}
+	return 0;
+}
+
+/*
+ * Rebuild the tree with its nodes filled to fillFactor.
+ * The pairs are read from the leaf nodes in key order and the tree is
+ * written again by buildTree() over the pages of the old one, so a tree
+ * grown by inserts and shrunk by removes becomes dense and sequential
+ * again. The pages after the new tree stay free, and are cut off the
+ * file when it is closed. Every latch is held while the pages are written.
+ * @param fillFactor[IN] how full the nodes are made, from 0 to 1
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::compact(double fillFactor)
+{
+	RC result;
+	int key;
+	RecordId rid;
+	lock_guard<mutex> guard(writeLock);
+	if(treeHeight == 0)  //the tree is empty
+		return 0;
+
+	//collect the pairs from the first leaf node on
+	EntrySorter entries;
+	PageId pid=rootPid;
+	for(int i=1;i<treeHeight;i++)
+	{
+		BTNonLeafNode nln(nodeFormat,counted,pageSize);
+		if((result=readInner(pid,nln))<0)
+			return result;
+		if((result=nln.readChildPtr(0,pid))<0)
+			return result;
+	}
+	while(pid!=0)
+	{
+		BTLeafNode ln(nodeFormat,pageSize);
+		if((result=ln.read(pid,pf))<0)
+			return result;
+		for(int i=0;i<ln.getKeyCount();i++)
+		{
+			ln.readEntry(i,key,rid);
+			if((result=entries.add(key,rid))<0)
+				return result;
+		}
+		pid=ln.getNextNodePtr();
+	}
+	if((result=entries.sort())<0)
+		return result;
+
+	int leafKeys=(int)(fillFactor*BTLeafNode::getMaxKeyCount(nodeFormat,pageSize)+0.5);
+	int nonLeafKeys=(int)(fillFactor*BTNonLeafNode::getMaxKeyCount(counted,pageSize)+0.5);
+	leafKeys=max(1,min(leafKeys,BTLeafNode::getMaxKeyCount(nodeFormat,pageSize)));
+	nonLeafKeys=max(1,min(nonLeafKeys,BTNonLeafNode::getMaxKeyCount(counted,pageSize)));
+
+	//every page of the tree is rewritten, readers wait for all of them
+	LatchSet latched;
+	latched.add(rootLatch);
+	latched.add(countLatch);
+	for(int i=0;i<LATCH_STRIPES;i++)
+		latched.add(latches[i]);
+
+	//the new tree takes the pages of the old one from the start of the file
+	for(PageId p=1;p<pf.endPid();p++)
+	{
+		if((result=pf.freePage(p))<0)
+			return result;
+	}
+	PageId root;
+	int height;
+	if((result=buildTree(entries,leafKeys,nonLeafKeys,root,height))<0)
+		return result;
+	unordered_map<PageId,InnerNode*>::iterator it;
+	for(it=innerNodes.begin();it!=innerNodes.end();it++)  //readers may still be on the old copies
+		retired.push_back(it->second);
+	innerNodes.clear();
+	innerRoot=NULL;
+	rootPid=(height == 0) ? -1 : root;
+	treeHeight=height;
+	prevLinks=true;
+	if((result=writeHeader())<0)
+		return result;
+	return (pinInner&&(height>0)) ? loadInnerLevels() : 0;
+}
+
+/**
+ * Run the standard B+Tree key search algorithm and identify the
+ * leaf node where searchKey may exist. If an index entry with
+ * searchKey exists in the leaf node, set IndexCursor to its location
+ * (i.e., IndexCursor.pid = PageId of the leaf node, and
+ * IndexCursor.eid = the searchKey index entry number.) and return 0.
+ * If not, set IndexCursor.pid = PageId of the leaf node and
+ * IndexCursor.eid = the index entry immediately after the largest
+ * index key that is smaller than searchKey, and return the error
+ * code RC_NO_SUCH_RECORD.
+ * Using the returned "IndexCursor", you will have to call readForward()
+ * to retrieve the actual (key, rid) pair from the index.
+ * @param key[IN] the key to find
+ * @param cursor[OUT] the cursor pointing to the index entry with
+ *                    searchKey or immediately behind the largest key
+ *                    smaller than searchKey.
+ * @return 0 if searchKey is found. Othewise an error code
+ */
+RC BTreeIndex::locate(int searchKey, IndexCursor& cursor)
+{
+		RC result;
+		while((result=descend(searchKey,false,cursor)) == RESTART)  //a writer changed a node on the way
+			;
+		return result;
+}
+
+/*
+ * Find the last index entry with a key not larger than searchKey, to
+ * read the entries up to searchKey backward with readBackward().
+ * @param searchKey[IN] the largest key to read
+ * @param cursor[OUT] the cursor pointing to that entry
+ * @return 0 if the key of that entry is searchKey. Othewise an error code
+ */
+RC BTreeIndex::locateLast(int searchKey, IndexCursor& cursor)
+{
+		RC result;
+		while((result=descend(searchKey,true,cursor)) == RESTART)  //a writer changed a node on the way
+			;
+		return result;
+}
+
+/*
+ * Count the entries with keys from lo to hi, as the entries up to hi
+ * less those before lo. Each of the two is found by one descent.
+ * @param lo[IN] the smallest key to count
+ * @param hi[IN] the largest key to count
+ * @param count[OUT] the # of entries with lo <= key <= hi
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::countRange(int lo, int hi, int& count)
+{
+		RC result;
+		int before, upto;
+		count=0;
+		if(!counted)  //the non-leaf nodes do not count entries
+			return RC_INVALID_FILE_FORMAT;
+		if(lo>hi)
+			return 0;
+		while((result=descendRank(hi,true,upto)) == RESTART)  //a writer changed a node on the way
+			;
+		if(result<0)
+			return result;
+		while((result=descendRank(lo,false,before)) == RESTART)
+			;
+		if(result<0)
+			return result;
+		count=max(0,upto-before);  //a remove may have come in between
+		return 0;
+}
+
+/*
+ * Return the # of entries with keys smaller than searchKey.
+ * @param searchKey[IN] the key
+ * @param rank[OUT] the # of entries with smaller keys
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::rank(int searchKey, int& rank)
+{
+		RC result;
+		rank=0;
+		if(!counted)  //the non-leaf nodes do not count entries
+			return RC_INVALID_FILE_FORMAT;
+		while((result=descendRank(searchKey,false,rank)) == RESTART)  //a writer changed a node on the way
+			;
+		return result;
+}
+
+/*
+ * Set the cursor to the n-th entry in key order, counting from 0.
+ * @param n[IN] the entry number
+ * @param cursor[OUT] the cursor pointing to the entry
+ * @return error code. RC_NO_SUCH_RECORD if there are not that many entries
+ */
+RC BTreeIndex::locateNth(int n, IndexCursor& cursor)
+{
+		RC result;
+		if(!counted)  //the non-leaf nodes do not count entries
+			return RC_INVALID_FILE_FORMAT;
+		while((result=descendNth(n,cursor)) == RESTART)  //a writer changed a node on the way
+			;
+		return result;
+}
+
+/*
+ * One attempt of locate(). Each node is read optimistically: its version
+ * is taken before the node is read, and the version of the parent is
+ * checked again after the pointer to the child has been taken from it.
+ * Nothing read from a node is trusted before its version is checked.
+ * @param key[IN] the key to find
+ * @param last[IN] find the entry as locateLast() instead of locate()
+ * @param cursor[OUT] the cursor set as by locate() or locateLast()
+ * @return the result of locate() or locateLast(), or RESTART if it has to be retried
+ */
+RC BTreeIndex::descend(int searchKey, bool last, IndexCursor& cursor)
+{
+		int result;
+		cursor.version=NO_VERSION;
+		cursor.key=searchKey;
+		cursor.rid.pid=-1;
+		cursor.rid.sid=-1;
+		atomic<unsigned>* latch=&rootLatch;
+		unsigned version=readLatch(rootLatch);
+		PageId pid=rootPid;
+		int height=treeHeight;
+		InnerNode* node=innerRoot;  //the copy in memory of the node at pid, if there is one
+		if(height == 0)  //empty tree
+			return validate(rootLatch,version) ? RC_NO_SUCH_RECORD : RESTART;
+
+		//travesal the tree to leaf node, from the root node
+		for(int i=1;i<=height;i++)
+		{
+			atomic<unsigned>& child=latchOf(pid);
+			unsigned childversion=readLatch(child);
+			if(!validate(*latch,version))  //pid may have been read from a changing parent
+				return RESTART;
+			latch=&child;
+			version=childversion;
+			if(i == height)
+				break;
+			BTNonLeafNode nln(nodeFormat,counted,pageSize);
+			if(node!=NULL)  //no need to read page file
+				nln.view(node->page);
+			else if((result=nln.read(pid,pf))<0)  //read page file
+				return validate(*latch,version) ? result : RESTART;
+			int eid;
+			if(last)
+				result=nln.locateChildPtr(searchKey,pid,eid);
+			else  //pairs with a key equal to a separator may be left of it after a remove
+				result=nln.locateFirstChildPtr(searchKey,pid,eid);
+			if(result<0)
+				return validate(*latch,version) ? result : RESTART;
+			if(node!=NULL)
+				node=node->children[eid].load(memory_order_relaxed);
+		}
+
+		BTLeafNode ln(nodeFormat,pageSize);   //when reach leaf node
+		if((result=ln.read(pid,pf))<0)  //read page file
+			return validate(*latch,version) ? result : RESTART;
+		if(last)
+			result=ln.locateLast(searchKey,cursor.eid);
+		else
+			result=ln.locate(searchKey,cursor.eid);   //locate searchKey
+		//every key of the leaf is smaller (larger for last), the entry is in the next (previous) leaf
+		PageId sibling=0;
+		if(!last&&(cursor.eid>=ln.getKeyCount()))
+			sibling=ln.getNextNodePtr();
+		else if(last&&(cursor.eid<0)&&prevLinks)
+			sibling=ln.getPrevNodePtr();
+		if(!validate(*latch,version))
+			return RESTART;
+		cursor.pid=pid;
+		if(!last)
+			cursor.version=version;
+		if(sibling==0)
+			return result;
+
+		atomic<unsigned>& siblingLatch=latchOf(sibling);
+		version=readLatch(siblingLatch);
+		if((result=ln.read(sibling,pf))<0)
+			return validate(siblingLatch,version) ? result : RESTART;
+		if(last)
+			result=ln.locateLast(searchKey,cursor.eid);
+		else
+			result=ln.locate(searchKey,cursor.eid);
+		if(!validate(siblingLatch,version))
+			return RESTART;
+		cursor.pid=sibling;
+		if(!last)
+			cursor.version=version;
+		return result;
+}
+
+/*
+ * One attempt of rank(), reading and validating the nodes as descend()
+ * does. On every level, the entries under the children before the one
+ * followed are added up, and at the leaf node the entries before the one
+ * searchKey would go to. Entries equal to searchKey may lie in the child
+ * before a key equal to it, so that child is followed unless they are counted.
+ * The counts may change without the latches of their nodes, so the count
+ * latch is checked as well.
+ * @param searchKey[IN] the key
+ * @param inclusive[IN] count the entries with searchKey as well
+ * @param count[OUT] the # of entries before searchKey, or up to it if inclusive
+ * @return error code, or RESTART if it has to be retried
+ */
+RC BTreeIndex::descendRank(int searchKey, bool inclusive, int& count)
+{
+		int result;
+		unsigned counts=readLatch(countLatch);
+		atomic<unsigned>* latch=&rootLatch;
+		unsigned version=readLatch(rootLatch);
+		PageId pid=rootPid;
+		int height=treeHeight;
+		InnerNode* node=innerRoot;  //the copy in memory of the node at pid, if there is one
+		count=0;
+		if(height == 0)  //empty tree
+			return validate(rootLatch,version) ? 0 : RESTART;
+
+		for(int i=1;i<=height;i++)
+		{
+			atomic<unsigned>& child=latchOf(pid);
+			unsigned childversion=readLatch(child);
+			if(!validate(*latch,version))  //pid may have been read from a changing parent
+				return RESTART;
+			latch=&child;
+			version=childversion;
+			if(i == height)
+				break;
+			BTNonLeafNode nln(nodeFormat,counted,pageSize);
+			if(node!=NULL)  //no need to read page file
+				nln.view(node->page);
+			else if((result=nln.read(pid,pf))<0)  //read page file
+				return validate(*latch,version) ? result : RESTART;
+			int eid;
+			if(inclusive)
+				result=nln.locateChildPtr(searchKey,pid,eid);
+			else
+				result=nln.locateFirstChildPtr(searchKey,pid,eid);
+			if(result<0)
+				return validate(*latch,version) ? result : RESTART;
+			count+=nln.countBefore(eid);
+			if(node!=NULL)
+				node=node->children[eid].load(memory_order_relaxed);
+		}
+
+		BTLeafNode ln(nodeFormat,pageSize);
+		int eid;
+		if((result=ln.read(pid,pf))<0)  //read page file
+			return validate(*latch,version) ? result : RESTART;
+		if(inclusive)
+			ln.locateLast(searchKey,eid);
+		else
+			ln.locate(searchKey,eid);
+		if(!validate(*latch,version)||!validate(countLatch,counts))
+			return RESTART;
+		count+=inclusive ? eid+1 : eid;
+		return 0;
+}
+
+/*
+ * One attempt of locateNth(), reading and validating the nodes as
+ * descend() does, and the count latch as descendRank() does. On every level,
+ * the child that holds the entry is found from the counts, and the entries
+ * before it are taken off n.
+ * @param n[IN] the entry number
+ * @param cursor[OUT] the cursor pointing to the entry
+ * @return error code, or RESTART if it has to be retried
+ */
+RC BTreeIndex::descendNth(int n, IndexCursor& cursor)
+{
+		int result;
+		unsigned counts=readLatch(countLatch);
+		atomic<unsigned>* latch=&rootLatch;
+		unsigned version=readLatch(rootLatch);
+		PageId pid=rootPid;
+		int height=treeHeight;
+		InnerNode* node=innerRoot;  //the copy in memory of the node at pid, if there is one
+		if((height == 0)||(n<0))  //empty tree
+			return validate(rootLatch,version) ? RC_NO_SUCH_RECORD : RESTART;
+
+		for(int i=1;i<=height;i++)
+		{
+			atomic<unsigned>& child=latchOf(pid);
+			unsigned childversion=readLatch(child);
+			if(!validate(*latch,version))  //pid may have been read from a changing parent
+				return RESTART;
+			latch=&child;
+			version=childversion;
+			if(i == height)
+				break;
+			BTNonLeafNode nln(nodeFormat,counted,pageSize);
+			if(node!=NULL)  //no need to read page file
+				nln.view(node->page);
+			else if((result=nln.read(pid,pf))<0)  //read page file
+				return validate(*latch,version) ? result : RESTART;
+			int eid;
+			if((result=nln.locateChildByCount(n,pid,eid))<0)  //n is past the last entry
+				return (validate(*latch,version)&&validate(countLatch,counts)) ? result : RESTART;
+			if(node!=NULL)
+				node=node->children[eid].load(memory_order_relaxed);
+		}
+
+		BTLeafNode ln(nodeFormat,pageSize);
+		if((result=ln.read(pid,pf))<0)  //read page file
+			return validate(*latch,version) ? result : RESTART;
+		result=(n<ln.getKeyCount()) ? 0 : RC_NO_SUCH_RECORD;
+		if(!validate(*latch,version)||!validate(countLatch,counts))
+			return RESTART;
+		cursor.pid=pid;
+		cursor.eid=n;
+		cursor.version=NO_VERSION;
+		return result;
+}
+
+/*
+ * The keys of locateBatch() that go through a node.
+ */
+struct BTreeIndex::ProbeGroup {
+  PageId pid;         // the node
+  InnerNode* node;    // its copy in memory. NULL if it is not kept there
+  int lo, hi;         // the keys order[lo] .. order[hi-1] go through it
+  unsigned version;   // the version of the node when pid was taken
+};
+
+/*
+ * Run locate() for many keys at once, descending the tree once.
+ * @param keys[IN] the keys to find
+ * @param n[IN] the # of keys
+ * @param cursors[OUT] cursors[i] is set as by locate(keys[i], cursors[i])
+ * @param results[OUT] if not NULL, the result of locate() for every key
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::locateBatch(const int* keys, int n, IndexCursor* cursors, RC* results)
+{
+		RC result;
+		if(n <= 0)
+			return 0;
+		vector<RC> found;
+		if(results == NULL)
+		{
+			found.resize(n);
+			results=&found[0];
+		}
+
+		//visit the keys in key order, so that the keys under a node are next to each other
+		vector<int> order(n);
+		for(int i=0;i<n;i++)
+			order[i]=i;
+		stable_sort(order.begin(),order.end(),[keys](int a, int b) { return keys[a]<keys[b]; });
+
+		while((result=descendBatch(keys,order,cursors,results)) == RESTART)  //the root changed on the way
+			;
+		return result;
+}
+
+/*
+ * One attempt of locateBatch(), one level at a time. On every level,
+ * each node is read once for all keys that go through it and the keys
+ * are split among its children. The nodes of the next level that are
+ * not in memory are read ahead together.
+ * Each node is validated as in descend(). The keys under a node that
+ * changed, and the keys past the end of their leaf node, are located
+ * one by one with locate().
+ * @param keys[IN] the keys to find
+ * @param order[IN] the positions of the keys in key order
+ * @param cursors[OUT] the cursors of the keys
+ * @param results[OUT] the results of the keys
+ * @return error code, or RESTART if it has to be retried
+ */
+RC BTreeIndex::descendBatch(const int* keys, const vector<int>& order,
+                            IndexCursor* cursors, RC* results)
+{
+		int result;
+		int n=order.size();
+		unsigned version=readLatch(rootLatch);
+		ProbeGroup root;
+		root.pid=rootPid;
+		root.node=innerRoot;
+		root.lo=0;
+		root.hi=n;
+		int height=treeHeight;
+		if(height == 0)  //empty tree
+		{
+			if(!validate(rootLatch,version))
+				return RESTART;
+			for(int i=0;i<n;i++)
+				results[i]=RC_NO_SUCH_RECORD;
+			return 0;
+		}
+		root.version=readLatch(latchOf(root.pid));
+		if(!validate(rootLatch,version))
+			return RESTART;
+
+		vector<ProbeGroup> level(1,root);
+		vector<int> retry;  //the keys under nodes that changed
+		for(int i=1;i<height;i++)  //split the keys among the children of every non-leaf node on this level
+		{
+			vector<ProbeGroup> below;
+			for(size_t g=0;g<level.size();g++)
+			{
+				ProbeGroup& parent=level[g];
+				BTNonLeafNode nln(nodeFormat,counted,pageSize);
+				if(parent.node!=NULL)  //no need to read page file
+					nln.view(parent.node->page);
+				else if((result=nln.read(parent.pid,pf))<0)
+				{
+					if(validate(latchOf(parent.pid),parent.version))
+						return result;
+					for(int p=parent.lo;p<parent.hi;p++)  //pid was taken from a changing node
+						retry.push_back(order[p]);
+					continue;
+				}
+
+				size_t first=below.size();
+				for(int p=parent.lo;p<parent.hi;p++)
+				{
+					PageId pid;
+					int eid;
+					nln.locateFirstChildPtr(keys[order[p]],pid,eid);
+					if((below.size()>first)&&(below.back().pid == pid))  //same child as the key before
+					{
+						below.back().hi=p+1;
+						continue;
+					}
+					ProbeGroup child;
+					child.pid=pid;
+					child.node=(parent.node!=NULL) ? parent.node->children[eid].load(memory_order_relaxed) : NULL;
+					child.lo=p;
+					child.hi=p+1;
+					child.version=readLatch(latchOf(pid));
+					below.push_back(child);
+				}
+				if(!validate(latchOf(parent.pid),parent.version))  //the children may have been read from a changing node
+				{
+					below.resize(first);
+					for(int p=parent.lo;p<parent.hi;p++)
+						retry.push_back(order[p]);
+				}
+			}
+			level.swap(below);
+
+			//start reading the nodes of the next level
+			vector<PageId> ahead;
+			for(size_t g=0;g<level.size();g++)
+				if(level[g].node == NULL)
+					ahead.push_back(level[g].pid);
+			if(!ahead.empty())
+				pf.prefetch(&ahead[0],ahead.size());
+		}
+
+		//locate the keys in their leaf nodes
+		for(size_t g=0;g<level.size();g++)
+		{
+			ProbeGroup& leaf=level[g];
+			BTLeafNode ln(nodeFormat,pageSize);
+			if((result=ln.read(leaf.pid,pf))<0)
+			{
+				if(validate(latchOf(leaf.pid),leaf.version))
+					return result;
+				for(int p=leaf.lo;p<leaf.hi;p++)
+					retry.push_back(order[p]);
+				continue;
+			}
+			size_t past=retry.size();
+			for(int p=leaf.lo;p<leaf.hi;p++)
+			{
+				IndexCursor& cursor=cursors[order[p]];
+				results[order[p]]=ln.locate(keys[order[p]],cursor.eid);
+				cursor.pid=leaf.pid;
+				cursor.version=leaf.version;
+				cursor.key=keys[order[p]];
+				cursor.rid.pid=-1;
+				cursor.rid.sid=-1;
+				if(cursor.eid>=ln.getKeyCount())  //the key may start the next leaf, which locate() looks at
+					retry.push_back(order[p]);
+			}
+			if(!validate(latchOf(leaf.pid),leaf.version))
+			{
+				retry.resize(past);
+				for(int p=leaf.lo;p<leaf.hi;p++)
+					retry.push_back(order[p]);
+			}
+		}
+
+		for(size_t r=0;r<retry.size();r++)
+		{
+			results[retry[r]]=locate(keys[retry[r]],cursors[retry[r]]);
+			if((results[retry[r]]<0)&&(results[retry[r]]!=RC_NO_SUCH_RECORD))
+				return results[retry[r]];
+		}
+		return 0;
+}
+
+/*
+ * Read the (key, rid) pair at the location specified by the index cursor,
+ * and move foward the cursor to the next entry.
+ * The leaf node is read optimistically and read again if a writer
+ * changed it meanwhile.
+ * @param cursor[IN/OUT] the cursor pointing to an leaf-node index entry in the b+tree
+ * @param key[OUT] the key stored at the index cursor location.
+ * @param rid[OUT] the RecordId stored at the index cursor location.
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::readForward(IndexCursor& cursor, int& key, RecordId& rid)
+{
+	  int result;
+	  bool moved=false;  //the cursor was moved to the next leaf node
+	  BTLeafNode ln(nodeFormat,pageSize);
+	  for(;;)
+	  {
+		atomic<unsigned>& latch=latchOf(cursor.pid);
+		unsigned version=readLatch(latch);
+		if((result=ln.read(cursor.pid,pf))<0)  //read page file specified by the index cursor
+		{
+			if(validate(latch,version))
+				return result;
+			continue;
+		}
+		PageId next=ln.getNextNodePtr();
+		if(cursor.eid<ln.getKeyCount())   //the entry is in this node
+		{
+			result=ln.readEntry(cursor.eid,key,rid);  //read the (key, rid) pair
+			if(!validate(latch,version))
+				continue;
+			if(result<0)
+				return result;
+			if(moved&&(next!=0))  //start reading the leaf after this one while this one is scanned
+				pf.prefetch(&next,1);
+			cursor.eid++;   //move foward the cursor to the next entry
+			cursor.version=NO_VERSION;
+			return 0;
+		}
+		//cursor.eid=ln.getKeyCount(), which means the entry is not in this node, move the cursor to next one
+		if(!validate(latch,version))
+			continue;
+		if(next==0) //reach the last leaf node in the tree
+			return RC_END_OF_TREE;
+		cursor.pid=next;  // move the cursor to next one in next page
+		cursor.eid=0;
+		cursor.version=NO_VERSION;
+		moved=true;
+	  }
+}
+
+/*
+ * Read the (key, rid) pair at the location specified by the index cursor,
+ * and move backward the cursor to the previous entry.
+ * The leaf node is read optimistically as in readForward().
+ * @param cursor[IN/OUT] the cursor pointing to an leaf-node index entry in the b+tree
+ * @param key[OUT] the key stored at the index cursor location.
+ * @param rid[OUT] the RecordId stored at the index cursor location.
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::readBackward(IndexCursor& cursor, int& key, RecordId& rid)
+{
+	  int result;
+	  bool moved=false;  //the cursor was moved to the previous leaf node
+	  BTLeafNode ln(nodeFormat,pageSize);
+	  if(!prevLinks)  //the leaf nodes cannot be followed backward
+		  return RC_INVALID_FILE_FORMAT;
+	  for(;;)
+	  {
+		atomic<unsigned>& latch=latchOf(cursor.pid);
+		unsigned version=readLatch(latch);
+		if((result=ln.read(cursor.pid,pf))<0)  //read page file specified by the index cursor
+		{
+			if(validate(latch,version))
+				return result;
+			continue;
+		}
+		PageId prev=ln.getPrevNodePtr();
+		int eid=cursor.eid;
+		if(eid>=ln.getKeyCount())  //the last entry of this node
+			eid=ln.getKeyCount()-1;
+		if(eid>=0)   //the entry is in this node
+		{
+			result=ln.readEntry(eid,key,rid);  //read the (key, rid) pair
+			if(!validate(latch,version))
+				continue;
+			if(result<0)
+				return result;
+			if(moved&&(prev!=0))  //start reading the leaf before this one while this one is scanned
+				pf.prefetch(&prev,1);
+			cursor.eid=eid-1;   //move backward the cursor to the previous entry
+			cursor.version=NO_VERSION;
+			return 0;
+		}
+		//the entry is not in this node, move the cursor to the last entry of the previous one
+		if(!validate(latch,version))
+			continue;
+		if(prev==0) //reach the first leaf node in the tree
+			return RC_END_OF_TREE;
+		cursor.pid=prev;
+		cursor.eid=INT_MAX;
+		cursor.version=NO_VERSION;
+		moved=true;
+	  }
+}
+
+/*
+ * Read up to max (key, rid) pairs with keys up to endKey and move
+ * forward the cursor past them. The pairs of a leaf node are taken
+ * from a single read of it, which is validated as in the other
+ * readForward() and taken again if a writer changed the node.
+ * The cursor keeps the version of its leaf node and the last pair taken.
+ * If the node changed since, entries may have shifted under eid, and
+ * the cursor is set again after that pair by relocate().
+ * @param cursor[IN/OUT] the cursor pointing to an leaf-node index entry in the b+tree
+ * @param endKey[IN] the largest key to return
+ * @param entries[OUT] the (key, rid) pairs read
+ * @param max[IN] the size of entries
+ * @param n[OUT] the # of pairs read. fewer than max at the end of the scan
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::readForward(IndexCursor& cursor, int endKey, IndexEntry* entries, int max, int& n)
+{
+	  int result;
+	  bool moved=false;  //the cursor was moved to the next leaf node
+	  BTLeafNode ln(nodeFormat,pageSize);
+	  n=0;
+	  while(n<max)
+	  {
+		atomic<unsigned>& latch=latchOf(cursor.pid);
+		unsigned version=readLatch(latch);
+		if(((cursor.version&1)==0)&&(cursor.version!=version))  //eid may no longer be the entry after the last pair
+		{
+			if((result=relocate(cursor))<0)
+				return (result==RC_END_OF_TREE) ? 0 : result;
+			continue;
+		}
+		if((result=ln.read(cursor.pid,pf))<0)  //read page file specified by the index cursor
+		{
+			if(validate(latch,version))
+				return result;
+			continue;
+		}
+
+		//take the pairs of this node up to endKey
+		int count=ln.getKeyCount();
+		int eid=cursor.eid;
+		int taken=n;
+		bool end=false;  //a key after endKey was found
+		while(!end&&(taken<max)&&(eid<count))
+		{
+			//decode the pairs a run at a time, which a packed node does several at once
+			int keys[SCAN_RUN];
+			RecordId rids[SCAN_RUN];
+			int run=min(SCAN_RUN,min(max-taken,count-eid));
+			if(ln.readEntries(eid,run,keys,rids)<0)  //changed by a writer, read it again
+				break;
+			for(int i=0;i<run;i++)
+			{
+				if(keys[i]>endKey)
+				{
+					end=true;
+					break;
+				}
+				entries[taken].key=keys[i];
+				entries[taken].rid=rids[i];
+				taken++;
+				eid++;
+			}
+		}
+		PageId next=ln.getNextNodePtr();
+		unsigned nextversion=(next!=0) ? readLatch(latchOf(next)) : NO_VERSION;  //taken while the pointer to it is valid
+		if(!validate(latch,version))  //read the node again
+			continue;
+
+		if(moved&&(next!=0))  //start reading the leaf after this one while this one is scanned
+			pf.prefetch(&next,1);
+		moved=false;
+		if(taken>n)  //the place of the cursor if the node changes
+		{
+			cursor.key=entries[taken-1].key;
+			cursor.rid=entries[taken-1].rid;
+		}
+		n=taken;
+		cursor.eid=eid;
+		cursor.version=version;
+		if(end||(n==max))
+			return 0;
+		if(next==0) //reach the last leaf node in the tree
+			return 0;
+		cursor.pid=next;  // move the cursor to next one in next page
+		cursor.eid=0;
+		cursor.version=nextversion;
+		moved=true;
+	  }
+	  return 0;
+}
+
+/*
+ * Set the cursor set by the batch readForward() to its entry again.
+ * The first entry with the key of the cursor is found with locate().
+ * If the cursor is after a pair, the entries with that key are then
+ * read in order, a leaf node at a time, until the pair is found. If
+ * the pair is not there any more, the cursor is left at the first
+ * entry with its key.
+ * @param cursor[IN/OUT] the cursor to set again
+ * @return error code. RC_END_OF_TREE if the tree is empty
+ */
+RC BTreeIndex::relocate(IndexCursor& cursor)
+{
+	  RC result;
+	  IndexCursor first;
+	  BTLeafNode ln(nodeFormat,pageSize);
+	  for(;;)
+	  {
+		result=locate(cursor.key,first);
+		if((result<0)&&(result!=RC_NO_SUCH_RECORD))
+			return result;
+		if((first.version&1)!=0)  //the tree is empty
+			return RC_END_OF_TREE;
+		if(cursor.rid.pid<0)  //the cursor is at the first entry with the key
+			break;
+
+		//look for the pair among the entries with its key
+		IndexCursor at=first;
+		bool found=false;
+		bool changed=false;
+		while(!found&&!changed)
+		{
+			atomic<unsigned>& latch=latchOf(at.pid);
+			unsigned version=readLatch(latch);
+			if((version!=at.version)||(ln.read(at.pid,pf)<0))
+			{
+				changed=true;
+				break;
+			}
+			int count=ln.getKeyCount();
+			bool past=false;  //an entry with a larger key was found
+			int key;
+			RecordId rid;
+			for(;(at.eid<count)&&!found&&!past;at.eid++)
+			{
+				if(ln.readEntry(at.eid,key,rid)<0)
+					break;
+				past=(key!=cursor.key);
+				found=!past&&(rid.pid==cursor.rid.pid)&&(rid.sid==cursor.rid.sid);
+			}
+			PageId next=ln.getNextNodePtr();
+			unsigned nextversion=(next!=0) ? readLatch(latchOf(next)) : NO_VERSION;
+			if(!validate(latch,version))
+			{
+				changed=true;
+				break;
+			}
+			if(found)
+				break;
+			if(past||(next==0)||((nextversion&1)!=0))  //the pair is not in the tree
+				break;
+			at.pid=next;
+			at.eid=0;
+			at.version=nextversion;
+		}
+		if(changed)  //a writer changed a node on the way
+			continue;
+		if(found)
+		{
+			cursor.pid=at.pid;
+			cursor.eid=at.eid;
+			cursor.version=at.version;
+			return 0;
+		}
+		break;
+	  }
+	  cursor.pid=first.pid;
+	  cursor.eid=first.eid;
+	  cursor.version=first.version;
+	  return 0;
+}
 
 //for test
 /*RC BTreeIndex::show(BTreeIndex &bindex)
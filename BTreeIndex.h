@@ -13,37 +13,101 @@
 #include "Bruinbase.h"
 #include "PageFile.h"
 #include "RecordFile.h"
+#include "EntrySorter.h"
+#include "BTreeNode.h"
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
              
 /**
  * The data structure to point to a particular entry at a b+tree leaf node.
  * An IndexCursor consists of pid (PageId of the leaf node) and 
  * eid (the location of the index entry inside the node).
  * IndexCursor is used for index lookup and traversal.
+ * The batch readForward() also keeps the version of the leaf node and
+ * the place of the entry by key, to find the entry again if a writer
+ * shifted the entries of the node.
  */
 typedef struct {
   // PageId of the index entry
   PageId  pid;  
   // The entry number inside the node
   int     eid;  
+  // The version of the leaf node when eid was found. Odd if not known
+  unsigned version;
+  // The entry is the one after the pair (key, rid), or the first one
+  // with a key not smaller than key if rid.pid is -1
+  int      key;
+  RecordId rid;
 } IndexCursor;
 
+class LatchSet;  // the node latches held by a writer, in BTreeIndex.cc
+
 /**
  * Implements a B-Tree index for bruinbase.
- * 
+ * Any number of threads may call locate() and readForward() while one
+ * other thread inserts or removes. Readers take no locks: every node has
+ * a version latch, and a reader checks that the versions of the nodes it
+ * read did not change meanwhile, starting over if they did. A writer
+ * latches only the nodes whose keys or pointers it modifies, so readers
+ * of other subtrees never wait. In an index that counts entries, the
+ * counts it changes further up are guarded by one more latch, which
+ * only countRange(), rank() and locateNth() check.
  */
 class BTreeIndex {
  public:
   BTreeIndex();
+  ~BTreeIndex();
 
   /**
    * Open the index file in read or write mode.
    * Under 'w' mode, the index file should be created if it does not exist.
+   * Under 'm' mode, the index file is memory-mapped for reading.
+   * The node format is read from the header page. A new index file
+   * gets the format set by setDefaultFormat(). An index written before
+   * leaf nodes pointed to the previous ones gets these pointers when it
+   * is opened in 'w' mode, and loses the keys that its splits left behind.
+   * An index whose non-leaf nodes do not count the entries under their
+   * children gets the counts if it is opened in 'w' mode after
+   * setCountEntries(true).
    * @param indexname[IN] the name of the index file
-   * @param mode[IN] 'r' for read, 'w' for write
+   * @param mode[IN] 'r' for read, 'w' for write, 'm' for memory-mapped read
    * @return error code. 0 if no error
    */
   RC open(const std::string& indexname, char mode);
 
+  /**
+   * Choose the node format of index files created from now on.
+   * Existing index files keep the format they were created with.
+   * @param format[IN] the layout of the nodes
+   */
+  static void setDefaultFormat(NodeFormat format);
+
+  /**
+   * Choose whether the indexes opened from now on keep their non-leaf
+   * nodes in memory. They are then loaded when the index is opened and
+   * updated by every insert, and a lookup reads only its leaf node
+   * from the index file.
+   * @param pin[IN] true to keep the non-leaf nodes in memory
+   */
+  static void setPinInnerLevels(bool pin);
+
+  /**
+   * Choose whether index files created from now on count the entries
+   * under each child in their non-leaf nodes, for countRange(), rank()
+   * and locateNth(). Every insert and remove then writes the non-leaf
+   * nodes on its path as well, and they hold fewer keys. Off by default.
+   * @param count[IN] true to count the entries
+   */
+  static void setCountEntries(bool count);
+
+  /**
+   * Return the node format of the open index.
+   * @return the layout of the nodes
+   */
+  NodeFormat getFormat() const;
+
   /**
    * Close the index file.
    * @return error code. 0 if no error
@@ -52,12 +116,49 @@ class BTreeIndex {
     
   /**
    * Insert (key, RecordId) pair to the index.
+   * Inserts from several threads are carried out one at a time.
    * @param key[IN] the key for the value inserted into the index
    * @param rid[IN] the RecordId for the record being inserted into the index
    * @return error code. 0 if no error
    */
   RC insert(int key, const RecordId& rid);
 
+  /**
+   * Insert all (key, RecordId) pairs of entries to the index.
+   * If the index is empty, the pairs are sorted and the tree is built
+   * bottom-up: packed leaf nodes first and then each non-leaf level,
+   * in a single sequential write pass. Otherwise the pairs are inserted
+   * one by one in key order.
+   * @param entries[IN] the pairs to insert. sort() must not have been called.
+   * @return error code. 0 if no error
+   */
+  RC bulkLoad(EntrySorter& entries);
+
+  /**
+   * Remove the (key, rid) pair from the index.
+   * A leaf node left less than half full borrows an entry from a sibling
+   * next to it, or is merged with it if the sibling cannot spare one, and
+   * so on up the tree; a root left with a single child is replaced by it.
+   * The pages of merged nodes are given back to the PageFile and are
+   * used again by later inserts. Readers may run meanwhile, but a cursor on a leaf node
+   * that is merged away becomes invalid; locate() again after a remove.
+   * @param key[IN] the key of the pair to remove
+   * @param rid[IN] the RecordId of the pair to remove
+   * @return error code. RC_NO_SUCH_RECORD if the pair is not in the index
+   */
+  RC remove(int key, const RecordId& rid);
+
+  /**
+   * Rebuild the tree bottom-up with its nodes filled to fillFactor of
+   * their capacity, in key order from the first page on. The pages left
+   * over are free, and those at the end of the file are cut off when the
+   * index is closed. Readers wait until the rebuild is over, and every
+   * cursor becomes invalid.
+   * @param fillFactor[IN] how full the nodes are made, from 0 to 1
+   * @return error code. 0 if no error
+   */
+  RC compact(double fillFactor);
+
   /**
    * Run the standard B+Tree key search algorithm and identify the
    * leaf node where searchKey may exist. If an index entry with
@@ -78,9 +179,74 @@ class BTreeIndex {
    */
   RC locate(int searchKey, IndexCursor& cursor);
 
+  /**
+   * Find the last index entry with a key not larger than searchKey and
+   * set IndexCursor to it. If every key is larger than searchKey, the
+   * cursor is set before the first entry. Using the returned cursor,
+   * readBackward() retrieves the (key, rid) pairs in descending key order,
+   * e.g. from locateLast(INT_MAX, cursor) the largest key first.
+   * @param searchKey[IN] the largest key to read
+   * @param cursor[OUT] the cursor pointing to that index entry
+   * @return 0 if the key of that entry is searchKey. Othewise, an error code
+   */
+  RC locateLast(int searchKey, IndexCursor& cursor);
+
+  /**
+   * Run locate() for many keys at once. The keys are sorted and the tree
+   * is descended once for all of them: every node on the way to the keys
+   * is read at most once, and the leaf nodes of a level are read ahead
+   * together. The keys can be in any order and may repeat.
+   * Nothing in Bruinbase calls it yet, since its SQL has no IN lists or
+   * joins; btreebench ("make bench") compares its page reads with locate().
+   * @param keys[IN] the keys to find
+   * @param n[IN] the # of keys
+   * @param cursors[OUT] cursors[i] is set as by locate(keys[i], cursors[i])
+   * @param results[OUT] if not NULL, results[i] is 0 if keys[i] is found
+   *                     and RC_NO_SUCH_RECORD if not
+   * @return error code. 0 if no error
+   */
+  RC locateBatch(const int* keys, int n, IndexCursor* cursors, RC* results = NULL);
+
+  /**
+   * Count the index entries with keys from lo to hi. Every non-leaf node
+   * counts the entries under each of its children, so only the nodes on
+   * the way to lo and to hi are read, however many entries are counted.
+   * An entry inserted or removed by another thread meanwhile may or may
+   * not be counted.
+   * @param lo[IN] the smallest key to count
+   * @param hi[IN] the largest key to count
+   * @param count[OUT] the # of entries with lo <= key <= hi
+   * @return error code. RC_INVALID_FILE_FORMAT for an index whose non-leaf
+   *         nodes do not count entries, see setCountEntries()
+   */
+  RC countRange(int lo, int hi, int& count);
+
+  /**
+   * Find the rank of a key, the # of index entries with smaller keys,
+   * reading only the nodes on the way to the key.
+   * @param searchKey[IN] the key
+   * @param rank[OUT] the # of entries with keys smaller than searchKey
+   * @return error code. RC_INVALID_FILE_FORMAT as by countRange()
+   */
+  RC rank(int searchKey, int& rank);
+
+  /**
+   * Set the cursor to the n-th index entry in key order, counting from 0,
+   * so that readForward() reads the n-th smallest key and the ones after it.
+   * Only the nodes on the way to the entry are read.
+   * @param n[IN] the entry number
+   * @param cursor[OUT] the cursor pointing to the entry
+   * @return error code. RC_NO_SUCH_RECORD if there are not that many entries,
+   *         and RC_INVALID_FILE_FORMAT as by countRange()
+   */
+  RC locateNth(int n, IndexCursor& cursor);
+
   /**
    * Read the (key, rid) pair at the location specified by the index cursor,
    * and move foward the cursor to the next entry.
+   * While another thread inserts, no entry is skipped, but an insert
+   * into the leaf node under the cursor shifts its entries, so an entry
+   * that was already returned may be returned again.
    * @param cursor[IN/OUT] the cursor pointing to an leaf-node index entry in the b+tree
    * @param key[OUT] the key stored at the index cursor location
    * @param rid[OUT] the RecordId stored at the index cursor location
@@ -88,18 +254,285 @@ class BTreeIndex {
    */
   RC readForward(IndexCursor& cursor, int& key, RecordId& rid);
 
+  /**
+   * Read the (key, rid) pair at the location specified by the index cursor,
+   * and move backward the cursor to the previous entry, following the
+   * previous pointers of the leaf nodes.
+   * An insert by another thread into the leaf node under the cursor may
+   * make the scan miss entries of that node.
+   * @param cursor[IN/OUT] the cursor pointing to an leaf-node index entry in the b+tree
+   * @param key[OUT] the key stored at the index cursor location
+   * @param rid[OUT] the RecordId stored at the index cursor location
+   * @return error code. RC_END_OF_TREE before the first entry, and
+   *         RC_INVALID_FILE_FORMAT for an index opened in 'r' or 'm' mode
+   *         that was written before leaf nodes had previous pointers
+   */
+  RC readBackward(IndexCursor& cursor, int& key, RecordId& rid);
+
+  /**
+   * Read up to max (key, rid) pairs with keys up to endKey, starting at
+   * the location specified by the index cursor, and move forward the
+   * cursor past them. Each leaf node is read once per call, and the
+   * leaf node after it is read ahead when the scan moves on to it.
+   * The scan is over when fewer than max pairs are returned.
+   * If a writer changed the leaf node under the cursor between two
+   * calls, the scan goes on after the last pair it returned, found again
+   * from the root, so no pair is returned twice. Only if that pair was
+   * removed meanwhile are the pairs with its key read again.
+   * @param cursor[IN/OUT] the cursor pointing to an leaf-node index entry in the b+tree
+   * @param endKey[IN] the largest key to return
+   * @param entries[OUT] the (key, rid) pairs read
+   * @param max[IN] the size of entries
+   * @param n[OUT] the # of pairs read
+   * @return error code. 0 if no error
+   */
+  RC readForward(IndexCursor& cursor, int endKey, IndexEntry* entries, int max, int& n);
+
 //for test
 //RC show(BTreeIndex &bindex);
 
   
  private:
+  static const int LATCH_STRIPES = 1024;  /// # of node latches. page pid uses latches[pid % LATCH_STRIPES]
+
+  /**
+   * One attempt of locate(). It gives up as soon as a node it read
+   * turns out to have been changed by a writer.
+   * @return the result of locate(), or RESTART if it has to be retried
+   */
+  RC descend(int searchKey, bool last, IndexCursor& cursor);
+
+  /**
+   * One attempt of rank(), which gives up as descend() does.
+   * @param inclusive[IN] count the entries with searchKey as well
+   * @param count[OUT] the # of entries before searchKey, or up to it if inclusive
+   * @return error code, or RESTART if it has to be retried
+   */
+  RC descendRank(int searchKey, bool inclusive, int& count);
+
+  /**
+   * One attempt of locateNth(), which gives up as descend() does.
+   * @return the result of locateNth(), or RESTART if it has to be retried
+   */
+  RC descendNth(int n, IndexCursor& cursor);
+
+  /**
+   * A non-leaf node on the way from the root to a leaf node,
+   * and the position of the child pointer taken.
+   */
+  struct PathStep;
+
+  /**
+   * Move the path to the leaf node after the one it leads to.
+   * @param path[IN/OUT] the path to a leaf node
+   * @param pid[OUT] the next leaf node. 0 if there is none
+   * @return error code. 0 if no error
+   */
+  RC nextLeaf(std::vector<PathStep>& path, PageId& pid);
+
+  /**
+   * Refill a non-leaf node that a remove left less than half full from
+   * its siblings, merging it with one of them if they have nothing to
+   * spare, and carry the merge up the path. The nodes above the last
+   * one changed count one entry less.
+   * @param path[IN] the path to the node, the node last
+   * @param latched[IN/OUT] the latches of the nodes changed so far
+   * @return error code. 0 if no error
+   */
+  RC rebalanceInner(std::vector<PathStep>& path, LatchSet& latched);
+
+  /**
+   * Count one entry less under the child pointer taken by every node on
+   * the path, if the tree counts entries.
+   * @param path[IN] the nodes, written under the count latch
+   * @return error code. 0 if no error
+   */
+  RC uncount(const std::vector<PathStep>& path);
+
+  /**
+   * A node of a level built by buildTree(): its first key, its page
+   * and the # of entries under it.
+   */
+  struct LevelNode;
+
+  /**
+   * Write the tree of sorted pairs bottom-up, on pages taken one next to
+   * the other from page 1 on: the leaf nodes with leafKeys pairs each,
+   * linked both ways, then every non-leaf level.
+   * The header page is left alone.
+   * @param entries[IN] the pairs, sort() already called
+   * @param leafKeys[IN] the # of pairs in each leaf node but the last
+   * @param nonLeafKeys[IN] the most keys in a non-leaf node
+   * @param root[OUT] the root of the new tree
+   * @param height[OUT] the height of the new tree. 0 if there is no pair
+   * @return error code. 0 if no error
+   */
+  RC buildTree(EntrySorter& entries, int leafKeys, int nonLeafKeys,
+               PageId& root, int& height);
+
+  /**
+   * Write the non-leaf levels on top of a level of nodes, bottom-up,
+   * next to the page written last.
+   * @param nodes[IN] the nodes of the level in key order. It is used up
+   * @param nonLeafKeys[IN] the most keys in a non-leaf node
+   * @param prev[IN] the page written last
+   * @param root[OUT] the root of the new tree
+   * @param height[IN/OUT] the height of the level, then of the new tree
+   * @return error code. 0 if no error
+   */
+  RC buildInnerLevels(std::vector<LevelNode>& nodes, int nonLeafKeys,
+                      PageId prev, PageId& root, int& height);
+
+  /**
+   * Stop keeping a non-leaf node that left the tree in memory. Readers
+   * may still be on the copy, so it is deleted only when the index closes.
+   * @param pid[IN] the node
+   */
+  void retireInner(PageId pid);
+
+  /**
+   * The keys of locateBatch() that go through a node: sorted keys
+   * lo .. hi-1, and the version of the node when its pid was taken.
+   */
+  struct ProbeGroup;
+
+  /**
+   * One attempt of locateBatch(). The keys under a node that turns out
+   * to have been changed by a writer are handed to locate() instead.
+   * @param order[IN] the positions of the keys in key order
+   * @return error code, or RESTART if it has to be retried
+   */
+  RC descendBatch(const int* keys, const std::vector<int>& order,
+                  IndexCursor* cursors, RC* results);
+
+  /**
+   * Return the version latch of a node.
+   * @param pid[IN] the node
+   * @return the latch guarding the node
+   */
+  std::atomic<unsigned>& latchOf(PageId pid);
+
+  /**
+   * A non-leaf node kept in memory: a copy of its page, and the copies
+   * of its children in the order of their pointers in the page. The
+   * children of the nodes right above the leaf nodes are NULL.
+   */
+  struct InnerNode {
+    /// room for the child pointers of any non-leaf node of a page of the size
+    InnerNode(int pageSize)
+      : page(new char[pageSize]), children(new std::atomic<InnerNode*>[pageSize/(sizeof(int)+sizeof(PageId))]) {
+      for (int i = 0; i < (int)(pageSize/(sizeof(int)+sizeof(PageId))); i++) children[i] = NULL;
+    }
+    ~InnerNode() { delete [] page; delete [] children; }
+
+    char* page;
+    std::atomic<InnerNode*>* children;
+
+   private:
+    InnerNode(const InnerNode&);
+    InnerNode& operator=(const InnerNode&);
+  };
+
+  /**
+   * Load all non-leaf nodes into memory.
+   * @return error code. 0 if no error
+   */
+  RC loadInnerLevels();
+
+  /**
+   * Drop the non-leaf nodes kept in memory.
+   */
+  void freeInnerLevels();
+
+  /**
+   * Read a non-leaf node for an insert, from memory if it is kept there.
+   * @param pid[IN] the node to read
+   * @param nln[OUT] the node
+   * @return error code. 0 if no error
+   */
+  RC readInner(PageId pid, BTNonLeafNode& nln);
+
+  /**
+   * Copy a non-leaf node that was just written to memory, if the
+   * non-leaf nodes are kept there.
+   * @param pid[IN] the node
+   * @param nln[IN] its new content
+   * @return the copy in memory. NULL if the nodes are not kept in memory
+   */
+  InnerNode* cacheInner(PageId pid, const BTNonLeafNode& nln);
+
+  /**
+   * Point the children of a node in memory to their copies.
+   * @param node[IN] the node
+   */
+  void linkChildren(InnerNode* node);
+
+  /**
+   * Save the root, the height and the node format to the header page.
+   * @return error code. 0 if no error
+   */
+  RC writeHeader();
+
+  /**
+   * Set the cursor to its entry again, after the leaf node under it
+   * changed, by locating its key and looking for its RecordId after it.
+   * @param cursor[IN/OUT] the cursor set by the batch readForward()
+   * @return error code. RC_END_OF_TREE if the tree is empty
+   */
+  RC relocate(IndexCursor& cursor);
+
+  /**
+   * Set the previous pointers of all leaf nodes of a tree written before
+   * leaf nodes had them.
+   * @return error code. 0 if no error
+   */
+  RC linkPrevLeaves();
+
+  /**
+   * Drop the key and pointer that splits by older versions left at the
+   * end of non-leaf nodes, which are never followed.
+   * @return error code. 0 if no error
+   */
+  RC trimDeadTails();
+
+  /**
+   * Write the non-leaf nodes of a tree that does not count the entries
+   * under their children again, with the counts.
+   * @return error code. 0 if no error
+   */
+  RC rebuildInnerLevels();
+
   PageFile pf;         /// the PageFile used to store the actual b+tree in disk
-  char tree_buffer[PageFile::PAGE_SIZE];
+  std::vector<char> tree_buffer;  /// the header page
+  int      pageSize;   /// the page size of the file, of the nodes and the header page
+
+  std::atomic<PageId> rootPid;  /// the PageId of the root node
+  std::atomic<int> treeHeight;  /// the height of the tree
+  NodeFormat nodeFormat;  /// the layout of the nodes of the tree
+  bool     prevLinks;  /// whether the leaf nodes point to the previous ones
+  bool     deadTails;  /// whether non-leaf nodes may end with a pointer left over by a split
+  bool     counted;    /// whether non-leaf nodes count the entries under their children
   
-  /// Note that the content of the above two variables will be gone when
-  /// this class is destructed. Make sure to store the values of the two 
-  /// variables in disk, so that they can be reconstructed when the index
-  /// is opened again later.
+  /// Note that the content of the above variables will be gone when
+  /// this class is destructed. They are stored in the header page (page 0)
+  /// whenever they change and reconstructed from it by open(), so every
+  /// BTreeIndex object can have its own index open.
+
+  /// versions of the nodes and of (rootPid, treeHeight). a version is odd
+  /// while a writer is changing what it guards
+  std::atomic<unsigned> latches[LATCH_STRIPES];
+  std::atomic<unsigned> rootLatch;
+  std::atomic<unsigned> countLatch;  /// the counts of non-leaf nodes whose latches are not taken
+  std::mutex writeLock;  /// held by the thread that is changing the tree
+
+  bool pinInner;  /// whether the non-leaf nodes are kept in memory
+  std::atomic<InnerNode*> innerRoot;  /// the root in memory. NULL if not kept or a leaf node
+  std::unordered_map<PageId, InnerNode*> innerNodes;  /// the nodes in memory, used by writers only
+  std::vector<InnerNode*> retired;  /// the nodes that left the tree, deleted by close()
+
+  static NodeFormat defaultFormat;  /// the layout of the nodes of new trees
+  static bool defaultPinInner;      /// whether indexes keep non-leaf nodes in memory
+  static bool defaultCounts;        /// whether the non-leaf nodes of new trees count entries
 };
 
 #endif /* BTREEINDEX_H */
@@ -1,23 +1,375 @@
 #include "BTreeNode.h"
 #include <string.h>
 #include <math.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <algorithm>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
-const int max_key_num = floor((PageFile::PAGE_SIZE - soi - sopid)/soent);  //the maximum number of keys in a node
-const int max_key_num_non = floor((PageFile::PAGE_SIZE - soi - sopid)/(soi + sopid));  //the maximum number of keys in a non-leaf node
+const int sorid = sizeof(RecordId);  //size of RecordId
+
+//
+// key search inside a node.
+// the keys of a node are sorted and stored at a fixed stride. a binary
+// search without branches narrows them down to a window of at most
+// SEARCH_WINDOW keys, which are then compared with the search key all at
+// once using the widest vector instructions the CPU supports.
+//
+
+const int SEARCH_WINDOW = 16;
+
+// count the keys in the window that come before searchKey: the keys
+// smaller than searchKey, or also those equal to it if inclusive is set.
+// the window is padded with INT_MAX up to SEARCH_WINDOW keys
+typedef int (*WindowCount)(const int* window, int searchKey, bool inclusive);
+
+static int countScalar(const int* window, int searchKey, bool inclusive)
+{
+	int count=0;
+	for(int i=0;i<SEARCH_WINDOW;i++)
+		count+=(window[i]<searchKey)|(inclusive&(window[i]==searchKey));
+	return count;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse4.2")))
+static int countSSE4(const int* window, int searchKey, bool inclusive)
+{
+	__m128i s=_mm_set1_epi32(searchKey);
+	int count=0;
+	for(int i=0;i<SEARCH_WINDOW;i+=4)
+	{
+		__m128i k=_mm_loadu_si128((const __m128i*)(window+i));
+		__m128i m=inclusive ? _mm_cmpgt_epi32(k,s) : _mm_cmpgt_epi32(s,k);  //keys after / keys before
+		count+=__builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(m)));
+	}
+	return inclusive ? SEARCH_WINDOW-count : count;
+}
+
+__attribute__((target("avx2")))
+static int countAVX2(const int* window, int searchKey, bool inclusive)
+{
+	__m256i s=_mm256_set1_epi32(searchKey);
+	int count=0;
+	for(int i=0;i<SEARCH_WINDOW;i+=8)
+	{
+		__m256i k=_mm256_loadu_si256((const __m256i*)(window+i));
+		__m256i m=inclusive ? _mm256_cmpgt_epi32(k,s) : _mm256_cmpgt_epi32(s,k);  //keys after / keys before
+		count+=__builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(m)));
+	}
+	return inclusive ? SEARCH_WINDOW-count : count;
+}
+#endif
+
+//pick the window comparison for the CPU we are running on
+static WindowCount pickWindowCount()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2"))
+		return countAVX2;
+	if(__builtin_cpu_supports("sse4.2"))
+		return countSSE4;
+#endif
+	return countScalar;
+}
+
+static const WindowCount windowCount=pickWindowCount();
+
+/*
+ * Count the keys that come before searchKey in a node.
+ * @param keys[IN] the first key of the node
+ * @param stride[IN] the distance in bytes between two keys
+ * @param n[IN] the number of keys
+ * @param searchKey[IN] the key to search for
+ * @param inclusive[IN] count the keys equal to searchKey as well
+ * @return the number of keys smaller than (or equal to) searchKey
+ */
+static int rankKey(const char* keys, int stride, int n, int searchKey, bool inclusive)
+{
+	//the keys before base come before searchKey, the keys from base+len on do not
+	int base=0;
+	int len=n;
+	while(len>SEARCH_WINDOW)
+	{
+		int half=len/2;
+		int key;
+		memcpy(&key,keys+(base+half-1)*stride,soi);
+		bool before=(key<searchKey)|(inclusive&(key==searchKey));
+		base=before ? base+half : base;  //compiles to a conditional move
+		len-=half;
+	}
+
+	int window[SEARCH_WINDOW];
+	for(int i=0;i<len;i++)
+		memcpy(&window[i],keys+(base+i)*stride,soi);
+	for(int i=len;i<SEARCH_WINDOW;i++)
+		window[i]=INT_MAX;
+
+	//with searchKey == INT_MAX, the padding counts as well
+	int count=windowCount(window,searchKey,inclusive);
+	return base+(count<len ? count : len);
+}
+
+//
+// the packed leaf format, see BTreeNode.h.
+// a key, PageId or sid is stored as its difference from the base of its
+// column, in the bits of the column. value i of a column starts at bit
+// i*bits and is read with one unaligned 8-byte load, so the page keeps
+// PACKED_SLACK bytes after the columns for the loads to stay inside it.
+//
+
+const int PACKED_NEXT=soi;                //the next node pointer
+const int PACKED_PREV=PACKED_NEXT+sopid;  //the previous node pointer
+const int PACKED_BASE=PACKED_PREV+sopid;  //the bases of the key, pid and sid columns
+const int PACKED_BITS=PACKED_BASE+3*soi;  //the bits of the three columns, a byte each
+const int PACKED_DATA=PACKED_BITS+soi;    //the columns
+const int PACKED_SLACK=sizeof(uint64_t);
+
+//half of a full node fits even if every value takes 32 bits, so a split
+//never fails. rounding up each column to whole bytes costs up to 3 bytes
+static int packedHalf(int pageSize)
+{ return (pageSize-PACKED_DATA-PACKED_SLACK-3)/(soi+sorid); }
+
+//the bases, the bits and the locations of the columns of a packed node
+struct PackedColumns {
+	int count;
+	unsigned base[3];
+	int bits[3];
+	int offset[3];
+};
+
+//the # of bytes a column of n values of bits takes
+static int columnBytes(int n, int bits)
+{ return (n*bits+7)/8; }
+
+//the # of bits a difference up to range needs
+static int bitsFor(unsigned range)
+{
+	int bits=0;
+	while((bits<32)&&((range>>bits)!=0))
+		bits++;
+	return bits;
+}
+
+/*
+ * Read the header of a packed node. A node read while a writer changed
+ * it may hold anything, so a header that leads out of the page gives an
+ * empty node.
+ * @param page[IN] the node
+ * @param capacity[IN] the maximum number of keys
+ * @param pageSize[IN] the size of the page
+ * @param c[OUT] the columns of the node
+ */
+static void readColumns(const char* page, int capacity, int pageSize, PackedColumns& c)
+{
+	int count;
+	int end=PACKED_DATA;
+	memcpy(&count,page,soi);
+	memcpy(c.base,page+PACKED_BASE,3*soi);
+	bool valid=(count>=0)&&(count<=capacity);
+	for(int i=0;i<3;i++)
+	{
+		c.bits[i]=(unsigned char)page[PACKED_BITS+i];
+		valid=valid&&(c.bits[i]<=32);
+		c.offset[i]=end;
+		if(valid)
+			end+=columnBytes(count,c.bits[i]);
+	}
+	if(!valid||(end>pageSize-PACKED_SLACK))
+	{
+		c.count=0;
+		c.bits[0]=c.bits[1]=c.bits[2]=0;
+		return;
+	}
+	c.count=count;
+}
+
+//value i of a column
+static unsigned extract(const char* column, int bits, int i)
+{
+	uint64_t word;
+	long bit=(long)i*bits;
+	memcpy(&word,column+(bit>>3),sizeof(word));
+	return (unsigned)((word>>(bit&7))&((((uint64_t)1)<<bits)-1));
+}
+
+//set value i of a column, whose bits must still be 0
+static void deposit(char* column, int bits, int i, unsigned value)
+{
+	uint64_t word;
+	long bit=(long)i*bits;
+	memcpy(&word,column+(bit>>3),sizeof(word));
+	word|=((uint64_t)value)<<(bit&7);
+	memcpy(column+(bit>>3),&word,sizeof(word));
+}
+
+// decode n values of a column from value first on, adding base to each.
+// every value is found from its own bit offset, so several are decoded at once
+typedef void (*ColumnDecode)(const char* column, int bits, unsigned base, int first, int n, int* out);
+
+static void decodeScalar(const char* column, int bits, unsigned base, int first, int n, int* out)
+{
+	for(int i=0;i<n;i++)
+		out[i]=(int)(base+extract(column,bits,first+i));
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2")))
+static void decodeAVX2(const char* column, int bits, unsigned base, int first, int n, int* out)
+{
+	const __m256i mask=_mm256_set1_epi64x((long long)((((uint64_t)1)<<bits)-1));
+	const __m256i step=_mm256_set1_epi64x(4LL*bits);
+	const __m256i low=_mm256_set1_epi64x(7);
+	const __m256i even=_mm256_setr_epi32(0,2,4,6,0,0,0,0);
+	const __m128i add=_mm_set1_epi32((int)base);
+	__m256i bit=_mm256_setr_epi64x((long long)first*bits,(long long)(first+1)*bits,
+	                               (long long)(first+2)*bits,(long long)(first+3)*bits);
+	int i=0;
+	for(;i+4<=n;i+=4)
+	{
+		//load the 8 bytes each value starts in, then shift and mask the value out
+		__m256i words=_mm256_i64gather_epi64((const long long*)column,_mm256_srli_epi64(bit,3),1);
+		__m256i values=_mm256_and_si256(_mm256_srlv_epi64(words,_mm256_and_si256(bit,low)),mask);
+		__m128i packed=_mm256_castsi256_si128(_mm256_permutevar8x32_epi32(values,even));
+		_mm_storeu_si128((__m128i*)(out+i),_mm_add_epi32(packed,add));
+		bit=_mm256_add_epi64(bit,step);
+	}
+	decodeScalar(column,bits,base,first+i,n-i,out+i);
+}
+#endif
+
+//pick the column decoder for the CPU we are running on
+static ColumnDecode pickColumnDecode()
+{
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2"))
+		return decodeAVX2;
+#endif
+	return decodeScalar;
+}
+
+static const ColumnDecode columnDecode=pickColumnDecode();
+
+/*
+ * Count the keys that come before searchKey in a packed node.
+ * @param page[IN] the node
+ * @param c[IN] the columns of the node
+ * @param searchKey[IN] the key to search for
+ * @param inclusive[IN] count the keys equal to searchKey as well
+ * @return the number of keys smaller than (or equal to) searchKey
+ */
+static int rankPacked(const char* page, const PackedColumns& c, int searchKey, bool inclusive)
+{
+	const char* keys=page+c.offset[0];
+	int base=0;
+	int len=c.count;
+	while(len>0)
+	{
+		int half=len/2;
+		int key=(int)(c.base[0]+extract(keys,c.bits[0],base+half));
+		bool before=(key<searchKey)|(inclusive&(key==searchKey));
+		base=before ? base+half+1 : base;
+		len=before ? len-half-1 : half;
+	}
+	return base;
+}
+
+//the content of a new node, with no keys
+static const char zeroPage[PageFile::MAX_PAGE_SIZE]={0};
+
 //Using constructor to for initialization
-BTLeafNode::BTLeafNode()
+BTLeafNode::BTLeafNode(NodeFormat format, int pageSize)
 {
-	for(int i=0;i<PageFile::PAGE_SIZE;i++)
+	this->format=format;
+	this->pageSize=pageSize;
+	capacity=getMaxKeyCount(format,pageSize);
+	buffer=NULL;
+	page=zeroPage;
+	pinFile=NULL;
+}//the buffer is allocated when the node is changed
+
+BTLeafNode::~BTLeafNode()
+{ release();
+	delete [] buffer; }
+
+/*
+ * Return the maximum number of keys a leaf node of the format can hold.
+ * The first two formats keep num_of_keys and the next and previous node pointers
+ * next to the entries.
+ * A packed node holds up to twice the entries that fit uncompressed, less one,
+ * so that each half of a full node fits uncompressed.
+ */
+int BTLeafNode::getMaxKeyCount(NodeFormat format, int pageSize)
+{
+	if(format==NODE_PACKED)
+		return 2*packedHalf(pageSize)-1;
+	return (pageSize - soi - 2*sopid)/(soi + sorid);
+}
+
+//locations in the page, see the layouts in BTreeNode.h
+int BTLeafNode::keyOffset(int eid) const
+{
+	if(format==NODE_SOA)
+		return soi+eid*soi;
+	return soi+eid*soent+offsetof(entry,key);
+}
+
+int BTLeafNode::ridOffset(int eid) const
+{
+	if(format==NODE_SOA)
+		return soi+capacity*soi+eid*sorid;
+	return soi+eid*soent+offsetof(entry,rid);
+}
+
+int BTLeafNode::nextOffset() const
+{
+	if(format==NODE_PACKED)
+		return PACKED_NEXT;
+	return soi+capacity*(soi+sorid);
+}
+
+int BTLeafNode::prevOffset() const
+{ return nextOffset()+sopid; }
+
+int BTLeafNode::keyStride() const
+{ return (format==NODE_SOA) ? soi : soent; }
+
+/*
+ * Make the node modifiable: copy the pinned page to buffer and unpin it.
+ */
+void BTLeafNode::own()
+{
+	if(page!=buffer)
 	{
-		buffer[i]='\0';
+		if(buffer==NULL)
+			buffer=new char[pageSize];
+		memcpy(buffer,page,pageSize);
+		release();
 	}
-	int temp=0;
-	memcpy(buffer,&temp,soi);
-}//clear up the buffer and the num_of_keys_in_node in leaf nodes
+}
 
-//Buffer structure: [num_of_keys_in_node(length=int) rid1 key1 rid2 key2...pageid] length=PageFile::PAGE_SIZE
+/*
+ * Unpin the page the node was read from, if it is still pinned.
+ * The content of the page is dropped.
+ */
+void BTLeafNode::release()
+{
+	if(pinFile!=NULL)
+	{
+		pinFile->unpin(pinPid);
+		pinFile=NULL;
+	}
+	page=(buffer!=NULL) ? buffer : zeroPage;
+}
+
+//Buffer structure: [num_of_keys_in_node(length=int) rid1 key1 rid2 key2...pageid] length=pageSize
 
 
 /*
@@ -27,7 +379,28 @@ BTLeafNode::BTLeafNode()
  * @return 0 if successful. Return an error code if there is an error.
  */
 RC BTLeafNode::read(PageId pid, const PageFile& pf)
-{ return pf.read(pid,buffer); }   //use the read function in Pagefile to read page into buffer
+{
+	RC result;
+	const char* pinned;
+
+	//drop the page read before without copying it
+	release();
+
+	//pin the page and use it in place, unless every page in the pool is pinned
+	if((result=pf.pin(pid,pinned))==0)
+	{
+		page=pinned;
+		pinFile=&pf;
+		pinPid=pid;
+		return 0;
+	}
+	if(result!=RC_BUFFER_FULL)
+		return result;
+	if(buffer==NULL)
+		buffer=new char[pageSize];
+	page=buffer;
+	return pf.read(pid,buffer);   //use the read function in Pagefile to read page into buffer
+}
 
 /*
  * Write the content of the node to the page pid in the PageFile pf.
@@ -36,15 +409,27 @@ RC BTLeafNode::read(PageId pid, const PageFile& pf)
  * @return 0 if successful. Return an error code if there is an error.
  */
 RC BTLeafNode::write(PageId pid, PageFile& pf)
-{ return pf.write(pid,buffer); }  //use the write function in Pagefile write buffer into page
+{ return pf.write(pid,page); }  //use the write function in Pagefile write buffer into page
 
 /*
  * Return the number of keys stored in the node.
+ * A node read while a writer changed it may hold any count, so the
+ * count is kept within the node to keep such a read inside the page.
  * @return the number of keys in the node
  */
 int BTLeafNode::getKeyCount()
-{ int keycount=0;
-	memcpy(&keycount,buffer,soi);
+{ if(format==NODE_PACKED)
+	{
+		PackedColumns c;
+		readColumns(page,capacity,pageSize,c);
+		return c.count;
+	}
+	int keycount=0;
+	memcpy(&keycount,page,soi);
+	if(keycount<0)
+		return 0;
+	if(keycount>capacity)
+		return capacity;
 	return keycount;
 	}
 
@@ -56,22 +441,38 @@ int BTLeafNode::getKeyCount()
  */
 RC BTLeafNode::insert(int key, const RecordId& rid)
 { //check if there is enough space for the new entry
-	if (getKeyCount() == max_key_num)
+	if (getKeyCount() == capacity)
 		return RC_NODE_FULL;
+	if(format==NODE_PACKED)
+	{
+		//decode, insert and encode again. the entry may not fit
+		vector<int> keys;
+		vector<RecordId> rids;
+		unpack(keys,rids);
+		int eid;
+		locate(key,eid);
+		keys.insert(keys.begin()+eid,key);
+		rids.insert(rids.begin()+eid,rid);
+		return pack(&keys[0],&rids[0],keys.size());
+	}
+	own();
 
 	//find the eid for new entry
 	int eid;
 	locate(key, eid);
-	//make space for new entry
-	char temp[(getKeyCount()-eid)*soent];   //move the rest of existed keys
-	memcpy(&temp,buffer+soi+eid*soent,(getKeyCount()-eid)*soent);
-	memcpy(buffer+soi+(eid+1)*soent,&temp,(getKeyCount()-eid)*soent);
+	//make space for new entry by moving the rest of existed keys
+	int rest=getKeyCount()-eid;
+	if(format==NODE_SOA)
+	{
+		memmove(buffer+keyOffset(eid+1),buffer+keyOffset(eid),rest*soi);
+		memmove(buffer+ridOffset(eid+1),buffer+ridOffset(eid),rest*sorid);
+	}
+	else
+		memmove(buffer+soi+(eid+1)*soent,buffer+soi+eid*soent,rest*soent);
 
 	//insert new entry
-	entry ENTRY;
-	ENTRY.key=key;
-	ENTRY.rid=rid;
-	memcpy(buffer+soi+eid*soent,&ENTRY,soent);
+	memcpy(buffer+keyOffset(eid),&key,soi);
+	memcpy(buffer+ridOffset(eid),&rid,sorid);
 
 	//update the num_of_keys_in_node
 	int key_num=getKeyCount();
@@ -81,6 +482,34 @@ RC BTLeafNode::insert(int key, const RecordId& rid)
 	return 0;
 	}
 
+/*
+ * Add the (key, rid) pair after the last entry of the node.
+ * @param key[IN] the key to add, not smaller than the last one.
+ * @param rid[IN] the RecordId to add.
+ * @return 0 if successful. Return an error code if the node is full.
+ */
+RC BTLeafNode::append(int key, const RecordId& rid)
+{
+	int n=getKeyCount();
+	if (n == capacity)
+		return RC_NODE_FULL;
+	if(format==NODE_PACKED)
+	{
+		vector<int> keys;
+		vector<RecordId> rids;
+		unpack(keys,rids);
+		keys.push_back(key);
+		rids.push_back(rid);
+		return pack(&keys[0],&rids[0],keys.size());
+	}
+	own();
+	memcpy(buffer+keyOffset(n),&key,soi);
+	memcpy(buffer+ridOffset(n),&rid,sorid);
+	n++;
+	memcpy(buffer,&n,soi);
+	return 0;
+}
+
 /*
  * Insert the (key, rid) pair to the node
  * and split the node half and half with sibling.
@@ -94,17 +523,38 @@ RC BTLeafNode::insert(int key, const RecordId& rid)
 RC BTLeafNode::insertAndSplit(int key, const RecordId& rid,
                               BTLeafNode& sibling, int& siblingKey)
 { 
+	if(format==NODE_PACKED)
+	{
+		//split the entries with the new one in halves, which always fit
+		vector<int> keys;
+		vector<RecordId> rids;
+		unpack(keys,rids);
+		int eid;
+		locate(key,eid);
+		keys.insert(keys.begin()+eid,key);
+		rids.insert(rids.begin()+eid,rid);
+		int n=keys.size();
+		int half=n/2;
+		RC rc;
+		if((rc=sibling.pack(&keys[half],&rids[half],n-half))<0)
+			return rc;
+		if((rc=pack(&keys[0],&rids[0],half))<0)
+			return rc;
+		siblingKey=keys[half];
+		return 0;
+	}
 	//check if there is enough space for the new entry, if so, we do not need to insert and split
-	if (getKeyCount() < max_key_num)
+	if (getKeyCount() < capacity)
 		return -1;
-	int halfkey=ceil(max_key_num/2);
+	own();
+	int halfkey=ceil(capacity/2);
 	//move half of the keys to the sibling
-	for(int i=halfkey;i<max_key_num;i++)
+	for(int i=halfkey;i<capacity;i++)
 	{
 		int newkey;
 		RecordId newrid;
 		readEntry(i,newkey,newrid);
-		sibling.insert(newkey,newrid);
+		sibling.append(newkey,newrid);  //pairs with equal keys stay in order
 	}
 
 	//update the num_of_keys_in_node in the old node
@@ -127,6 +577,43 @@ RC BTLeafNode::insertAndSplit(int key, const RecordId& rid,
 
 	return 0; }
 
+/*
+ * Remove the (key, rid) pair of the eid entry from the node.
+ * @param eid[IN] the entry number to remove
+ * @return 0 if successful. Return an error code if there is no such entry.
+ */
+RC BTLeafNode::remove(int eid)
+{
+	if (eid < 0 || eid >= getKeyCount())
+		return RC_INVALID_CURSOR;
+	if(format==NODE_PACKED)
+	{
+		vector<int> keys;
+		vector<RecordId> rids;
+		unpack(keys,rids);
+		keys.erase(keys.begin()+eid);
+		rids.erase(rids.begin()+eid);
+		return pack(keys.data(),rids.data(),keys.size());  //the smaller range never takes more bits
+	}
+	own();
+
+	//close the gap by moving the rest of the entries
+	int rest=getKeyCount()-eid-1;
+	if(format==NODE_SOA)
+	{
+		memmove(buffer+keyOffset(eid),buffer+keyOffset(eid+1),rest*soi);
+		memmove(buffer+ridOffset(eid),buffer+ridOffset(eid+1),rest*sorid);
+	}
+	else
+		memmove(buffer+soi+eid*soent,buffer+soi+(eid+1)*soent,rest*soent);
+
+	//update the num_of_keys_in_node
+	int key_num=getKeyCount()-1;
+	memcpy(buffer,&key_num,soi);
+
+	return 0;
+	}
+
 /**
  * If searchKey exists in the node, set eid to the index entry
  * with searchKey and return 0. If not, set eid to the index entry
@@ -140,21 +627,51 @@ RC BTLeafNode::insertAndSplit(int key, const RecordId& rid,
  */
 RC BTLeafNode::locate(int searchKey, int& eid)
 { 	
-	RC key;
-	RecordId rid;
-	for( int i=0; i<getKeyCount(); i++)
+	int keycount=getKeyCount();
+	//the first entry with a key not smaller than searchKey
+	if(format==NODE_PACKED)
 	{
-		readEntry(i,key,rid);
-		if (key>=searchKey)
-		{
-			eid=i;
-			return 0;
-		}
+		PackedColumns c;
+		readColumns(page,capacity,pageSize,c);
+		eid=rankPacked(page,c,searchKey,false);
 	}
-	eid=getKeyCount();  //set eid to the index entry immediately after the largest index key that is smaller than searchKey
+	else
+		eid=rankKey(page+keyOffset(0),keyStride(),keycount,searchKey,false);
+	if(eid<keycount)
+		return 0;
 	return RC_NO_SUCH_RECORD;   //cannot find the searchKey
 }
 
+/*
+ * Set eid to the last index entry with a key not larger than searchKey.
+ * @param searchKey[IN] the key to search for.
+ * @param eid[OUT] the last index entry number with a key up to searchKey,
+ *                 -1 if there is none.
+ * @return 0 if the key of that entry is searchKey. Otherwise return an error code.
+ */
+RC BTLeafNode::locateLast(int searchKey, int& eid)
+{
+	//the entry before the first one with a key larger than searchKey
+	if(format==NODE_PACKED)
+	{
+		PackedColumns c;
+		readColumns(page,capacity,pageSize,c);
+		eid=rankPacked(page,c,searchKey,true)-1;
+		if((eid>=0)&&((int)(c.base[0]+extract(page+c.offset[0],c.bits[0],eid))==searchKey))
+			return 0;
+		return RC_NO_SUCH_RECORD;
+	}
+	eid=rankKey(page+keyOffset(0),keyStride(),getKeyCount(),searchKey,true)-1;
+	if(eid>=0)
+	{
+		int key;
+		memcpy(&key,page+keyOffset(eid),soi);
+		if(key==searchKey)
+			return 0;
+	}
+	return RC_NO_SUCH_RECORD;
+}
+
 /*
  * Read the (key, rid) pair from the eid entry.
  * @param eid[IN] the entry number to read the (key, rid) pair from
@@ -167,19 +684,194 @@ RC BTLeafNode::readEntry(int eid, int& key, RecordId& rid)
 	if (eid < 0 || eid > getKeyCount())
 	return -1;
 
-	entry ENTRY;
-	memcpy(&ENTRY,buffer+soi+soent*eid,soent);
-	key=ENTRY.key;
-	rid=ENTRY.rid;
+	if(format==NODE_PACKED)
+	{
+		PackedColumns c;
+		readColumns(page,capacity,pageSize,c);
+		if(eid>=c.count)
+			return RC_INVALID_CURSOR;
+		key=(int)(c.base[0]+extract(page+c.offset[0],c.bits[0],eid));
+		rid.pid=(PageId)(c.base[1]+extract(page+c.offset[1],c.bits[1],eid));
+		rid.sid=(int)(c.base[2]+extract(page+c.offset[2],c.bits[2],eid));
+		return 0;
+	}
+	memcpy(&key,page+keyOffset(eid),soi);
+	memcpy(&rid,page+ridOffset(eid),sorid);
 	return 0; }
 
+/*
+ * Read the n (key, rid) pairs from the eid entry on.
+ * @param eid[IN] the first entry to read
+ * @param n[IN] the # of entries to read
+ * @param keys[OUT] the keys
+ * @param rids[OUT] the RecordIds
+ * @return 0 if successful. Return an error code if there is an error.
+ */
+RC BTLeafNode::readEntries(int eid, int n, int* keys, RecordId* rids)
+{
+	if(format!=NODE_PACKED)
+	{
+		RC rc;
+		for(int i=0;i<n;i++)
+			if((rc=readEntry(eid+i,keys[i],rids[i]))<0)
+				return rc;
+		return 0;
+	}
+
+	PackedColumns c;
+	readColumns(page,capacity,pageSize,c);
+	if((eid<0)||(n<0)||(eid+n>c.count))
+		return RC_INVALID_CURSOR;
+
+	//the pids and sids are decoded into a column of their own first, a run at a time
+	const int RUN=64;
+	int pids[RUN];
+	int sids[RUN];
+	columnDecode(page+c.offset[0],c.bits[0],c.base[0],eid,n,keys);
+	for(int done=0;done<n;done+=RUN)
+	{
+		int run=min(RUN,n-done);
+		columnDecode(page+c.offset[1],c.bits[1],c.base[1],eid+done,run,pids);
+		columnDecode(page+c.offset[2],c.bits[2],c.base[2],eid+done,run,sids);
+		for(int i=0;i<run;i++)
+		{
+			rids[done+i].pid=pids[i];
+			rids[done+i].sid=sids[i];
+		}
+	}
+	return 0;
+}
+
+/*
+ * Move all entries of the node after this one to the end of this one.
+ * @param from[IN] the node after this one
+ * @return 0 if successful. RC_NODE_FULL if the entries do not fit.
+ */
+RC BTLeafNode::merge(BTLeafNode& from)
+{
+	int n=getKeyCount();
+	int m=from.getKeyCount();
+	if(n+m>capacity)
+		return RC_NODE_FULL;
+
+	if(format==NODE_PACKED)
+	{
+		vector<int> keys;
+		vector<RecordId> rids;
+		unpack(keys,rids);
+		keys.resize(n+m);
+		rids.resize(n+m);
+		from.readEntries(0,m,keys.data()+n,rids.data()+n);
+		RC rc;
+		if((rc=pack(keys.data(),rids.data(),n+m))<0)
+			return rc;
+	}
+	else
+	{
+		own();
+		for(int i=0;i<m;i++)
+		{
+			int key;
+			RecordId rid;
+			from.readEntry(i,key,rid);
+			memcpy(buffer+keyOffset(n+i),&key,soi);
+			memcpy(buffer+ridOffset(n+i),&rid,sorid);
+		}
+		int key_num=n+m;
+		memcpy(buffer,&key_num,soi);
+	}
+
+	//the other node is left empty
+	from.own();
+	int zero=0;
+	if(from.format==NODE_PACKED)
+		memset(from.buffer+PACKED_BASE,0,PACKED_DATA-PACKED_BASE);
+	memcpy(from.buffer,&zero,soi);
+	return 0;
+}
+
+/*
+ * Decode all entries of a packed node.
+ * @param keys[OUT] the keys
+ * @param rids[OUT] the RecordIds
+ */
+void BTLeafNode::unpack(vector<int>& keys, vector<RecordId>& rids)
+{
+	int n=getKeyCount();
+	keys.resize(n);
+	rids.resize(n);
+	readEntries(0,n,keys.data(),rids.data());
+}
+
+/*
+ * Encode the entries of a packed node to buffer, keeping the next and
+ * previous node pointers.
+ * @param keys[IN] the sorted keys
+ * @param rids[IN] the RecordIds
+ * @param n[IN] the # of entries
+ * @return 0 if successful. RC_NODE_FULL if they do not fit.
+ */
+RC BTLeafNode::pack(const int* keys, const RecordId* rids, int n)
+{
+	if(n>capacity)
+		return RC_NODE_FULL;
+
+	//the base of each column is its smallest value
+	unsigned base[3]={0,0,0};
+	unsigned range[3]={0,0,0};
+	if(n>0)
+	{
+		int lo[3]={keys[0],rids[0].pid,rids[0].sid};
+		int hi[3]={keys[n-1],rids[0].pid,rids[0].sid};
+		for(int i=1;i<n;i++)
+		{
+			lo[1]=min(lo[1],(int)rids[i].pid);
+			hi[1]=max(hi[1],(int)rids[i].pid);
+			lo[2]=min(lo[2],rids[i].sid);
+			hi[2]=max(hi[2],rids[i].sid);
+		}
+		for(int j=0;j<3;j++)
+		{
+			base[j]=(unsigned)lo[j];
+			range[j]=(unsigned)hi[j]-(unsigned)lo[j];
+		}
+	}
+
+	int bits[3];
+	int end=PACKED_DATA;
+	for(int j=0;j<3;j++)
+	{
+		bits[j]=bitsFor(range[j]);
+		end+=columnBytes(n,bits[j]);
+	}
+	if(end>pageSize-PACKED_SLACK)
+		return RC_NODE_FULL;
+
+	own();
+	memset(buffer+PACKED_BASE,0,pageSize-PACKED_BASE);
+	memcpy(buffer,&n,soi);
+	memcpy(buffer+PACKED_BASE,base,3*soi);
+	char* column=buffer+PACKED_DATA;
+	for(int j=0;j<3;j++)
+	{
+		buffer[PACKED_BITS+j]=(char)bits[j];
+		for(int i=0;i<n;i++)
+		{
+			unsigned v=(j==0) ? (unsigned)keys[i] : (j==1) ? (unsigned)rids[i].pid : (unsigned)rids[i].sid;
+			deposit(column,bits[j],i,v-base[j]);
+		}
+		column+=columnBytes(n,bits[j]);
+	}
+	return 0;
+}
+
 /*
  * Return the pid of the next slibling node.
  * @return the PageId of the next sibling node
  */
 PageId BTLeafNode::getNextNodePtr()
 { PageId pid;
-	memcpy(&pid,buffer+soi+soent*max_key_num,sopid);
+	memcpy(&pid,page+nextOffset(),sopid);
 	return pid; }
 
 /*
@@ -188,19 +880,105 @@ PageId BTLeafNode::getNextNodePtr()
  * @return 0 if successful. Return an error code if there is an error.
  */
 RC BTLeafNode::setNextNodePtr(PageId pid)
-{ memcpy(buffer+soi+soent*max_key_num,&pid,sopid);
+{ own();
+	memcpy(buffer+nextOffset(),&pid,sopid);
+	return 0; }
+
+/*
+ * Return the pid of the previous slibling node.
+ * @return the PageId of the previous sibling node
+ */
+PageId BTLeafNode::getPrevNodePtr()
+{ PageId pid;
+	memcpy(&pid,page+prevOffset(),sopid);
+	return pid; }
+
+/*
+ * Set the pid of the previous slibling node.
+ * @param pid[IN] the PageId of the previous sibling node
+ * @return 0 if successful. Return an error code if there is an error.
+ */
+RC BTLeafNode::setPrevNodePtr(PageId pid)
+{ own();
+	memcpy(buffer+prevOffset(),&pid,sopid);
 	return 0; }
 
 //Non-leaf nodes
 //Using constructor to for initialization
-BTNonLeafNode::BTNonLeafNode(){
-	for(int i=0;i<PageFile::PAGE_SIZE;i++)
+BTNonLeafNode::BTNonLeafNode(NodeFormat format, bool counted, int pageSize){
+	this->format=format;
+	this->counted=counted;
+	this->pageSize=pageSize;
+	capacity=getMaxKeyCount(counted,pageSize);
+	buffer=NULL;
+	page=zeroPage;
+	pinFile=NULL;
+}//the buffer is allocated when the node is changed
+
+BTNonLeafNode::~BTNonLeafNode()
+{ release();
+	delete [] buffer; }
+
+/*
+ * Return the maximum number of keys a non-leaf node can hold, in any layout.
+ * A node with N keys has N+1 PageIds, and N+1 counts if it counts entries.
+ */
+int BTNonLeafNode::getMaxKeyCount(bool counted, int pageSize)
+{
+	if(counted)
+		return (pageSize - soi - sopid - soi)/(soi + sopid + soi);
+	return (pageSize - soi - sopid)/(soi + sopid); }
+
+//locations in the page, see the layouts in BTreeNode.h
+int BTNonLeafNode::keyOffset(int i) const
+{
+	if(format!=NODE_INTERLEAVED)
+		return soi+i*soi;
+	return soi+sopid+i*(soi+sopid);
+}
+
+int BTNonLeafNode::pidOffset(int i) const
+{
+	if(format!=NODE_INTERLEAVED)
+		return soi+capacity*soi+i*sopid;
+	return soi+i*(soi+sopid);
+}
+
+//the counts follow the last PageId a full node can have, in both layouts
+int BTNonLeafNode::countOffset(int i) const
+{ return soi+capacity*(soi+sopid)+sopid+i*soi; }
+
+int BTNonLeafNode::keyStride() const
+{ return (format!=NODE_INTERLEAVED) ? soi : soi+sopid; }
+
+/*
+ * Make the node modifiable: copy the pinned page or the viewed image to
+ * buffer and unpin the page.
+ */
+void BTNonLeafNode::own()
+{
+	if(page!=buffer)
+	{
+		if(buffer==NULL)
+			buffer=new char[pageSize];
+		memcpy(buffer,page,pageSize);
+		release();
+	}
+}
+
+/*
+ * Unpin the page the node was read from, if it is still pinned.
+ * The content of the page is dropped.
+ */
+void BTNonLeafNode::release()
+{
+	if(pinFile!=NULL)
 	{
-		buffer[i]='\0';
+		pinFile->unpin(pinPid);
+		pinFile=NULL;
 	}
-	int temp=0;
-	memcpy(buffer,&temp,soi);
-}//clear up the buffer and the num_of_keys_in_node in leaf nodes
+	page=(buffer!=NULL) ? buffer : zeroPage;
+}
 
 
 /*
@@ -210,7 +988,45 @@ BTNonLeafNode::BTNonLeafNode(){
  * @return 0 if successful. Return an error code if there is an error.
  */
 RC BTNonLeafNode::read(PageId pid, const PageFile& pf)
-{ return pf.read(pid,buffer); }   //use the read function in Pagefile to read page into buffer
+{
+	RC result;
+	const char* pinned;
+
+	//drop the page read before without copying it
+	release();
+
+	//pin the page and use it in place, unless every page in the pool is pinned
+	if((result=pf.pin(pid,pinned))==0)
+	{
+		page=pinned;
+		pinFile=&pf;
+		pinPid=pid;
+		return 0;
+	}
+	if(result!=RC_BUFFER_FULL)
+		return result;
+	if(buffer==NULL)
+		buffer=new char[pageSize];
+	page=buffer;
+	return pf.read(pid,buffer);   //use the read function in Pagefile to read page into buffer
+}
+
+/*
+ * Use the image of a node kept in memory in place.
+ * @param image[IN] the content of the node, a page of the file
+ */
+void BTNonLeafNode::view(const char* image)
+{
+	release();
+	page=image;
+}
+
+/*
+ * Copy the content of the node to an image kept in memory.
+ * @param image[OUT] a page of the file to copy the node to
+ */
+void BTNonLeafNode::copyTo(char* image) const
+{ memcpy(image,page,pageSize); }
 
 /*
  * Write the content of the node to the page pid in the PageFile pf.
@@ -219,15 +1035,21 @@ RC BTNonLeafNode::read(PageId pid, const PageFile& pf)
  * @return 0 if successful. Return an error code if there is an error.
  */
 RC BTNonLeafNode::write(PageId pid, PageFile& pf)
-{ return pf.write(pid,buffer); }  //use the write function in Pagefile write buffer into page
+{ return pf.write(pid,page); }  //use the write function in Pagefile write buffer into page
 
 /*
  * Return the number of keys stored in the node.
+ * A node read while a writer changed it may hold any count, so the
+ * count is kept within the node to keep such a read inside the page.
  * @return the number of keys in the node
  */
 int BTNonLeafNode::getKeyCount()
 { int keycount=0;
-	memcpy(&keycount,buffer,soi);
+	memcpy(&keycount,page,soi);
+	if(keycount<0)
+		return 0;
+	if(keycount>capacity)
+		return capacity;
 	return keycount;
 	}
 
@@ -238,34 +1060,48 @@ int BTNonLeafNode::getKeyCount()
  * @return 0 if successful. Return an error code if the node is full.
  */
 RC BTNonLeafNode::insert(int key, PageId pid)
+{
+	//locate the position of new key, after all keys equal to it so that
+	//pid ends up right of the child it was split from
+	return insert(key,pid,rankKey(page+keyOffset(0),keyStride(),getKeyCount(),key,true));
+	}
+
+/*
+ * Insert the (key, pid) pair to the node as key eid, so that pid comes
+ * right after the eid-th child pointer. Among equal keys, only the
+ * position tells which child pid was split from.
+ * @param key[IN] the key to insert
+ * @param pid[IN] the PageId to insert
+ * @param eid[IN] the position of the new key, 0 <= eid <= num_of_keys
+ * @param count[IN] the # of entries under pid
+ * @return 0 if successful. Return an error code if the node is full.
+ */
+RC BTNonLeafNode::insert(int key, PageId pid, int eid, int count)
 { //check if there is enough space for the new key
-	if (getKeyCount() == max_key_num_non)
+	if (getKeyCount() == capacity)
 		return RC_NODE_FULL;
+	if (eid < 0 || eid > getKeyCount())
+		return RC_INVALID_CURSOR;
+	own();
 
-	//find the eid for new key
-	int eid;
-
-	//locate the position of new key
-	for(int i=0;i<getKeyCount();i++)
+	//make space for new entry by moving the rest of existed keys.
+	//the new pid goes right of the new key
+	int rest=getKeyCount()-eid;
+	if(format!=NODE_INTERLEAVED)
 	{
-		int temp_key;
-		memcpy(&temp_key,buffer+soi+sopid+i*(soi+sopid),soi);
-		if(temp_key>=key)
-			{eid=i;
-			break;
-		}
-		else
-			eid=getKeyCount();
+		memmove(buffer+keyOffset(eid+1),buffer+keyOffset(eid),rest*soi);
+		memmove(buffer+pidOffset(eid+2),buffer+pidOffset(eid+1),rest*sopid);
 	}
-
-	//make space for new entry
-	char temp[(getKeyCount()-eid)*(soi+sopid)];   //move the rest of existed keys
-	memcpy(&temp,buffer+soi+sopid+eid*(soi+sopid),(getKeyCount()-eid)*(soi+sopid));
-	memcpy(buffer+soi+sopid+(eid+1)*(soi+sopid),&temp,(getKeyCount()-eid)*(soi+sopid));
+	else
+		memmove(buffer+keyOffset(eid+1),buffer+keyOffset(eid),rest*(soi+sopid));
+	if(counted)
+		memmove(buffer+countOffset(eid+2),buffer+countOffset(eid+1),rest*soi);
 
 	//insert new entry
-	memcpy(buffer+soi+sopid+eid*(soi+sopid),&key,soi);
-	memcpy(buffer+soi+sopid+eid*(soi+sopid)+soi,&pid,sopid);
+	memcpy(buffer+keyOffset(eid),&key,soi);
+	memcpy(buffer+pidOffset(eid+1),&pid,sopid);
+	if(counted)
+		memcpy(buffer+countOffset(eid+1),&count,soi);
 
 	//update the num_of_keys_in_node
 	int key_num=getKeyCount();
@@ -275,6 +1111,124 @@ RC BTNonLeafNode::insert(int key, PageId pid)
 	return 0;
 	}
 
+/*
+ * Insert a (pid, key) pair in front of the node: pid becomes the first
+ * pointer and key the first key, followed by the old first pointer.
+ * @param pid[IN] the PageId to insert
+ * @param key[IN] the key to insert, not larger than the keys in the node
+ * @param count[IN] the # of entries under pid
+ * @return 0 if successful. Return an error code if the node is full.
+ */
+RC BTNonLeafNode::insertFirst(PageId pid, int key, int count)
+{
+	int keycount=getKeyCount();
+	if (keycount == capacity)
+		return RC_NODE_FULL;
+	own();
+
+	if(format!=NODE_INTERLEAVED)
+	{
+		memmove(buffer+keyOffset(1),buffer+keyOffset(0),keycount*soi);
+		memmove(buffer+pidOffset(1),buffer+pidOffset(0),(keycount+1)*sopid);
+	}
+	else
+		memmove(buffer+pidOffset(1),buffer+pidOffset(0),keycount*(soi+sopid)+sopid);
+	if(counted)
+	{
+		memmove(buffer+countOffset(1),buffer+countOffset(0),(keycount+1)*soi);
+		memcpy(buffer+countOffset(0),&count,soi);
+	}
+
+	memcpy(buffer+pidOffset(0),&pid,sopid);
+	memcpy(buffer+keyOffset(0),&key,soi);
+	keycount++;
+	memcpy(buffer,&keycount,soi);
+	return 0;
+	}
+
+/*
+ * Remove key eid and the pointer right of it from the node.
+ * @param eid[IN] the key to remove
+ * @return 0 if successful. Return an error code if there is no such key.
+ */
+RC BTNonLeafNode::remove(int eid)
+{
+	int keycount=getKeyCount();
+	if (eid < 0 || eid >= keycount)
+		return RC_INVALID_CURSOR;
+	own();
+
+	int rest=keycount-eid-1;
+	if(format!=NODE_INTERLEAVED)
+	{
+		memmove(buffer+keyOffset(eid),buffer+keyOffset(eid+1),rest*soi);
+		memmove(buffer+pidOffset(eid+1),buffer+pidOffset(eid+2),rest*sopid);
+	}
+	else
+		memmove(buffer+keyOffset(eid),buffer+keyOffset(eid+1),rest*(soi+sopid));
+	if(counted)
+		memmove(buffer+countOffset(eid+1),buffer+countOffset(eid+2),rest*soi);
+
+	keycount--;
+	memcpy(buffer,&keycount,soi);
+	return 0;
+	}
+
+/*
+ * Remove the first pointer and the first key from the node.
+ * @return 0 if successful. Return an error code if the node has no key.
+ */
+RC BTNonLeafNode::removeFirst()
+{
+	int keycount=getKeyCount();
+	if (keycount == 0)
+		return RC_INVALID_CURSOR;
+	own();
+
+	if(format!=NODE_INTERLEAVED)
+	{
+		memmove(buffer+keyOffset(0),buffer+keyOffset(1),(keycount-1)*soi);
+		memmove(buffer+pidOffset(0),buffer+pidOffset(1),keycount*sopid);
+	}
+	else
+		memmove(buffer+pidOffset(0),buffer+pidOffset(1),(keycount-1)*(soi+sopid)+sopid);
+	if(counted)
+		memmove(buffer+countOffset(0),buffer+countOffset(1),keycount*soi);
+
+	keycount--;
+	memcpy(buffer,&keycount,soi);
+	return 0;
+	}
+
+/*
+ * Read the eid-th key.
+ * @param eid[IN] the position of the key, 0 <= eid < num_of_keys
+ * @param key[OUT] the key
+ * @return 0 if successful. Return an error code if there is an error.
+ */
+RC BTNonLeafNode::readKey(int eid, int& key)
+{
+	if (eid < 0 || eid >= getKeyCount())
+	return RC_INVALID_CURSOR;
+
+	memcpy(&key,page+keyOffset(eid),soi);
+	return 0; }
+
+/*
+ * Replace the eid-th key.
+ * @param eid[IN] the position of the key, 0 <= eid < num_of_keys
+ * @param key[IN] the new key
+ * @return 0 if successful. Return an error code if there is an error.
+ */
+RC BTNonLeafNode::setKey(int eid, int key)
+{
+	if (eid < 0 || eid >= getKeyCount())
+	return RC_INVALID_CURSOR;
+	own();
+
+	memcpy(buffer+keyOffset(eid),&key,soi);
+	return 0; }
+
 /*
  * Insert the (key, pid) pair to the node
  * and split the node half and half with sibling.
@@ -286,51 +1240,64 @@ RC BTNonLeafNode::insert(int key, PageId pid)
  * @return 0 if successful. Return an error code if there is an error.
  */
 RC BTNonLeafNode::insertAndSplit(int key, PageId pid, BTNonLeafNode& sibling, int& midKey)
+{
+	return insertAndSplit(key,pid,rankKey(page+keyOffset(0),keyStride(),getKeyCount(),key,true),0,sibling,midKey);
+	}
+
+/*
+ * Insert the (key, pid) pair to the node as key eid, as by
+ * insert(key, pid, eid), and split the node half and half with sibling.
+ * @param key[IN] the key to insert
+ * @param pid[IN] the PageId to insert
+ * @param eid[IN] the position of the new key, 0 <= eid <= num_of_keys
+ * @param count[IN] the # of entries under pid
+ * @param sibling[IN] the sibling node to split with. This node MUST be empty when this function is called.
+ * @param midKey[OUT] the key in the middle after the split. This key should be inserted to the parent node.
+ * @return 0 if successful. Return an error code if there is an error.
+ */
+RC BTNonLeafNode::insertAndSplit(int key, PageId pid, int eid, int count, BTNonLeafNode& sibling, int& midKey)
 { //check if there is enough space for the new entry, if so, we do not need to insert and split
-	if (getKeyCount() < max_key_num_non)
+	if (getKeyCount() < capacity)
 		return -1;
-	int halfkey=ceil(max_key_num_non/2);
+	own();
+	int halfkey=ceil(capacity/2);
 
 	//move half of the keys to the sibling
-	for(int i=halfkey;i<max_key_num_non;i++)
+	for(int i=halfkey;i<capacity;i++)
 	{
 		int newkey;
 		PageId newpid;
-		memcpy(&newkey,buffer+soi+sopid+i*(soi+sopid),soi);
-		memcpy(&newpid,buffer+soi+sopid+i*(soi+sopid)+soi,sopid);
+		memcpy(&newkey,buffer+keyOffset(i),soi);
+		memcpy(&newpid,buffer+pidOffset(i+1),sopid);
 		if (sibling.getKeyCount()==0)// initialize the root node
 			{
 			  PageId newpid_left;
-			  memcpy(&newpid_left,buffer+soi+(i*(soi+sopid)),sopid);
+			  memcpy(&newpid_left,buffer+pidOffset(i),sopid);
 			  sibling.initializeRoot(newpid_left,newkey,newpid);
 			}
 		else
 		sibling.insert(newkey,newpid);
 	}
 
+	//the pointers from halfkey on take their counts along
+	for(int i=halfkey;i<=capacity;i++)
+	{
+		int moved;
+		readChildCount(i,moved);
+		sibling.setChildCount(i-halfkey,moved);
+	}
+
 	//update the num_of_keys_in_node in the old node
 	memcpy(buffer,&halfkey,soi);
 
-	//insert new entry
-	int eid;
-	for(int i=0;i<getKeyCount();i++)
-	{
-		int temp_key;
-		memcpy(&temp_key,buffer+soi+sopid+i*(soi+sopid),soi);
-		if(temp_key>=key)
-			{eid=i;
-			break;
-		}
-		else
-			eid=getKeyCount();
-	}
-	if(eid != getKeyCount())  //new entry can be inserted into the old node
-		insert(key,pid);
+	//insert new entry, the keys from halfkey on are in the sibling now
+	if(eid < halfkey)  //new entry can be inserted into the old node
+		insert(key,pid,eid,count);
 	else
-		sibling.insert(key,pid);
+		sibling.insert(key,pid,eid-halfkey,count);
 
 	//get the middle key after split
-	memcpy(&midKey,buffer+soi+sopid+(getKeyCount()-1)*(soi+sopid),soi);
+	memcpy(&midKey,buffer+keyOffset(getKeyCount()-1),soi);
 
 	return 0; }
 
@@ -343,23 +1310,137 @@ RC BTNonLeafNode::insertAndSplit(int key, PageId pid, BTNonLeafNode& sibling, in
  */
 RC BTNonLeafNode::locateChildPtr(int searchKey, PageId& pid)
 {
-	PageId pid_left;
-	PageId pid_right;
-	int key_mid;
-	for(int i=0;i<getKeyCount();i++)
+	int eid;
+	return locateChildPtr(searchKey,pid,eid); }
+
+/*
+ * Given the searchKey, find the child-node pointer to follow and
+ * output it in pid, and its position in eid.
+ * @param searchKey[IN] the searchKey that is being looked up.
+ * @param pid[OUT] the pointer to the child node to follow.
+ * @param eid[OUT] the position of pid in the node, 0 <= eid <= num_of_keys.
+ * @return 0 if successful. Return an error code if there is an error.
+ */
+RC BTNonLeafNode::locateChildPtr(int searchKey, PageId& pid, int& eid)
+{
+	//follow the pointer left of the first key larger than searchKey
+	eid=rankKey(page+keyOffset(0),keyStride(),getKeyCount(),searchKey,true);
+	memcpy(&pid,page+pidOffset(eid),sopid);
+	return 0; }
+
+/*
+ * Find the leftmost child node that may hold searchKey. Keys equal to
+ * a key of this node may also be found left of it, in the child that
+ * was split.
+ * @param searchKey[IN] the searchKey that is being looked up.
+ * @param pid[OUT] the pointer to the child node to follow.
+ * @param eid[OUT] the position of pid in the node, 0 <= eid <= num_of_keys.
+ * @return 0 if successful. Return an error code if there is an error.
+ */
+RC BTNonLeafNode::locateFirstChildPtr(int searchKey, PageId& pid, int& eid)
+{
+	//follow the pointer left of the first key not smaller than searchKey
+	eid=rankKey(page+keyOffset(0),keyStride(),getKeyCount(),searchKey,false);
+	memcpy(&pid,page+pidOffset(eid),sopid);
+	return 0; }
+
+/*
+ * Read the eid-th child-node pointer.
+ * @param eid[IN] the position of the pointer, 0 <= eid <= num_of_keys
+ * @param pid[OUT] the pointer
+ * @return 0 if successful. Return an error code if there is an error.
+ */
+RC BTNonLeafNode::readChildPtr(int eid, PageId& pid)
+{
+	if (eid < 0 || eid > getKeyCount())
+	return RC_INVALID_CURSOR;
+
+	memcpy(&pid,page+pidOffset(eid),sopid);
+	return 0; }
+
+/*
+ * Read the # of entries under the eid-th child-node pointer.
+ * @param eid[IN] the position of the pointer, 0 <= eid <= num_of_keys
+ * @param count[OUT] the # of entries. 0 if the node does not count them
+ * @return 0 if successful. Return an error code if there is an error.
+ */
+RC BTNonLeafNode::readChildCount(int eid, int& count)
+{
+	if (eid < 0 || eid > getKeyCount())
+	return RC_INVALID_CURSOR;
+
+	count=0;
+	if(counted)
+		memcpy(&count,page+countOffset(eid),soi);
+	return 0; }
+
+/*
+ * Set the # of entries under the eid-th child-node pointer.
+ * @param eid[IN] the position of the pointer, 0 <= eid <= num_of_keys
+ * @param count[IN] the # of entries
+ * @return 0 if successful. Return an error code if there is an error.
+ */
+RC BTNonLeafNode::setChildCount(int eid, int count)
+{
+	if (eid < 0 || eid > getKeyCount())
+	return RC_INVALID_CURSOR;
+	if(!counted)
+		return 0;
+	own();
+
+	memcpy(buffer+countOffset(eid),&count,soi);
+	return 0; }
+
+/*
+ * Return the # of entries under the child-node pointers before the eid-th.
+ * @param eid[IN] the position of the pointer, 0 <= eid <= num_of_keys
+ * @return the # of entries under pointers 0 .. eid-1
+ */
+int BTNonLeafNode::countBefore(int eid)
+{
+	int total=0;
+	if(eid>getKeyCount()+1)
+		eid=getKeyCount()+1;
+	for(int i=0;counted&&(i<eid);i++)
 	{
-		memcpy(&pid_left,buffer+soi+i*(soi+sopid),sopid);
-		memcpy(&key_mid,buffer+soi+i*(soi+sopid)+sopid,soi);
-		memcpy(&pid_right,buffer+soi+i*(soi+sopid)+sopid+soi,sopid);   //get the [pid_left key_mid pid_right]
-		if(key_mid>searchKey)
-			{
-				pid=pid_left;
-				break;
-			}
-		else
-			pid=pid_right;               //if search for the pageid in another node there may be a problem#####
+		int count;
+		memcpy(&count,page+countOffset(i),soi);
+		total+=count;
 	}
-	return 0; }
+	return total; }
+
+/*
+ * Return the # of entries under the node.
+ * @return the # of entries under all child-node pointers
+ */
+int BTNonLeafNode::getEntryCount()
+{ return countBefore(getKeyCount()+1); }
+
+/*
+ * Find the child node that holds entry n under the node, by going
+ * over the counts of the children from the first one on.
+ * @param n[IN/OUT] the entry. On return, its number in the child node
+ * @param pid[OUT] the pointer to the child node to follow.
+ * @param eid[OUT] the position of pid in the node, 0 <= eid <= num_of_keys.
+ * @return 0 if successful. RC_NO_SUCH_RECORD if there are not that many entries.
+ */
+RC BTNonLeafNode::locateChildByCount(int& n, PageId& pid, int& eid)
+{
+	int keycount=getKeyCount();
+	if(!counted||(n<0))
+		return RC_NO_SUCH_RECORD;
+	for(eid=0;eid<=keycount;eid++)
+	{
+		int count;
+		memcpy(&count,page+countOffset(eid),soi);
+		if(n<count)
+		{
+			memcpy(&pid,page+pidOffset(eid),sopid);
+			return 0;
+		}
+		n-=count;
+	}
+	return RC_NO_SUCH_RECORD; }
 
 /*
  * Initialize the root node with (pid1, key, pid2).
@@ -369,11 +1450,14 @@ RC BTNonLeafNode::locateChildPtr(int searchKey, PageId& pid)
  * @return 0 if successful. Return an error code if there is an error.
  */
 RC BTNonLeafNode::initializeRoot(PageId pid1, int key, PageId pid2)
-{ int keycount=1;
+{ own();
+	int keycount=1;
 	memcpy(buffer,&keycount,soi);
-	memcpy(buffer+soi,&pid1,sopid);
-	memcpy(buffer+soi+sopid,&key,soi);
-	memcpy(buffer+soi+sopid+soi,&pid2,sopid);   //insert the [pid1 key pid2] to root
+	memcpy(buffer+pidOffset(0),&pid1,sopid);
+	memcpy(buffer+keyOffset(0),&key,soi);
+	memcpy(buffer+pidOffset(1),&pid2,sopid);   //insert the [pid1 key pid2] to root
+	if(counted)  //the caller counts the entries under them
+		memset(buffer+countOffset(0),0,2*soi);
 	return 0;
 	}
 
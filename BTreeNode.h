@@ -13,12 +13,13 @@
 #include "RecordFile.h"
 #include "PageFile.h"
 #include <math.h>
+#include <vector>
 
 /**
  * BTLeafNode: The class representing a B+tree leaf node.
  */
 
- //Buffer structure: [num_of_keys_in_node(length=int) rid1 key1 rid2 key2...pageid] length=PageFile::PAGE_SIZE
+ //Buffer structure: [num_of_keys_in_node(length=int) rid1 key1 rid2 key2...pageid] length=the page size of the file
 
 const int soi = sizeof(int);  //size of int
 const int sopid = sizeof(PageId);  //size of PageId
@@ -30,22 +31,78 @@ struct entry
 	};
 
 const int soent = sizeof(entry);  //size of entry
+
+/**
+ * The on-disk layouts of B+tree nodes. The layout of all nodes of an index
+ * is recorded in the index header page.
+ * NODE_INTERLEAVED: the original layout. Keys are interleaved with their
+ *   RecordIds or PageIds, as drawn above for leaf nodes.
+ * NODE_SOA: the keys of a node are stored in one contiguous array,
+ *   followed by the array of their RecordIds or PageIds, so that a key
+ *   search reads only densely packed keys.
+ *   leaf:     [num_of_keys key1 ... keyN rid1 ... ridN pageid]
+ *   non-leaf: [num_of_keys key1 ... keyN pid0 pid1 ... pidN]
+ * NODE_PACKED: leaf nodes are compressed. Each key, PageId and sid is
+ *   stored as its difference from the smallest one in the node (frame of
+ *   reference), in as many bits as the largest difference needs, and the
+ *   three columns are bit-packed one after the other:
+ *   leaf:     [num_of_keys pageid prev_pageid key_base pid_base sid_base
+ *              key_bits pid_bits sid_bits keys pids sids]
+ *   How many entries fit depends on the entries. Non-leaf nodes use the
+ *   NODE_SOA layout.
+ * In the first two layouts, the PageId of the previous leaf node follows the
+ * PageId of the next one. The capacity of a leaf leaves room for both.
+ * A non-leaf node may also count the entries under each of its children:
+ * the # of entries under pid0 ... pidN follow the PageIds, and fewer keys
+ * fit in the node.
+ */
+enum NodeFormat { NODE_INTERLEAVED = 0, NODE_SOA = 1, NODE_PACKED = 2 };
  
 class BTLeafNode {
   public:
     /**
     * Initialization
+    * @param format[IN] the layout of the node in its page
+    * @param pageSize[IN] the page size of the file the node is in
+    */
+    BTLeafNode(NodeFormat format = NODE_INTERLEAVED, int pageSize = PageFile::PAGE_SIZE);
+    ~BTLeafNode();
+
+   /**
+    * Return the maximum number of keys a leaf node of the format can hold.
+    * A NODE_PACKED node may be full with fewer keys, but can always hold
+    * half of them.
+    * @param format[IN] the layout of the node
+    * @param pageSize[IN] the page size of the file
+    * @return the capacity of the node
     */
-    BTLeafNode();
+    static int getMaxKeyCount(NodeFormat format, int pageSize = PageFile::PAGE_SIZE);
+
+   /**
+    * Return the maximum number of keys this node can hold.
+    * @return the capacity of the node
+    */
+    int getMaxKeyCount() const { return capacity; }
    /**
     * Insert the (key, rid) pair to the node.
     * Remember that all keys inside a B+tree node should be kept sorted.
     * @param key[IN] the key to insert
     * @param rid[IN] the RecordId to insert
-    * @return 0 if successful. Return an error code if the node is full.
+    * @return 0 if successful. RC_NODE_FULL if the node is full.
     */
     RC insert(int key, const RecordId& rid);
 
+   /**
+    * Add the (key, rid) pair after all entries of the node. The key must
+    * not be smaller than the last one. Unlike insert(), which puts a pair
+    * before the entries with an equal key, this keeps pairs moved from
+    * another node in the order they had there.
+    * @param key[IN] the key to add
+    * @param rid[IN] the RecordId to add
+    * @return 0 if successful. RC_NODE_FULL if the node is full.
+    */
+    RC append(int key, const RecordId& rid);
+
    /**
     * Insert the (key, rid) pair to the node
     * and split the node half and half with sibling.
@@ -59,6 +116,22 @@ class BTLeafNode {
     */
     RC insertAndSplit(int key, const RecordId& rid, BTLeafNode& sibling, int& siblingKey);
 
+   /**
+    * Remove the (key, rid) pair of the eid entry from the node.
+    * The entries after it move forward by one.
+    * @param eid[IN] the entry number to remove
+    * @return 0 if successful. Return an error code if there is no such entry.
+    */
+    RC remove(int eid);
+
+   /**
+    * Move all entries of the node after this one to the end of this one.
+    * @param from[IN] the node after this one. It is left empty
+    * @return 0 if successful. RC_NODE_FULL if the entries do not fit,
+    *         and both nodes are left as they were.
+    */
+    RC merge(BTLeafNode& from);
+
    /**
     * If searchKey exists in the node, set eid to the index entry
     * with searchKey and return 0. If not, set eid to the index entry
@@ -72,6 +145,15 @@ class BTLeafNode {
     */
     RC locate(int searchKey, int& eid);
 
+   /**
+    * Set eid to the last index entry with a key not larger than searchKey,
+    * or to -1 if every key in the node is larger than searchKey.
+    * @param searchKey[IN] the key to search for.
+    * @param eid[OUT] the last index entry number with a key up to searchKey.
+    * @return 0 if the key of that entry is searchKey. If not, RC_NO_SUCH_RECORD.
+    */
+    RC locateLast(int searchKey, int& eid);
+
    /**
     * Read the (key, rid) pair from the eid entry.
     * @param eid[IN] the entry number to read the (key, rid) pair from
@@ -81,6 +163,17 @@ class BTLeafNode {
     */
     RC readEntry(int eid, int& key, RecordId& rid);
 
+   /**
+    * Read the n (key, rid) pairs from the eid entry on. A NODE_PACKED
+    * node decodes them a column at a time, several entries at once.
+    * @param eid[IN] the first entry to read
+    * @param n[IN] the # of entries to read, eid + n <= num_of_keys
+    * @param keys[OUT] the keys
+    * @param rids[OUT] the RecordIds
+    * @return 0 if successful. Return an error code if there is an error.
+    */
+    RC readEntries(int eid, int n, int* keys, RecordId* rids);
+
    /**
     * Return the pid of the next slibling node.
     * @return the PageId of the next sibling node
@@ -95,6 +188,19 @@ class BTLeafNode {
     */
     RC setNextNodePtr(PageId pid);
 
+   /**
+    * Return the pid of the previous slibling node.
+    * @return the PageId of the previous sibling node. 0 for the first one
+    */
+    PageId getPrevNodePtr();
+
+   /**
+    * Set the previous slibling node PageId.
+    * @param pid[IN] the PageId of the previous sibling node
+    * @return 0 if successful. Return an error code if there is an error.
+    */
+    RC setPrevNodePtr(PageId pid);
+
    /**
     * Return the number of keys stored in the node.
     * @return the number of keys in the node
@@ -103,6 +209,8 @@ class BTLeafNode {
 
    /**
     * Read the content of the node from the page pid in the PageFile pf.
+    * The page is pinned in the buffer pool and used in place until the
+    * node is modified, read again or destructed.
     * @param pid[IN] the PageId to read
     * @param pf[IN] PageFile to read from
     * @return 0 if successful. Return an error code if there is an error.
@@ -119,11 +227,65 @@ class BTLeafNode {
 
 
   private:
+   /**
+    * Make the node modifiable: copy the pinned page to buffer and unpin it.
+    */
+    void own();
+
+   /**
+    * Unpin the page the node was read from, dropping its content.
+    */
+    void release();
+
+    // a node may hold a pinned page, so it cannot be copied
+    BTLeafNode(const BTLeafNode&);
+    BTLeafNode& operator=(const BTLeafNode&);
+
+    // the location of the key and the RecordId of entry eid,
+    // and of the next and previous node pointers, in the page
+    int keyOffset(int eid) const;
+    int ridOffset(int eid) const;
+    int nextOffset() const;
+    int prevOffset() const;
+
+    // the distance between two consecutive keys in the page
+    int keyStride() const;
+
+   /**
+    * Decode all entries of a NODE_PACKED node.
+    * @param keys[OUT] the keys
+    * @param rids[OUT] the RecordIds
+    */
+    void unpack(std::vector<int>& keys, std::vector<RecordId>& rids);
+
+   /**
+    * Encode the entries of a NODE_PACKED node to buffer, keeping the
+    * next and previous node pointers.
+    * @param keys[IN] the sorted keys
+    * @param rids[IN] the RecordIds
+    * @param n[IN] the # of entries
+    * @return 0 if successful. RC_NODE_FULL if they do not fit, and the node is left alone.
+    */
+    RC pack(const int* keys, const RecordId* rids, int n);
+
+    NodeFormat format;  // the layout of the node
+    int pageSize;       // the size of the page of the node
+    int capacity;       // the maximum number of keys
+
    /**
     * The main memory buffer for loading the content of the disk page
-    * that contains the node.
+    * that contains the node, pageSize bytes. It is allocated when the
+    * node is first changed or cannot be pinned. NULL until then.
+    */
+    char* buffer;
+
+   /**
+    * The content of the node: either buffer, a page pinned by read(),
+    * or a page of zeros for a new node.
     */
-    char buffer[PageFile::PAGE_SIZE];
+    const char* page;
+    const PageFile* pinFile;  // the PageFile page is pinned in. NULL if none
+    PageId pinPid;            // the pinned page
 	
 };
 
@@ -133,7 +295,29 @@ class BTLeafNode {
  */
 class BTNonLeafNode {
   public:
-   BTNonLeafNode();
+   /**
+    * Initialization
+    * @param format[IN] the layout of the node in its page
+    * @param counted[IN] whether the node counts the entries under its children
+    * @param pageSize[IN] the page size of the file the node is in
+    */
+   BTNonLeafNode(NodeFormat format = NODE_INTERLEAVED, bool counted = false, int pageSize = PageFile::PAGE_SIZE);
+   ~BTNonLeafNode();
+
+   /**
+    * Return the maximum number of keys a non-leaf node can hold.
+    * Every layout of a non-leaf node holds the same number of keys.
+    * @param counted[IN] whether the node counts the entries under its children
+    * @param pageSize[IN] the page size of the file
+    * @return the capacity of the node
+    */
+    static int getMaxKeyCount(bool counted, int pageSize = PageFile::PAGE_SIZE);
+
+   /**
+    * Return the maximum number of keys this node can hold.
+    * @return the capacity of the node
+    */
+    int getMaxKeyCount() const { return capacity; }
    
    /**
     * Insert a (key, pid) pair to the node.
@@ -144,6 +328,18 @@ class BTNonLeafNode {
     */
     RC insert(int key, PageId pid);
 
+   /**
+    * Insert a (key, pid) pair to the node as key eid, so that pid comes
+    * right after the eid-th pointer. Among equal keys, only the position
+    * tells which child pid was split from.
+    * @param key[IN] the key to insert
+    * @param pid[IN] the PageId to insert
+    * @param eid[IN] the position of the new key, 0 <= eid <= num_of_keys
+    * @param count[IN] the # of entries under pid
+    * @return 0 if successful. Return an error code if the node is full.
+    */
+    RC insert(int key, PageId pid, int eid, int count = 0);
+
    /**
     * Insert the (key, pid) pair to the node
     * and split the node half and half with sibling.
@@ -158,6 +354,58 @@ class BTNonLeafNode {
     */
     RC insertAndSplit(int key, PageId pid, BTNonLeafNode& sibling, int& midKey);
 
+   /**
+    * Insert the (key, pid) pair to the node as key eid, as by
+    * insert(key, pid, eid), and split the node half and half with sibling.
+    * @param key[IN] the key to insert
+    * @param pid[IN] the PageId to insert
+    * @param eid[IN] the position of the new key, 0 <= eid <= num_of_keys
+    * @param count[IN] the # of entries under pid
+    * @param sibling[IN] the sibling node to split with. This node MUST be empty when this function is called.
+    * @param midKey[OUT] the key in the middle after the split. This key should be inserted to the parent node.
+    * @return 0 if successful. Return an error code if there is an error.
+    */
+    RC insertAndSplit(int key, PageId pid, int eid, int count, BTNonLeafNode& sibling, int& midKey);
+
+   /**
+    * Insert a (pid, key) pair in front of the node: pid becomes the first
+    * pointer and key the first key, followed by the old first pointer.
+    * @param pid[IN] the PageId to insert
+    * @param key[IN] the key to insert, not larger than the keys in the node
+    * @param count[IN] the # of entries under pid
+    * @return 0 if successful. Return an error code if the node is full.
+    */
+    RC insertFirst(PageId pid, int key, int count = 0);
+
+   /**
+    * Remove key eid and the pointer right of it from the node.
+    * @param eid[IN] the key to remove
+    * @return 0 if successful. Return an error code if there is no such key.
+    */
+    RC remove(int eid);
+
+   /**
+    * Remove the first pointer and the first key from the node.
+    * @return 0 if successful. Return an error code if the node has no key.
+    */
+    RC removeFirst();
+
+   /**
+    * Read the eid-th key.
+    * @param eid[IN] the position of the key, 0 <= eid < num_of_keys
+    * @param key[OUT] the key
+    * @return 0 if successful. Return an error code if there is an error.
+    */
+    RC readKey(int eid, int& key);
+
+   /**
+    * Replace the eid-th key.
+    * @param eid[IN] the position of the key, 0 <= eid < num_of_keys
+    * @param key[IN] the new key
+    * @return 0 if successful. Return an error code if there is an error.
+    */
+    RC setKey(int eid, int key);
+
    /**
     * Given the searchKey, find the child-node pointer to follow and
     * output it in pid.
@@ -168,6 +416,75 @@ class BTNonLeafNode {
     */
     RC locateChildPtr(int searchKey, PageId& pid);
 
+   /**
+    * Given the searchKey, find the child-node pointer to follow and
+    * output it in pid, and its position among the pointers in eid.
+    * @param searchKey[IN] the searchKey that is being looked up.
+    * @param pid[OUT] the pointer to the child node to follow.
+    * @param eid[OUT] the position of pid in the node, 0 <= eid <= num_of_keys.
+    * @return 0 if successful. Return an error code if there is an error.
+    */
+    RC locateChildPtr(int searchKey, PageId& pid, int& eid);
+
+   /**
+    * Find the leftmost child node that may hold searchKey, and output
+    * the pointer to it in pid and its position in eid.
+    * @param searchKey[IN] the searchKey that is being looked up.
+    * @param pid[OUT] the pointer to the child node to follow.
+    * @param eid[OUT] the position of pid in the node, 0 <= eid <= num_of_keys.
+    * @return 0 if successful. Return an error code if there is an error.
+    */
+    RC locateFirstChildPtr(int searchKey, PageId& pid, int& eid);
+
+   /**
+    * Read the eid-th child-node pointer.
+    * @param eid[IN] the position of the pointer, 0 <= eid <= num_of_keys
+    * @param pid[OUT] the pointer
+    * @return 0 if successful. Return an error code if there is an error.
+    */
+    RC readChildPtr(int eid, PageId& pid);
+
+   /**
+    * Read the # of entries under the eid-th child-node pointer.
+    * A node that does not count them has 0 under every pointer.
+    * @param eid[IN] the position of the pointer, 0 <= eid <= num_of_keys
+    * @param count[OUT] the # of entries
+    * @return 0 if successful. Return an error code if there is an error.
+    */
+    RC readChildCount(int eid, int& count);
+
+   /**
+    * Set the # of entries under the eid-th child-node pointer.
+    * A node that does not count them ignores it.
+    * @param eid[IN] the position of the pointer, 0 <= eid <= num_of_keys
+    * @param count[IN] the # of entries
+    * @return 0 if successful. Return an error code if there is an error.
+    */
+    RC setChildCount(int eid, int count);
+
+   /**
+    * Return the # of entries under the child-node pointers before the eid-th.
+    * @param eid[IN] the position of the pointer, 0 <= eid <= num_of_keys
+    * @return the # of entries under pointers 0 .. eid-1
+    */
+    int countBefore(int eid);
+
+   /**
+    * Return the # of entries under the node.
+    * @return the # of entries under all child-node pointers
+    */
+    int getEntryCount();
+
+   /**
+    * Find the child node that holds entry n under the node, counting
+    * the entries from 0 in key order.
+    * @param n[IN/OUT] the entry. On return, its number in the child node
+    * @param pid[OUT] the pointer to the child node to follow.
+    * @param eid[OUT] the position of pid in the node, 0 <= eid <= num_of_keys.
+    * @return 0 if successful. RC_NO_SUCH_RECORD if there are not that many entries.
+    */
+    RC locateChildByCount(int& n, PageId& pid, int& eid);
+
    /**
     * Initialize the root node with (pid1, key, pid2).
     * @param pid1[IN] the first PageId to insert
@@ -185,6 +502,8 @@ class BTNonLeafNode {
 
    /**
     * Read the content of the node from the page pid in the PageFile pf.
+    * The page is pinned in the buffer pool and used in place until the
+    * node is modified, read again or destructed.
     * @param pid[IN] the PageId to read
     * @param pf[IN] PageFile to read from
     * @return 0 if successful. Return an error code if there is an error.
@@ -199,12 +518,63 @@ class BTNonLeafNode {
     */
     RC write(PageId pid, PageFile& pf);
 
+   /**
+    * Use the image of a node kept in memory in place, as read() uses a
+    * pinned page. The image must not be freed while the node uses it.
+    * @param image[IN] the content of the node, a page of the file
+    */
+    void view(const char* image);
+
+   /**
+    * Copy the content of the node to an image kept in memory.
+    * @param image[OUT] a page of the file to copy the node to
+    */
+    void copyTo(char* image) const;
+
   private:
+   /**
+    * Make the node modifiable: copy the pinned page or the viewed image
+    * to buffer and unpin the page.
+    */
+    void own();
+
+   /**
+    * Unpin the page the node was read from, dropping its content.
+    */
+    void release();
+
+    // a node may hold a pinned page, so it cannot be copied
+    BTNonLeafNode(const BTNonLeafNode&);
+    BTNonLeafNode& operator=(const BTNonLeafNode&);
+
+    // the location of key i, of the PageId left of key i
+    // (pid i, 0 <= i <= num_of_keys) and of the # of entries under it in the page
+    int keyOffset(int i) const;
+    int pidOffset(int i) const;
+    int countOffset(int i) const;
+
+    // the distance between two consecutive keys in the page
+    int keyStride() const;
+
+    NodeFormat format;  // the layout of the node
+    bool counted;       // whether the node counts the entries under its children
+    int pageSize;       // the size of the page of the node
+    int capacity;       // the maximum number of keys
+
    /**
     * The main memory buffer for loading the content of the disk page
-    * that contains the node.
+    * that contains the node, pageSize bytes. It is allocated when the
+    * node is first changed or cannot be pinned. NULL until then.
+    */
+    char* buffer;
+
+   /**
+    * The content of the node: either buffer, a page pinned by read(), an
+    * image passed to view(), or a page of zeros for a new node.
     */
-    char buffer[PageFile::PAGE_SIZE];
+    const char* page;
+    const PageFile* pinFile;  // the PageFile page is pinned in. NULL if none
+    PageId pinPid;            // the pinned page
 	
 };
 
@@ -0,0 +1,312 @@
+/**
+ * Tests of BTreeIndex that the SQL commands cannot reach: removing pairs,
+ * merging nodes and compacting the tree, checked with locate(), scans
+ * both ways and the counts of entries against a copy of the pairs kept in
+ * memory, and scanning while another thread inserts.
+ */
+
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <set>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include "Bruinbase.h"
+#include "BTreeIndex.h"
+
+using namespace std;
+
+static const char* INDEX_FILE = "btreetest.idx";
+
+static int failures = 0;
+
+#define CHECK(cond, ...) \
+  do { \
+    if (!(cond)) { \
+      fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__); \
+      fprintf(stderr, __VA_ARGS__); \
+      fprintf(stderr, "\n"); \
+      failures++; \
+    } \
+  } while (0)
+
+// the pairs in the index, by key
+typedef multimap<int, RecordId> Pairs;
+
+static const char* formatName(NodeFormat format)
+{
+  switch (format) {
+  case NODE_SOA: return "soa";
+  case NODE_PACKED: return "packed";
+  default: return "interleaved";
+  }
+}
+
+// check that a scan gives every pair in key order, and a backward scan
+// from the last pair in the reverse order
+static void checkScan(BTreeIndex& index, const Pairs& pairs, const char* step)
+{
+  IndexCursor cursor;
+  int key;
+  RecordId rid;
+  vector<int> keys;
+
+  index.locate(INT_MIN, cursor);
+  while (index.readForward(cursor, key, rid) == 0) keys.push_back(key);
+
+  vector<int> expected;
+  for (Pairs::const_iterator it = pairs.begin(); it != pairs.end(); ++it) {
+    expected.push_back(it->first);
+  }
+  CHECK(keys == expected, "%s: scan gave %zu keys, expected %zu", step, keys.size(), expected.size());
+
+  RC rc;
+  keys.clear();
+  index.locateLast(INT_MAX, cursor);
+  while ((rc = index.readBackward(cursor, key, rid)) == 0) keys.push_back(key);
+  reverse(expected.begin(), expected.end());
+  CHECK(rc == RC_END_OF_TREE, "%s: backward scan returned %d", step, rc);
+  CHECK(keys == expected, "%s: backward scan gave %zu keys, expected %zu", step, keys.size(), expected.size());
+}
+
+// check locate(), locateLast() and locateBatch() for every key in [0, range]
+static void checkLocate(BTreeIndex& index, const Pairs& pairs, int range, const char* step)
+{
+  vector<int> keys;
+  for (int k = 0; k <= range; k++) keys.push_back(k);
+  vector<IndexCursor> cursors(keys.size());
+  vector<RC> results(keys.size());
+  CHECK(index.locateBatch(&keys[0], keys.size(), &cursors[0], &results[0]) == 0,
+        "%s: locateBatch failed", step);
+
+  for (int k = 0; k <= range; k++) {
+    IndexCursor cursor;
+    int key;
+    RecordId rid;
+    bool present = (pairs.count(k) > 0);
+    Pairs::const_iterator next = pairs.lower_bound(k);
+
+    // locate() fails only when every key is smaller
+    RC rc = index.locate(k, cursor);
+    CHECK((rc == 0) == (next != pairs.end()), "%s: locate(%d) returned %d", step, k, rc);
+    rc = index.readForward(cursor, key, rid);
+    if (next == pairs.end()) {
+      CHECK(rc != 0, "%s: locate(%d) -> %d past the last key", step, k, key);
+    } else {
+      CHECK(rc == 0 && key == next->first, "%s: locate(%d) -> %d, expected %d",
+            step, k, key, next->first);
+    }
+
+    CHECK((results[k] == 0) == (next != pairs.end()), "%s: locateBatch(%d) returned %d", step, k, results[k]);
+    rc = index.readForward(cursors[k], key, rid);
+    if (next != pairs.end()) {
+      CHECK(rc == 0 && key == next->first, "%s: locateBatch(%d) -> %d, expected %d",
+            step, k, key, next->first);
+    }
+
+    rc = index.locateLast(k, cursor);
+    CHECK((rc == 0) == present, "%s: locateLast(%d) returned %d", step, k, rc);
+  }
+}
+
+// check countRange(), rank() and locateNth() against the pairs, or that
+// they fail if the index does not count entries
+static void checkCounts(BTreeIndex& index, const Pairs& pairs, int range, bool counts, const char* step)
+{
+  IndexCursor cursor;
+  int count, key;
+  RecordId rid;
+  RC rc;
+
+  if (!counts) {
+    CHECK(index.countRange(0, range, count) == RC_INVALID_FILE_FORMAT, "%s: countRange without counts", step);
+    CHECK(index.rank(0, count) == RC_INVALID_FILE_FORMAT, "%s: rank without counts", step);
+    CHECK(index.locateNth(0, cursor) == RC_INVALID_FILE_FORMAT, "%s: locateNth without counts", step);
+    return;
+  }
+
+  vector<int> keys;
+  for (Pairs::const_iterator it = pairs.begin(); it != pairs.end(); ++it) keys.push_back(it->first);
+
+  // ranges of every width, and one over every key
+  const int widths[] = { 0, 1, 17, 500, range };
+  for (int lo = -1; lo <= range + 1; lo += 37) {
+    for (size_t w = 0; w < sizeof(widths) / sizeof(widths[0]); w++) {
+      int hi = lo + widths[w];
+      int expected = upper_bound(keys.begin(), keys.end(), hi) - lower_bound(keys.begin(), keys.end(), lo);
+      rc = index.countRange(lo, hi, count);
+      CHECK(rc == 0 && count == expected, "%s: countRange(%d, %d) = %d, expected %d", step, lo, hi, count, expected);
+    }
+  }
+  rc = index.countRange(INT_MIN, INT_MAX, count);
+  CHECK(rc == 0 && count == (int)keys.size(), "%s: countRange over every key = %d, expected %zu",
+        step, count, keys.size());
+
+  for (int k = -1; k <= range + 1; k++) {
+    int expected = lower_bound(keys.begin(), keys.end(), k) - keys.begin();
+    rc = index.rank(k, count);
+    CHECK(rc == 0 && count == expected, "%s: rank(%d) = %d, expected %d", step, k, count, expected);
+  }
+
+  for (int n = 0; n <= (int)keys.size(); n++) {
+    rc = index.locateNth(n, cursor);
+    if (n == (int)keys.size()) {
+      CHECK(rc == RC_NO_SUCH_RECORD, "%s: locateNth(%d) past the last entry returned %d", step, n, rc);
+      break;
+    }
+    CHECK(rc == 0, "%s: locateNth(%d) returned %d", step, n, rc);
+    rc = index.readForward(cursor, key, rid);
+    CHECK(rc == 0 && key == keys[n], "%s: locateNth(%d) -> %d, expected %d", step, n, key, keys[n]);
+  }
+}
+
+/*
+ * insert pairs with many duplicate keys, so that leaf nodes split, remove
+ * most of them so that leaf nodes borrow and merge, and compact the tree. pairs with a key
+ * equal to a separator may then be left only in the leaf before it.
+ */
+static void testRemove(NodeFormat format, bool pin, bool counts)
+{
+  const int N = 20000;
+  const int RANGE = 4000;
+  BTreeIndex index;
+  Pairs pairs;
+  char step[64];
+
+  unlink(INDEX_FILE);
+  BTreeIndex::setDefaultFormat(format);
+  BTreeIndex::setPinInnerLevels(pin);
+  BTreeIndex::setCountEntries(counts);
+  srand(1);
+
+  if (index.open(INDEX_FILE, 'w') < 0) {
+    CHECK(false, "cannot open %s", INDEX_FILE);
+    return;
+  }
+  for (int i = 0; i < N; i++) {
+    RecordId rid = { i / 9, i % 9 };
+    int key = rand() % RANGE;
+    CHECK(index.insert(key, rid) == 0, "insert(%d) failed", key);
+    pairs.insert(make_pair(key, rid));
+  }
+  sprintf(step, "%s%s%s after insert", formatName(format), pin ? " pinned" : "", counts ? " counted" : "");
+  checkScan(index, pairs, step);
+  checkLocate(index, pairs, RANGE, step);
+  checkCounts(index, pairs, RANGE, counts, step);
+
+  // remove 80% of the pairs in random order
+  vector<pair<int, RecordId> > all(pairs.begin(), pairs.end());
+  for (size_t i = all.size() - 1; i > 0; i--) swap(all[i], all[rand() % (i + 1)]);
+  for (size_t i = 0; i < all.size() * 4 / 5; i++) {
+    RC rc = index.remove(all[i].first, all[i].second);
+    CHECK(rc == 0, "remove(%d) returned %d", all[i].first, rc);
+    Pairs::iterator it = pairs.lower_bound(all[i].first);
+    while (it->second != all[i].second) ++it;
+    pairs.erase(it);
+  }
+  CHECK(index.remove(RANGE + 1, all[0].second) == RC_NO_SUCH_RECORD, "removed a missing pair");
+
+  sprintf(step, "%s%s%s after remove", formatName(format), pin ? " pinned" : "", counts ? " counted" : "");
+  checkScan(index, pairs, step);
+  checkLocate(index, pairs, RANGE, step);
+  checkCounts(index, pairs, RANGE, counts, step);
+
+  CHECK(index.compact(1.0) == 0, "compact failed");
+  sprintf(step, "%s%s%s after compact", formatName(format), pin ? " pinned" : "", counts ? " counted" : "");
+  checkScan(index, pairs, step);
+  checkLocate(index, pairs, RANGE, step);
+  checkCounts(index, pairs, RANGE, counts, step);
+  index.close();
+
+  // and again from the file
+  index.open(INDEX_FILE, 'r');
+  sprintf(step, "%s%s%s reopened", formatName(format), pin ? " pinned" : "", counts ? " counted" : "");
+  checkScan(index, pairs, step);
+  checkLocate(index, pairs, RANGE, step);
+  checkCounts(index, pairs, RANGE, counts, step);
+  index.close();
+}
+
+/*
+ * scan the index in small batches while another thread inserts pairs
+ * with the same keys, splitting the leaf nodes under the cursor. every
+ * pair inserted before the scan must be returned, and no pair twice.
+ * the index counts entries, so the inserts change the counts of the
+ * non-leaf nodes above the scan as well.
+ */
+static void testScanWhileInsert(NodeFormat format)
+{
+  const int N = 20000;
+  const int RANGE = 5000;
+  const int BATCH = 7;
+  BTreeIndex index;
+
+  unlink(INDEX_FILE);
+  BTreeIndex::setDefaultFormat(format);
+  BTreeIndex::setPinInnerLevels(false);
+  BTreeIndex::setCountEntries(true);
+  srand(2);
+
+  if (index.open(INDEX_FILE, 'w') < 0) {
+    CHECK(false, "cannot open %s", INDEX_FILE);
+    return;
+  }
+  for (int i = 0; i < N; i++) {
+    RecordId rid = { i, 0 };
+    index.insert(rand() % RANGE, rid);
+  }
+
+  std::thread writer([&index] {
+    for (int i = 0; i < 2 * N; i++) {
+      RecordId rid = { i, 1 };
+      index.insert(rand() % RANGE, rid);
+      if (i % 64 == 0) std::this_thread::yield();
+    }
+  });
+
+  set<pair<int, int> > seen;
+  int twice = 0;
+  IndexCursor cursor;
+  IndexEntry entries[BATCH];
+  int n;
+  index.locate(INT_MIN, cursor);
+  do {
+    CHECK(index.readForward(cursor, INT_MAX, entries, BATCH, n) == 0, "%s: readForward failed", formatName(format));
+    for (int i = 0; i < n; i++) {
+      if (!seen.insert(make_pair(entries[i].rid.pid, entries[i].rid.sid)).second) twice++;
+    }
+    std::this_thread::yield();
+  } while (n == BATCH);
+  writer.join();
+
+  int missed = 0;
+  for (int i = 0; i < N; i++) {
+    if (seen.count(make_pair(i, 0)) == 0) missed++;
+  }
+  CHECK(twice == 0, "%s: scan returned %d pairs twice", formatName(format), twice);
+  CHECK(missed == 0, "%s: scan missed %d pairs", formatName(format), missed);
+  index.close();
+}
+
+int main()
+{
+  NodeFormat formats[] = { NODE_INTERLEAVED, NODE_SOA, NODE_PACKED };
+
+  for (int f = 0; f < 3; f++) {
+    testRemove(formats[f], false, false);
+    testRemove(formats[f], false, true);
+    testRemove(formats[f], true, true);
+    testScanWhileInsert(formats[f]);
+  }
+
+  unlink(INDEX_FILE);
+  if (failures > 0) {
+    fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+  printf("btree: OK\n");
+  return 0;
+}
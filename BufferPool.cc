@@ -0,0 +1,461 @@
+/*
+ * Copyright (C) 2008 by The Regents of the University of California
+ * Redistribution of this file is permitted under the terms of the GNU
+ * Public License (GPL).
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <sys/uio.h>
+#include "Bruinbase.h"
+#include "BufferPool.h"
+
+using std::mutex;
+using std::lock_guard;
+using std::unique_lock;
+using std::vector;
+
+// write the buffers of iov to fd at off, going on after a short write.
+// the buffers are changed to describe what is left. false on an error
+static bool writeFully(int fd, struct iovec* iov, int n, off_t off)
+{
+  while (n > 0) {
+    ssize_t done = pwritev(fd, iov, n, off);
+    if (done < 0 && errno == EINTR) continue;
+    if (done <= 0) return false;
+    off += done;
+
+    // skip the buffers written, and the part written of the next one
+    while (n > 0 && done >= (ssize_t)iov->iov_len) {
+      done -= iov->iov_len;
+      iov++;
+      n--;
+    }
+    if (n > 0) {
+      iov->iov_base = (char*)iov->iov_base + done;
+      iov->iov_len -= done;
+    }
+  }
+  return true;
+}
+
+size_t BufferPool::PageKeyHash::operator() (const PageKey& k) const
+{
+  // mix the file identity and the page id (FNV-1a style)
+  size_t h = 14695981039346656037UL;
+  h = (h ^ k.file.dev) * 1099511628211UL;
+  h = (h ^ k.file.ino) * 1099511628211UL;
+  h = (h ^ (size_t)k.pid) * 1099511628211UL;
+  return h;
+}
+
+BufferPool::BufferPool(int pageSize, int capacity, int shards)
+{
+  this->pageSize = pageSize;
+  this->writeCount = 0;
+  allocate(capacity, shards);
+}
+
+BufferPool::~BufferPool()
+{
+  release();
+}
+
+RC BufferPool::resize(int capacity, int shards)
+{
+  if (capacity <= 0 || shards <= 0) return RC_INVALID_ATTRIBUTE;
+
+  // dirty pages must reach the disk before their frames go away
+  for (unsigned n = 0; n < this->shards.size(); n++) {
+    Shard& s = *this->shards[n];
+    lock_guard<mutex> guard(s.lock);
+    for (unsigned i = 0; i < s.frames.size(); i++) {
+      RC rc;
+      Frame& f = s.frames[i];
+      if (f.dirty && (rc = flushShard(s, f.key.file, f.fd)) < 0) return rc;
+    }
+  }
+
+  release();
+  allocate(capacity, shards);
+  return 0;
+}
+
+void BufferPool::allocate(int capacity, int shards)
+{
+  // never have more shards than pages
+  if (shards > capacity) shards = capacity;
+
+  this->capacity = 0;
+  for (int i = 0; i < shards; i++) {
+    Shard* s = new Shard;
+
+    // spread the pages over the shards as evenly as possible
+    int n = capacity / shards + ((i < capacity % shards) ? 1 : 0);
+    s->frames.resize(n);
+    for (int j = 0; j < n; j++) {
+      s->frames[j].used = false;
+      s->frames[j].valid = false;
+      s->frames[j].background = false;
+      s->frames[j].ref = false;
+      s->frames[j].dirty = false;
+      s->frames[j].pins = 0;
+    }
+    s->data = (char*) malloc((size_t)n * pageSize);
+    s->hand = 0;
+    s->table.reserve(n);
+
+    this->shards.push_back(s);
+    this->capacity += n;
+  }
+}
+
+void BufferPool::release()
+{
+  for (unsigned i = 0; i < shards.size(); i++) {
+    free(shards[i]->data);
+    delete shards[i];
+  }
+  shards.clear();
+  capacity = 0;
+}
+
+BufferPool::Shard& BufferPool::shardOf(const PageKey& key)
+{
+  // consecutive pages share a shard so that a run of them can be
+  // handled under a single lock
+  PageKey run = key;
+  run.pid = key.pid / SHARD_RUN;
+  return *shards[PageKeyHash()(run) % shards.size()];
+}
+
+int BufferPool::victim(Shard& s)
+{
+  // advance the clock hand until we find a frame that has not been
+  // referenced since the last sweep, clearing reference bits on the way.
+  // after two full sweeps every unpinned frame has been considered.
+  int n = s.frames.size();
+  for (int step = 0; step < 2 * n; step++) {
+    Frame& f = s.frames[s.hand];
+    int i = s.hand;
+    s.hand = (s.hand + 1) % n;
+
+    if (!f.used) return i;
+    if (f.pins > 0) continue;
+    if (f.ref) {
+      f.ref = false;
+      continue;
+    }
+
+    // a dirty page is written back before it is evicted, together with
+    // the other dirty pages of its file in this shard. if that fails,
+    // the page is kept and the next frame is tried
+    if (f.dirty && flushShard(s, f.key.file, f.fd) < 0) continue;
+
+    // evict the page in the frame
+    s.table.erase(f.key);
+    f.used = false;
+    f.valid = false;
+    return i;
+  }
+
+  return -1;
+}
+
+int BufferPool::lookup(Shard& s, const PageKey& key, unique_lock<mutex>& guard)
+{
+  std::unordered_map<PageKey, int, PageKeyHash>::iterator it;
+
+  for (;;) {
+    it = s.table.find(key);
+    if (it == s.table.end()) return -1;
+    if (s.frames[it->second].valid) return it->second;
+
+    // a background read is loaded only when the file that started it
+    // collects it, which need not happen while we wait. leave the frame
+    // to the read, and the page to be cached again in another frame
+    if (s.frames[it->second].background) {
+      s.table.erase(it);
+      return -1;
+    }
+
+    // another thread is reading the page from the disk
+    s.loading.wait(guard);
+  }
+}
+
+char* BufferPool::pin(const FileId& file, PageId pid, bool& cached)
+{
+  PageKey key = { file, pid };
+  Shard& s = shardOf(key);
+  unique_lock<mutex> guard(s.lock);
+  int i;
+
+  if ((i = lookup(s, key, guard)) >= 0) {
+    cached = true;
+  } else {
+    // reserve a frame. the caller loads the page into it
+    if ((i = victim(s)) < 0) return NULL;
+    s.frames[i].key = key;
+    s.frames[i].used = true;
+    s.frames[i].valid = false;
+    s.frames[i].background = false;
+    s.table[key] = i;
+    cached = false;
+  }
+
+  s.frames[i].pins++;
+  s.frames[i].ref = true;
+  return s.data + (size_t)i * pageSize;
+}
+
+char* BufferPool::reserve(const FileId& file, PageId pid, bool& cached)
+{
+  PageKey key = { file, pid };
+  Shard& s = shardOf(key);
+  lock_guard<mutex> guard(s.lock);
+  int i;
+
+  cached = (s.table.count(key) > 0);
+  if (cached || (i = victim(s)) < 0) return NULL;
+
+  s.frames[i].key = key;
+  s.frames[i].used = true;
+  s.frames[i].valid = false;
+  s.frames[i].background = true;
+  s.frames[i].dirty = false;
+  s.frames[i].pins = 1;
+  s.frames[i].ref = true;
+  s.table[key] = i;
+  return s.data + (size_t)i * pageSize;
+}
+
+void BufferPool::finished(const FileId& file, PageId pid, const char* frame, bool ok)
+{
+  PageKey key = { file, pid };
+  Shard& s = shardOf(key);
+  lock_guard<mutex> guard(s.lock);
+
+  int i = (frame - s.data) / pageSize;
+  Frame& f = s.frames[i];
+  std::unordered_map<PageKey, int, PageKeyHash>::iterator it = s.table.find(key);
+  bool taken = (it == s.table.end() || it->second != i);
+
+  f.background = false;
+  if (ok && !taken) {
+    f.valid = true;
+    f.pins--;
+    return;
+  }
+
+  // the page could not be read, or is cached in another frame now
+  if (!taken) s.table.erase(it);
+  f.used = false;
+  f.valid = false;
+  f.ref = false;
+  f.pins = 0;
+}
+
+void BufferPool::loaded(const FileId& file, PageId pid)
+{
+  PageKey key = { file, pid };
+  Shard& s = shardOf(key);
+  lock_guard<mutex> guard(s.lock);
+
+  std::unordered_map<PageKey, int, PageKeyHash>::iterator it = s.table.find(key);
+  if (it == s.table.end()) return;
+
+  s.frames[it->second].valid = true;
+  s.loading.notify_all();
+}
+
+void BufferPool::discard(const FileId& file, PageId pid)
+{
+  PageKey key = { file, pid };
+  Shard& s = shardOf(key);
+  lock_guard<mutex> guard(s.lock);
+
+  std::unordered_map<PageKey, int, PageKeyHash>::iterator it = s.table.find(key);
+  if (it == s.table.end()) return;
+
+  Frame& f = s.frames[it->second];
+  s.table.erase(it);
+  f.used = false;
+  f.valid = false;
+  f.ref = false;
+  f.dirty = false;
+  f.pins = 0;
+
+  // the waiting threads find the page missing and read it themselves
+  s.loading.notify_all();
+}
+
+void BufferPool::unpin(const FileId& file, PageId pid)
+{
+  PageKey key = { file, pid };
+  Shard& s = shardOf(key);
+  lock_guard<mutex> guard(s.lock);
+
+  std::unordered_map<PageKey, int, PageKeyHash>::iterator it = s.table.find(key);
+  if (it == s.table.end()) return;
+
+  if (s.frames[it->second].pins > 0) s.frames[it->second].pins--;
+}
+
+bool BufferPool::get(const FileId& file, PageId pid, void* buffer)
+{
+  PageKey key = { file, pid };
+  Shard& s = shardOf(key);
+  unique_lock<mutex> guard(s.lock);
+  int i;
+
+  if ((i = lookup(s, key, guard)) < 0) return false;
+
+  memcpy(buffer, s.data + (size_t)i * pageSize, pageSize);
+  s.frames[i].ref = true;
+  return true;
+}
+
+bool BufferPool::put(const FileId& file, PageId pid, const void* buffer, int dirtyFd)
+{
+  PageKey key = { file, pid };
+  Shard& s = shardOf(key);
+  unique_lock<mutex> guard(s.lock);
+  int i;
+
+  // overwrite the cached copy if there is one. otherwise take a new frame.
+  // when every frame is pinned, the page is simply not cached
+  if ((i = lookup(s, key, guard)) < 0) {
+    if ((i = victim(s)) < 0) return false;
+    s.frames[i].key = key;
+    s.frames[i].used = true;
+    s.frames[i].valid = true;
+    s.frames[i].background = false;
+    s.frames[i].dirty = false;
+    s.table[key] = i;
+  }
+
+  // the buffer may be the frame itself when a pinned page is written back
+  char* frame = s.data + (size_t)i * pageSize;
+  if (frame != buffer) memcpy(frame, buffer, pageSize);
+  s.frames[i].ref = true;
+
+  // a page written through to the disk is clean again
+  s.frames[i].dirty = (dirtyFd >= 0);
+  s.frames[i].fd = dirtyFd;
+
+  return true;
+}
+
+RC BufferPool::flush(const FileId& file)
+{
+  vector<DirtyPage> pages;
+  int fd = -1;
+  RC  rc;
+
+  // lock every shard, in order, to collect the dirty pages of the file
+  for (unsigned n = 0; n < shards.size(); n++) {
+    Shard& s = *shards[n];
+    s.lock.lock();
+    for (unsigned i = 0; i < s.frames.size(); i++) {
+      Frame& f = s.frames[i];
+      if (f.dirty && f.key.file.dev == file.dev && f.key.file.ino == file.ino) {
+        DirtyPage d = { f.key.pid, &f, s.data + (size_t)i * pageSize };
+        pages.push_back(d);
+        fd = f.fd;
+      }
+    }
+  }
+
+  rc = pages.empty() ? 0 : writeBack(pages, fd);
+
+  for (unsigned n = 0; n < shards.size(); n++) {
+    shards[n]->lock.unlock();
+  }
+  return rc;
+}
+
+RC BufferPool::flushShard(Shard& s, const FileId& file, int fd)
+{
+  vector<DirtyPage> pages;
+
+  for (unsigned i = 0; i < s.frames.size(); i++) {
+    Frame& f = s.frames[i];
+    if (f.dirty && f.key.file.dev == file.dev && f.key.file.ino == file.ino) {
+      DirtyPage d = { f.key.pid, &f, s.data + (size_t)i * pageSize };
+      pages.push_back(d);
+    }
+  }
+
+  return writeBack(pages, fd);
+}
+
+RC BufferPool::writeBack(vector<DirtyPage>& pages, int fd)
+{
+  struct iovec iov[IOV_MAX];
+
+  std::sort(pages.begin(), pages.end());
+
+  // write every run of consecutive pages with a single call
+  unsigned i = 0;
+  while (i < pages.size()) {
+    int n = 0;
+    do {
+      iov[n].iov_base = pages[i + n].data;
+      iov[n].iov_len = pageSize;
+      n++;
+    } while (i + n < pages.size() && n < IOV_MAX &&
+             pages[i + n].pid == pages[i].pid + n);
+
+    if (!writeFully(fd, iov, n, (off_t)pages[i].pid * pageSize)) {
+      return RC_FILE_WRITE_FAILED;
+    }
+
+    for (int j = 0; j < n; j++) {
+      pages[i + j].frame->dirty = false;
+    }
+    writeCount += n;
+    i += n;
+  }
+
+  return 0;
+}
+
+void BufferPool::erase(const FileId& file, PageId pid)
+{
+  PageKey key = { file, pid };
+  Shard& s = shardOf(key);
+  unique_lock<mutex> guard(s.lock);
+  int i;
+
+  // pinned pages must stay where they are and dirty pages must be kept
+  if ((i = lookup(s, key, guard)) < 0) return;
+  if (s.frames[i].pins > 0 || s.frames[i].dirty) return;
+
+  s.table.erase(key);
+  s.frames[i].used = false;
+  s.frames[i].valid = false;
+  s.frames[i].ref = false;
+}
+
+void BufferPool::eraseFile(const FileId& file)
+{
+  for (unsigned n = 0; n < shards.size(); n++) {
+    Shard& s = *shards[n];
+    lock_guard<mutex> guard(s.lock);
+
+    for (unsigned i = 0; i < s.frames.size(); i++) {
+      Frame& f = s.frames[i];
+      if (f.used && f.pins == 0 && !f.dirty &&
+          f.key.file.dev == file.dev && f.key.file.ino == file.ino) {
+        s.table.erase(f.key);
+        f.used = false;
+        f.valid = false;
+        f.ref = false;
+      }
+    }
+  }
+}
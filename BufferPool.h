@@ -0,0 +1,246 @@
+/*
+ * Copyright (C) 2008 by The Regents of the University of California
+ * Redistribution of this file is permitted under the terms of the GNU
+ * Public License (GPL).
+ */
+
+#ifndef BUFFERPOOL_H
+#define BUFFERPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "Bruinbase.h"
+
+typedef int PageId;
+
+/**
+ * identifies a unix file independent of the descriptor it is opened with,
+ * so that cached pages survive closing and reopening the file.
+ */
+typedef struct {
+  unsigned long dev;  // device of the file
+  unsigned long ino;  // inode number of the file
+} FileId;
+
+/**
+ * page cache shared by all PageFiles.
+ * pages are looked up in a hash table keyed on (file, pid) and replaced
+ * with the CLOCK policy. pinned pages are never replaced. the pool is
+ * split into shards, each with its own lock, hash table and clock hand,
+ * so that concurrent lookups of different pages rarely wait for each
+ * other. a run of SHARD_RUN consecutive pages of a file always maps to
+ * the same shard.
+ */
+class BufferPool {
+ public:
+
+  static const int DEFAULT_CAPACITY = 1024;  // # pages cached by default
+  static const int DEFAULT_SHARDS = 8;       // # shards by default
+  static const int SHARD_RUN = 8;            // # consecutive pages per shard
+
+  /**
+   * @param pageSize[IN] the size of a cached page
+   * @param capacity[IN] the total # of pages to cache
+   * @param shards[IN] the # of shards to split the pool into
+   */
+  BufferPool(int pageSize, int capacity = DEFAULT_CAPACITY, int shards = DEFAULT_SHARDS);
+  ~BufferPool();
+
+  /**
+   * change the size of the pool. all cached pages are dropped.
+   * must not be called while another thread uses the pool.
+   * @param capacity[IN] the total # of pages to cache
+   * @param shards[IN] the # of shards to split the pool into
+   * @return error code. 0 if no error
+   */
+  RC resize(int capacity, int shards);
+
+  /**
+   * @return the total # of pages the pool can cache
+   */
+  int getCapacity() const { return capacity; }
+
+  /**
+   * pin a page in its frame so that it stays at the same address until
+   * unpin() is called. if the page is not cached, a frame is reserved for
+   * it and cached is set to false: the caller must then fill the frame
+   * with the content of the page and call loaded(), or call discard() if
+   * the page could not be read. other threads pinning the page meanwhile
+   * wait until it is loaded.
+   * @param file[IN] the file of the page
+   * @param pid[IN] the page to pin
+   * @param cached[OUT] whether the frame already holds the page
+   * @return the frame holding the page. NULL if every frame is pinned
+   */
+  char* pin(const FileId& file, PageId pid, bool& cached);
+
+  /**
+   * reserve a pinned frame for a page read in the background, e.g., by
+   * io_uring. unlike a frame reserved by pin(), nobody waits for it: the
+   * read completes only when its issuer collects it, so a thread that
+   * needs the page before then takes the page to another frame and reads
+   * it itself. the read must be ended by finished().
+   * @param file[IN] the file of the page
+   * @param pid[IN] the page to read
+   * @param cached[OUT] whether the page is cached or being read already
+   * @return the frame to read the page into. NULL if the page is cached
+   *         or every frame is pinned
+   */
+  char* reserve(const FileId& file, PageId pid, bool& cached);
+
+  /**
+   * end a background read into a frame reserved by reserve(), and unpin
+   * the frame. if the page was taken to another frame meanwhile, the
+   * frame is simply released.
+   * @param file[IN] the file of the page
+   * @param pid[IN] the page that was read
+   * @param frame[IN] the frame returned by reserve()
+   * @param ok[IN] whether the whole page was read into the frame
+   */
+  void finished(const FileId& file, PageId pid, const char* frame, bool ok);
+
+  /**
+   * mark a frame reserved by pin() as holding the content of its page.
+   * @param file[IN] the file of the page
+   * @param pid[IN] the page that was read into the frame
+   */
+  void loaded(const FileId& file, PageId pid);
+
+  /**
+   * release a frame reserved by pin() whose page could not be read.
+   * @param file[IN] the file of the page
+   * @param pid[IN] the page that could not be read
+   */
+  void discard(const FileId& file, PageId pid);
+
+  /**
+   * release a page pinned by pin(). the page may be evicted afterwards.
+   * @param file[IN] the file of the page
+   * @param pid[IN] the page to unpin
+   */
+  void unpin(const FileId& file, PageId pid);
+
+  /**
+   * copy a cached page to the buffer.
+   * @param file[IN] the file of the page
+   * @param pid[IN] the page to look up
+   * @param buffer[OUT] the buffer to copy the page to
+   * @return true if the page was cached
+   */
+  bool get(const FileId& file, PageId pid, void* buffer);
+
+  /**
+   * cache the content of a page, evicting another page if necessary.
+   * a dirty page is written to the disk only when it is evicted or
+   * flushed; until then the pool holds the only up-to-date copy.
+   * @param file[IN] the file of the page
+   * @param pid[IN] the page to cache
+   * @param buffer[IN] the content of the page
+   * @param dirtyFd[IN] the descriptor to write the page back to later.
+   *                    -1 if the page is already on the disk
+   * @return false if the page could not be cached (every frame is pinned)
+   */
+  bool put(const FileId& file, PageId pid, const void* buffer, int dirtyFd = -1);
+
+  /**
+   * write all dirty pages of a file to the disk in pid order.
+   * consecutive dirty pages are written with a single pwritev() call.
+   * @param file[IN] the file whose dirty pages are written
+   * @return error code. 0 if no error
+   */
+  RC flush(const FileId& file);
+
+  /**
+   * drop a page from the pool if it is cached and neither pinned nor dirty.
+   * @param file[IN] the file of the page
+   * @param pid[IN] the page to drop
+   */
+  void erase(const FileId& file, PageId pid);
+
+  /**
+   * drop all cached pages of a file that are neither pinned nor dirty.
+   * @param file[IN] the file whose pages are dropped
+   */
+  void eraseFile(const FileId& file);
+
+  /**
+   * @return the total # of dirty pages written to the disk
+   */
+  int getWriteCount() const { return writeCount; }
+
+ private:
+  struct PageKey {
+    FileId file;
+    PageId pid;
+    bool operator== (const PageKey& k) const {
+      return pid == k.pid && file.ino == k.file.ino && file.dev == k.file.dev;
+    }
+  };
+
+  struct PageKeyHash {
+    size_t operator() (const PageKey& k) const;
+  };
+
+  struct Frame {
+    PageKey key;   // the page held in the frame
+    bool    used;  // does the frame hold a page?
+    bool    valid; // has the content of the page been loaded?
+    bool    background; // is the page being read by reserve()?
+    bool    ref;   // reference bit for CLOCK
+    bool    dirty; // is the page newer than the disk?
+    int     fd;    // the descriptor to write a dirty page back to
+    int     pins;  // # of pin() calls not yet matched by unpin()
+  };
+
+  // a dirty page to be written back
+  struct DirtyPage {
+    PageId pid;
+    Frame* frame;
+    char*  data;
+    bool operator< (const DirtyPage& d) const { return pid < d.pid; }
+  };
+
+  struct Shard {
+    std::mutex lock;
+    std::condition_variable loading;  // signaled when a frame is loaded
+    std::unordered_map<PageKey, int, PageKeyHash> table;  // page -> frame
+    std::vector<Frame> frames;
+    char* data;   // page contents, frames.size() pages
+    int   hand;   // the clock hand
+  };
+
+  // find the shard a page belongs to
+  Shard& shardOf(const PageKey& key);
+
+  // pick a frame in the shard to hold a new page, evicting its old page.
+  // returns -1 if every frame is pinned. the shard must be locked.
+  int victim(Shard& s);
+
+  // write the dirty pages of the file held in the shard, e.g., to evict
+  // one of them. the shard must be locked.
+  RC flushShard(Shard& s, const FileId& file, int fd);
+
+  // write the pages to fd in pid order, coalescing consecutive pages
+  // into single pwritev() calls, and mark them clean
+  RC writeBack(std::vector<DirtyPage>& pages, int fd);
+
+  // find the frame of a cached page, waiting while pin() loads it.
+  // a page being read by reserve() is taken out of the table instead.
+  // returns -1 if the page is not cached. the shard must be locked.
+  int lookup(Shard& s, const PageKey& key, std::unique_lock<std::mutex>& guard);
+
+  // allocate or release the shards
+  void allocate(int capacity, int shards);
+  void release();
+
+  int pageSize;
+  int capacity;
+  std::atomic<int> writeCount;  // # of dirty pages written back
+  std::vector<Shard*> shards;
+};
+
+#endif /* BUFFERPOOL_H */
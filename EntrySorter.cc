@@ -0,0 +1,142 @@
+/*
+ * Copyright (C) 2008 by The Regents of the University of California
+ * Redistribution of this file is permitted under the terms of the GNU
+ * Public License (GPL).
+ */
+
+#include <algorithm>
+#include "Bruinbase.h"
+#include "EntrySorter.h"
+
+using std::vector;
+
+bool operator< (const IndexEntry& e1, const IndexEntry& e2)
+{
+  if (e1.key < e2.key) return true;
+  if (e1.key > e2.key) return false;
+  return (e1.rid < e2.rid);
+}
+
+EntrySorter::EntrySorter(int runSize)
+{
+  this->runSize = (runSize > 0) ? runSize : DEFAULT_RUN_SIZE;
+  count = 0;
+  pos = 0;
+}
+
+EntrySorter::~EntrySorter()
+{
+  for (unsigned i = 0; i < runs.size(); i++) {
+    if (runs[i] != NULL) fclose(runs[i]);
+  }
+}
+
+RC EntrySorter::add(int key, const RecordId& rid)
+{
+  RC rc;
+  IndexEntry e;
+
+  // the buffer is full. write it out as a sorted run
+  if ((int)buf.size() >= runSize) {
+    if ((rc = spill()) < 0) return rc;
+  }
+
+  e.key = key;
+  e.rid = rid;
+  buf.push_back(e);
+  count++;
+
+  return 0;
+}
+
+RC EntrySorter::sort()
+{
+  RC rc;
+
+  // everything fits in memory. no need to merge
+  if (runs.empty()) {
+    std::sort(buf.begin(), buf.end());
+    pos = 0;
+    return 0;
+  }
+
+  // spill the rest of the entries and merge all runs
+  if (!buf.empty()) {
+    if ((rc = spill()) < 0) return rc;
+  }
+
+  heap.clear();
+  for (unsigned i = 0; i < runs.size(); i++) {
+    rewind(runs[i]);
+    if ((rc = fill(i)) < 0) return rc;
+  }
+
+  return 0;
+}
+
+RC EntrySorter::next(int& key, RecordId& rid)
+{
+  RC rc;
+
+  // the entries are in memory
+  if (runs.empty()) {
+    if (pos >= (int)buf.size()) return RC_END_OF_ENTRIES;
+    key = buf[pos].key;
+    rid = buf[pos].rid;
+    pos++;
+    return 0;
+  }
+
+  // pop the smallest entry from the merge heap and refill it from its run
+  if (heap.empty()) return RC_END_OF_ENTRIES;
+
+  std::pop_heap(heap.begin(), heap.end(), greater);
+  HeapItem top = heap.back();
+  heap.pop_back();
+
+  key = top.entry.key;
+  rid = top.entry.rid;
+
+  if ((rc = fill(top.run)) < 0) return rc;
+
+  return 0;
+}
+
+RC EntrySorter::spill()
+{
+  FILE* run;
+
+  std::sort(buf.begin(), buf.end());
+
+  // the run is removed automatically when it is closed
+  if ((run = tmpfile()) == NULL) return RC_FILE_OPEN_FAILED;
+  runs.push_back(run);
+
+  if (fwrite(&buf[0], sizeof(IndexEntry), buf.size(), run) != buf.size()) {
+    return RC_FILE_WRITE_FAILED;
+  }
+  buf.clear();
+
+  return 0;
+}
+
+RC EntrySorter::fill(int n)
+{
+  HeapItem item;
+
+  if (fread(&item.entry, sizeof(IndexEntry), 1, runs[n]) != 1) {
+    // the run is exhausted or could not be read
+    return ferror(runs[n]) ? RC_FILE_READ_FAILED : 0;
+  }
+
+  item.run = n;
+  heap.push_back(item);
+  std::push_heap(heap.begin(), heap.end(), greater);
+
+  return 0;
+}
+
+bool EntrySorter::greater(const HeapItem& h1, const HeapItem& h2)
+{
+  return (h2.entry < h1.entry);
+}
@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2008 by The Regents of the University of California
+ * Redistribution of this file is permitted under the terms of the GNU
+ * Public License (GPL).
+ */
+
+#ifndef ENTRYSORTER_H
+#define ENTRYSORTER_H
+
+#include <cstdio>
+#include <vector>
+#include "Bruinbase.h"
+#include "RecordFile.h"
+
+/**
+ * A (key, RecordId) pair that is fed to or read from a b+tree index.
+ */
+typedef struct {
+  int      key;  // the index key
+  RecordId rid;  // the record the key points to
+} IndexEntry;
+
+// IndexEntry comparator: order by key first and then by rid
+bool operator< (const IndexEntry& e1, const IndexEntry& e2);
+
+/**
+ * sorts a stream of (key, RecordId) pairs in (key, rid) order.
+ * entries are kept in memory until runSize entries are buffered.
+ * after that, every full buffer is sorted and spilled to a temporary
+ * file as a sorted run, and the runs are merged when the entries are read.
+ * usage: add() all entries, call sort() once, then next() until it
+ * returns RC_END_OF_ENTRIES.
+ */
+class EntrySorter {
+ public:
+
+  // default # entries kept in memory before spilling a run (12MB)
+  static const int DEFAULT_RUN_SIZE = 1 << 20;
+
+  EntrySorter(int runSize = DEFAULT_RUN_SIZE);
+  ~EntrySorter();
+
+  /**
+   * add a (key, rid) pair to the sorter.
+   * @param key[IN] the key of the entry
+   * @param rid[IN] the RecordId of the entry
+   * @return error code. 0 if no error
+   */
+  RC add(int key, const RecordId& rid);
+
+  /**
+   * finish the input and prepare the entries to be read in sorted order.
+   * @return error code. 0 if no error
+   */
+  RC sort();
+
+  /**
+   * read the next entry in (key, rid) order.
+   * @param key[OUT] the key of the entry
+   * @param rid[OUT] the RecordId of the entry
+   * @return 0 if an entry is returned. RC_END_OF_ENTRIES at the end
+   */
+  RC next(int& key, RecordId& rid);
+
+  /**
+   * @return the total # of entries added to the sorter
+   */
+  int size() const { return count; }
+
+ private:
+  // sort the in-memory buffer and write it to a temporary file as a run
+  RC spill();
+
+  // read the next entry of the n'th run into the merge heap
+  RC fill(int n);
+
+  int runSize;                    // max # entries in the in-memory buffer
+  int count;                      // total # of entries added
+  int pos;                        // read position when there is no run
+  std::vector<IndexEntry> buf;    // in-memory buffer
+  std::vector<FILE*> runs;        // sorted runs spilled to temporary files
+
+  // the merge heap: the smallest unread entry of every run
+  struct HeapItem {
+    IndexEntry entry;
+    int        run;
+  };
+  std::vector<HeapItem> heap;
+
+  // heap comparator: the smallest entry comes to the front
+  static bool greater(const HeapItem& h1, const HeapItem& h2);
+};
+
+#endif /* ENTRYSORTER_H */
@@ -0,0 +1,162 @@
+/*
+ * Copyright (C) 2008 by The Regents of the University of California
+ * Redistribution of this file is permitted under the terms of the GNU
+ * Public License (GPL).
+ */
+
+#include <cerrno>
+#include <cstring>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "IoRing.h"
+
+static int io_uring_setup(unsigned entries, struct io_uring_params* p)
+{
+  return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned submit, unsigned complete, unsigned flags)
+{
+  return (int) syscall(__NR_io_uring_enter, fd, submit, complete, flags, NULL, 0);
+}
+
+IoRing::IoRing(unsigned entries)
+{
+  struct io_uring_params p;
+
+  fd = -1;
+  this->entries = 0;
+  queued = inflight = 0;
+  sqMap = cqMap = sqes = MAP_FAILED;
+  sqMapSize = cqMapSize = sqesSize = 0;
+
+  memset(&p, 0, sizeof(p));
+  int rfd = io_uring_setup(entries, &p);
+  if (rfd < 0) return;
+
+  // map the submission queue, the completion queue and the queue entries.
+  // newer kernels let both queues share one mapping
+  sqMapSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cqMapSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (cqMapSize > sqMapSize) sqMapSize = cqMapSize;
+    cqMapSize = 0;
+  }
+
+  sqMap = mmap(NULL, sqMapSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, rfd, IORING_OFF_SQ_RING);
+  if (sqMap == MAP_FAILED) { ::close(rfd); return; }
+
+  if (cqMapSize > 0) {
+    cqMap = mmap(NULL, cqMapSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, rfd, IORING_OFF_CQ_RING);
+    if (cqMap == MAP_FAILED) { munmap(sqMap, sqMapSize); sqMap = MAP_FAILED; ::close(rfd); return; }
+  }
+  char* cq = (char*) ((cqMapSize > 0) ? cqMap : sqMap);
+
+  sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+  sqes = mmap(NULL, sqesSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, rfd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    munmap(sqMap, sqMapSize); sqMap = MAP_FAILED;
+    if (cqMapSize > 0) { munmap(cqMap, cqMapSize); cqMap = MAP_FAILED; }
+    ::close(rfd);
+    return;
+  }
+
+  char* sq = (char*) sqMap;
+  sqHead  = (unsigned*) (sq + p.sq_off.head);
+  sqTail  = (unsigned*) (sq + p.sq_off.tail);
+  sqMask  = (unsigned*) (sq + p.sq_off.ring_mask);
+  sqArray = (unsigned*) (sq + p.sq_off.array);
+  cqHead  = (unsigned*) (cq + p.cq_off.head);
+  cqTail  = (unsigned*) (cq + p.cq_off.tail);
+  cqMask  = (unsigned*) (cq + p.cq_off.ring_mask);
+  cqes    = cq + p.cq_off.cqes;
+
+  fd = rfd;
+  this->entries = p.sq_entries;
+}
+
+IoRing::~IoRing()
+{
+  unsigned long tag;
+  int res;
+
+  if (fd < 0) return;
+
+  // the kernel may still write into the buffers of unfinished reads
+  submit();
+  while (inflight > 0 && complete(tag, res, true));
+
+  munmap(sqes, sqesSize);
+  if (cqMapSize > 0) munmap(cqMap, cqMapSize);
+  munmap(sqMap, sqMapSize);
+  ::close(fd);
+}
+
+bool IoRing::read(int fd, void* buf, size_t len, off_t off, unsigned long tag)
+{
+  if (this->fd < 0 || inflight >= entries) return false;
+
+  unsigned tail = *sqTail;
+  unsigned idx = tail & *sqMask;
+  struct io_uring_sqe* sqe = (struct io_uring_sqe*) sqes + idx;
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = fd;
+  sqe->addr = (unsigned long) buf;
+  sqe->len = len;
+  sqe->off = off;
+  sqe->user_data = tag;
+  sqArray[idx] = idx;
+
+  // publish the entry to the kernel
+  __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+
+  queued++;
+  inflight++;
+  return true;
+}
+
+int IoRing::submit()
+{
+  if (fd < 0) return -EINVAL;
+
+  int started = 0;
+  while (queued > 0) {
+    int n = io_uring_enter(fd, queued, 0, 0);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return -errno;
+    }
+    queued -= n;
+    started += n;
+  }
+  return started;
+}
+
+bool IoRing::complete(unsigned long& tag, int& res, bool wait)
+{
+  if (fd < 0) return false;
+
+  for (;;) {
+    unsigned head = *cqHead;
+    if (head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe* cqe = (struct io_uring_cqe*) cqes + (head & *cqMask);
+      tag = cqe->user_data;
+      res = cqe->res;
+      __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+      inflight--;
+      return true;
+    }
+
+    if (!wait || inflight == 0) return false;
+    if (queued > 0 && submit() < 0) return false;
+
+    // nothing has finished yet. sleep until a read does
+    if (io_uring_enter(fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+      return false;
+    }
+  }
+}
@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2008 by The Regents of the University of California
+ * Redistribution of this file is permitted under the terms of the GNU
+ * Public License (GPL).
+ */
+
+#ifndef IORING_H
+#define IORING_H
+
+#include <cstddef>
+#include <sys/types.h>
+
+/**
+ * a minimal Linux io_uring submission/completion queue pair, used to keep
+ * many page reads in flight at once. it talks to the kernel directly with
+ * the io_uring_setup/io_uring_enter system calls and needs no library.
+ * reads are queued with read(), handed to the kernel with submit(), and
+ * their results are collected with complete() in any order.
+ * an IoRing is not thread-safe; the owner must serialize the calls.
+ */
+class IoRing {
+ public:
+
+  /**
+   * set up a ring. if io_uring is not available (an old kernel or a
+   * sandbox that forbids it), the ring is unusable and ok() returns false.
+   * @param entries[IN] the # of reads that can be in flight at once
+   */
+  IoRing(unsigned entries);
+  ~IoRing();
+
+  /**
+   * @return true if the ring was set up and can be used
+   */
+  bool ok() const { return fd >= 0; }
+
+  /**
+   * @return the # of reads that can be in flight at once
+   */
+  unsigned capacity() const { return entries; }
+
+  /**
+   * @return the # of reads queued or submitted but not yet completed
+   */
+  unsigned pending() const { return inflight; }
+
+  /**
+   * queue a read. it is started by the next submit().
+   * @param fd[IN] the file to read from
+   * @param buf[OUT] the buffer to read into
+   * @param len[IN] the # of bytes to read
+   * @param off[IN] the offset in the file to read from
+   * @param tag[IN] returned by complete() when the read finishes
+   * @return false if the ring is full
+   */
+  bool read(int fd, void* buf, size_t len, off_t off, unsigned long tag);
+
+  /**
+   * start all queued reads.
+   * @return the # of reads started. negative errno on failure
+   */
+  int submit();
+
+  /**
+   * collect the result of a finished read.
+   * @param tag[OUT] the tag of the finished read
+   * @param res[OUT] the # of bytes read or a negative errno
+   * @param wait[IN] block until a read finishes if none has finished yet
+   * @return true if a result was collected
+   */
+  bool complete(unsigned long& tag, int& res, bool wait);
+
+ private:
+  IoRing(const IoRing&);
+  IoRing& operator= (const IoRing&);
+
+  int      fd;         // the ring descriptor. -1 if not set up
+  unsigned entries;    // # submission queue entries
+  unsigned queued;     // # reads queued but not submitted
+  unsigned inflight;   // # reads queued or submitted but not completed
+
+  // the shared rings mapped from the kernel
+  void*    sqMap;
+  size_t   sqMapSize;
+  void*    cqMap;
+  size_t   cqMapSize;
+  void*    sqes;
+  size_t   sqesSize;
+
+  // pointers into the submission queue ring
+  unsigned* sqHead;
+  unsigned* sqTail;
+  unsigned* sqMask;
+  unsigned* sqArray;
+
+  // pointers into the completion queue ring
+  unsigned* cqHead;
+  unsigned* cqTail;
+  unsigned* cqMask;
+  void*     cqes;
+};
+
+#endif /* IORING_H */
@@ -9,31 +9,122 @@
 
 #include "Bruinbase.h"
 #include "PageFile.h"
+#include <cerrno>
 #include <cstring>
+#include <vector>
 #include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
 using std::string;
+using std::set;
+using std::mutex;
+using std::lock_guard;
 
-int PageFile::readCount = 0;
-int PageFile::writeCount = 0;
-int PageFile::cacheClock = 1;
-struct PageFile::cacheStruct PageFile::readCache[PageFile::CACHE_COUNT];
+static const int FREE_MAP_MAGIC = 0x4d534642;  // "BFSM", starts a free-space map file
+static const int PAGE_FILE_MAGIC = 0x46475042; // "BPGF", starts the header page of a file
+static const int POOL_COUNT = 7;               // page sizes from PAGE_SIZE to MAX_PAGE_SIZE
+
+std::atomic<int> PageFile::readCount(0);
+std::atomic<int> PageFile::writeCount(0);
+BufferPool* PageFile::pools[POOL_COUNT];
+mutex PageFile::poolLock;
+int PageFile::cachePages = BufferPool::DEFAULT_CAPACITY;
+int PageFile::cacheShards = BufferPool::DEFAULT_SHARDS;
+int PageFile::defaultPageSize = PageFile::PAGE_SIZE;
+
+// the index of the pool for a page size. -1 if the size is not allowed
+static int poolIndex(int pageSize)
+{
+  for (int i = 0; i < POOL_COUNT; i++) {
+    if (pageSize == (PageFile::PAGE_SIZE << i)) return i;
+  }
+  return -1;
+}
+
+// read size bytes at off, going on after a short read.
+// false on an error or at the end of the file
+static bool readFully(int fd, void* buf, int size, off_t off)
+{
+  char* p = (char*) buf;
+  while (size > 0) {
+    ssize_t n = ::pread(fd, p, size, off);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    p += n;
+    off += n;
+    size -= n;
+  }
+  return true;
+}
+
+// write size bytes at off, going on after a short write. false on an error
+static bool writeFully(int fd, const void* buf, int size, off_t off)
+{
+  const char* p = (const char*) buf;
+  while (size > 0) {
+    ssize_t n = ::pwrite(fd, p, size, off);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    p += n;
+    off += n;
+    size -= n;
+  }
+  return true;
+}
+
+// the # of pages of a size a pool of the given memory holds
+static int poolPages(int pageSize, int pages)
+{
+  int n = (int) ((long) pages * PageFile::PAGE_SIZE / pageSize);
+  return (n > 0) ? n : 1;
+}
 
 PageFile::PageFile() 
 { 
   fd = -1; 
   epid = 0; 
+  pageSize = PAGE_SIZE;
+  first = 0;
+  cache = NULL;
+  writable = false;
+  writeBack = false;
+  mapped = false;
+  map = NULL;
+  freeDirty = false;
+  freeSaved = false;
+  ring = NULL;
+  ringTried = false;
+  nreading = 0;
 }
 
 PageFile::PageFile(const string& filename, char mode)
 {
   fd = -1;
   epid = 0;
+  pageSize = PAGE_SIZE;
+  first = 0;
+  cache = NULL;
+  writable = false;
+  writeBack = false;
+  mapped = false;
+  map = NULL;
+  freeDirty = false;
+  freeSaved = false;
+  ring = NULL;
+  ringTried = false;
+  nreading = 0;
   open(filename.c_str(), mode);
 }
 
+PageFile::~PageFile()
+{
+  // dirty pages refer to the descriptor, so they must be written
+  // before the file goes away
+  if (fd >= 0) close();
+}
+
 RC PageFile::open(const string& filename, char mode)
 {
   RC   rc;
@@ -52,6 +143,10 @@ RC PageFile::open(const string& filename, char mode)
   case 'W':
     oflag = (O_RDWR|O_CREAT);
     break;
+  case 'm':
+  case 'M':
+    oflag = O_RDONLY;
+    break;
   default:
     return RC_INVALID_FILE_MODE;
   }
@@ -60,33 +155,332 @@ RC PageFile::open(const string& filename, char mode)
   fd = ::open(filename.c_str(), oflag, 0644);
   if (fd < 0) { fd = -1; return RC_FILE_OPEN_FAILED; }
 
-  // get the size of the file to set the end pid
+  // get the size of the file, and the page size from its header
   rc = ::fstat(fd, &statbuf);
   if (rc < 0) { ::close(fd); fd = -1; return RC_FILE_OPEN_FAILED; }
-  epid = statbuf.st_size / PAGE_SIZE;
+  writable = (oflag != O_RDONLY);
+  if ((rc = readHeader(statbuf.st_size)) < 0) { ::close(fd); fd = -1; return rc; }
+
+  // remember the identity of the file for the buffer pool. an empty file
+  // may reuse the inode of a file removed earlier, so drop any stale pages.
+  fid.dev = statbuf.st_dev;
+  fid.ino = statbuf.st_ino;
+  cache = poolFor(pageSize);
+  if (epid == 0) cache->eraseFile(fid);
+
+  sequence.reset();
+
+  writeBack = false;
+  mapped = (mode == 'm' || mode == 'M');
+  map = NULL;
+
+  // the pages freed while the file was last open for writing
+  freePages.clear();
+  freeDirty = false;
+  freeSaved = false;
+  if (writable) loadFreeMap(filename);
+
+  // map the whole file. an empty file cannot be mapped and has no pages
+  if (mapped && epid > 0) {
+    void* addr = ::mmap(NULL, (size_t)block(epid) * pageSize, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) { ::close(fd); fd = -1; return RC_FILE_OPEN_FAILED; }
+    map = (char*) addr;
+  }
 
   return 0;
 }
 
+RC PageFile::readHeader(off_t size)
+{
+  int head[2];  // magic, page size
+
+  if (size == 0) {
+    // a new file gets the default page size. the header page is written
+    // right away, so that the file never holds pages without it
+    pageSize = defaultPageSize;
+    epid = 0;
+    if (!writable) {
+      first = 0;
+      return 0;
+    }
+    std::vector<char> page(pageSize, 0);
+    head[0] = PAGE_FILE_MAGIC;
+    head[1] = pageSize;
+    memcpy(&page[0], head, sizeof(head));
+    if (!writeFully(fd, &page[0], pageSize, 0)) return RC_FILE_WRITE_FAILED;
+    first = 1;
+    return 0;
+  }
+
+  // a file without the magic number was written before there was a header
+  if (::pread(fd, head, sizeof(head), 0) == sizeof(head) && head[0] == PAGE_FILE_MAGIC) {
+    if (poolIndex(head[1]) < 0) return RC_INVALID_FILE_FORMAT;
+    pageSize = head[1];
+    first = 1;
+  } else {
+    pageSize = PAGE_SIZE;
+    first = 0;
+  }
+  epid = (size - (off_t)first * pageSize) / pageSize;
+  if (epid < 0) epid = 0;
+  return 0;
+}
+
+RC PageFile::setDefaultPageSize(int size)
+{
+  if (poolIndex(size) < 0) return RC_INVALID_ATTRIBUTE;
+  defaultPageSize = size;
+  return 0;
+}
+
+BufferPool* PageFile::poolFor(int pageSize)
+{
+  int i = poolIndex(pageSize);
+
+  lock_guard<mutex> guard(poolLock);
+  if (pools[i] == NULL) pools[i] = new BufferPool(pageSize, poolPages(pageSize, cachePages), cacheShards);
+  return pools[i];
+}
+
+RC PageFile::setCacheSize(int pages, int shards)
+{
+  RC rc;
+
+  if (pages <= 0 || shards <= 0) return RC_INVALID_ATTRIBUTE;
+
+  lock_guard<mutex> guard(poolLock);
+  cachePages = pages;
+  cacheShards = shards;
+  for (int i = 0; i < POOL_COUNT; i++) {
+    if (pools[i] != NULL && (rc = pools[i]->resize(poolPages(PAGE_SIZE << i, pages), shards)) < 0) return rc;
+  }
+  return 0;
+}
+
+int PageFile::getPageWriteCount()
+{
+  int count = writeCount;
+
+  lock_guard<mutex> guard(poolLock);
+  for (int i = 0; i < POOL_COUNT; i++) {
+    if (pools[i] != NULL) count += pools[i]->getWriteCount();
+  }
+  return count;
+}
+
 RC PageFile::close()
 {
+  RC rc;
+
   if (fd <= 0) return RC_FILE_CLOSE_FAILED;
 
+  // the frames of pages still being read in the background are pinned
+  if (ring != NULL) {
+    lock_guard<mutex> guard(ioLock);
+    while (!reading.empty() && reap(true));
+    delete ring;
+    ring = NULL;
+  }
+  ringTried = false;
+
+  // write the dirty pages before the descriptor becomes invalid
+  if (writeBack && (rc = flush()) < 0) return rc;
+
+  // return the free pages at the end to the file system, and keep the rest
+  if (writable) {
+    if ((rc = trimFreePages()) < 0) return rc;
+    if ((rc = saveFreeMap()) < 0) return rc;
+  }
+  freePages.clear();
+
+  // unmap the file
+  if (map != NULL) ::munmap(map, (size_t)block(epid) * pageSize);
+  map = NULL;
+
   // close the file
   if (::close(fd) < 0) return RC_FILE_CLOSE_FAILED;
 
-  // evict all cached pages for this file
-  for (int i = 0; i < CACHE_COUNT; i++) {
-    if (readCache[i].fd == fd && readCache[i].lastAccessed != 0) {
-       readCache[i].fd = 0;
-       readCache[i].pid = 0;
-       readCache[i].lastAccessed = 0;
-    }
-  }
+  // the cached pages of the file are kept in the buffer pool,
+  // so that they can be used again when the file is reopened
 
   // set the fd and epid to the initial state
   fd = -1; 
   epid = 0;
+  first = 0;
+  writable = false;
+  writeBack = false;
+  mapped = false;
+  return 0;
+}
+
+RC PageFile::setWriteBack(bool on)
+{
+  RC rc;
+
+  if (on && !writable) return RC_INVALID_FILE_MODE;
+
+  // the pages written so far must reach the disk when turning it off
+  if (!on && writeBack && (rc = flush()) < 0) return rc;
+
+  writeBack = on;
+  return 0;
+}
+
+RC PageFile::advise(Access pattern) const
+{
+  if (fd < 0) return RC_FILE_READ_FAILED;
+
+  if (mapped) {
+    if (map == NULL) return 0;
+    int advice = (pattern == SEQUENTIAL) ? MADV_SEQUENTIAL :
+                 (pattern == RANDOM) ? MADV_RANDOM : MADV_NORMAL;
+    return (::madvise(map, (size_t)block(epid) * pageSize, advice) < 0) ? RC_FILE_READ_FAILED : 0;
+  }
+
+  int advice = (pattern == SEQUENTIAL) ? POSIX_FADV_SEQUENTIAL :
+               (pattern == RANDOM) ? POSIX_FADV_RANDOM : POSIX_FADV_NORMAL;
+  return (::posix_fadvise(fd, 0, 0, advice) != 0) ? RC_FILE_READ_FAILED : 0;
+}
+
+RC PageFile::flush()
+{
+  RC rc;
+
+  if (fd < 0) return RC_FILE_WRITE_FAILED;
+  if ((rc = cache->flush(fid)) < 0) return rc;
+  return writable ? saveFreeMap() : 0;
+}
+
+RC PageFile::allocatePage(PageId& pid, PageId hint)
+{
+  if (fd < 0 || !writable) return RC_INVALID_FILE_MODE;
+
+  RC rc;
+
+  lock_guard<mutex> guard(freeLock);
+  if ((rc = dropFreeMap()) < 0) return rc;
+  if (!freePages.empty()) {
+    // take the free page closest to hint, the one after it on a tie
+    set<PageId>::iterator it = freePages.lower_bound(hint);
+    if (it == freePages.end()) {
+      --it;
+    } else if (it != freePages.begin()) {
+      set<PageId>::iterator before = it;
+      --before;
+      if (hint - *before < *it - hint) it = before;
+    }
+    pid = *it;
+    freePages.erase(it);
+    freeDirty = true;
+    return 0;
+  }
+
+  // expand the file by a hole. the page reads as zeros until it is written
+  pid = epid;
+  if (::ftruncate(fd, (off_t)block(pid + 1) * pageSize) < 0) return RC_FILE_WRITE_FAILED;
+  cache->erase(fid, block(pid));
+  extend(pid);
+  return 0;
+}
+
+RC PageFile::freePage(PageId pid)
+{
+  if (fd < 0 || !writable) return RC_INVALID_FILE_MODE;
+  if (pid < 0 || pid >= epid) return RC_INVALID_PID;
+
+  RC rc;
+
+  lock_guard<mutex> guard(freeLock);
+  if ((rc = dropFreeMap()) < 0) return rc;
+  freePages.insert(pid);
+  freeDirty = true;
+  return 0;
+}
+
+int PageFile::getFreePageCount() const
+{
+  lock_guard<mutex> guard(freeLock);
+  return freePages.size();
+}
+
+void PageFile::loadFreeMap(const string& filename)
+{
+  int head[3];  // magic, end pid of the file, # of free pages
+
+  freeName = filename + ".fsm";
+  int mfd = ::open(freeName.c_str(), O_RDONLY);
+  if (mfd < 0) return;
+  freeSaved = true;
+
+  // a map left behind by another file of the same name, or by a file
+  // that was changed without its map, would hand out pages in use
+  if (::read(mfd, head, sizeof(head)) == sizeof(head) &&
+      head[0] == FREE_MAP_MAGIC && head[1] == epid && head[2] >= 0 && head[2] <= epid) {
+    PageId* pids = new PageId[head[2]];
+    ssize_t size = (ssize_t)head[2] * sizeof(PageId);
+    if (::read(mfd, pids, size) == size) freePages.insert(pids, pids + head[2]);
+    delete [] pids;
+  }
+  ::close(mfd);
+
+  // the map no longer matches the file once a page is written
+  freeDirty = true;
+}
+
+RC PageFile::dropFreeMap()
+{
+  if (!freeSaved) return 0;
+
+  // if we crashed before the map is written again, the map would hand
+  // out pages taken or written since it was read
+  if (::unlink(freeName.c_str()) < 0 && errno != ENOENT) return RC_FILE_WRITE_FAILED;
+  freeSaved = false;
+  freeDirty = true;
+  return 0;
+}
+
+RC PageFile::saveFreeMap()
+{
+  lock_guard<mutex> guard(freeLock);
+  if (!freeDirty) return 0;
+
+  if (freePages.empty()) {
+    if (::unlink(freeName.c_str()) < 0 && errno != ENOENT) return RC_FILE_WRITE_FAILED;
+    freeSaved = false;
+    freeDirty = false;
+    return 0;
+  }
+
+  int mfd = ::open(freeName.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+  if (mfd < 0) return RC_FILE_WRITE_FAILED;
+
+  int head[3] = { FREE_MAP_MAGIC, epid, (int) freePages.size() };
+  std::vector<PageId> pids(freePages.begin(), freePages.end());
+  ssize_t size = (ssize_t)pids.size() * sizeof(PageId);
+  bool ok = ::write(mfd, head, sizeof(head)) == sizeof(head) &&
+            ::write(mfd, &pids[0], size) == size;
+  if (::close(mfd) < 0 || !ok) return RC_FILE_WRITE_FAILED;
+
+  freeSaved = true;
+  freeDirty = false;
+  return 0;
+}
+
+RC PageFile::trimFreePages()
+{
+  PageId end = epid;
+
+  lock_guard<mutex> guard(freeLock);
+  while (!freePages.empty() && *freePages.rbegin() == end - 1) {
+    freePages.erase(end - 1);
+    end--;
+  }
+  if (end == epid) return 0;
+
+  if (::ftruncate(fd, (off_t)block(end) * pageSize) < 0) return RC_FILE_WRITE_FAILED;
+  for (PageId pid = end; pid < epid; pid++) cache->erase(fid, block(pid));
+  epid = end;
+  freeDirty = true;
   return 0;
 }
 
@@ -95,35 +489,47 @@ PageId PageFile::endPid() const
   return epid;
 }
 
-RC PageFile::seek(PageId pid) const
+void PageFile::extend(PageId pid)
 {
-  return (::lseek(fd, pid * PAGE_SIZE, SEEK_SET) < 0) ? RC_FILE_SEEK_FAILED : 0;
+  // another thread may extend the file at the same time
+  PageId end = epid.load();
+  while (pid >= end && !epid.compare_exchange_weak(end, pid + 1));
 }
 
 RC PageFile::write(PageId pid, const void* buffer)
 {
-  RC rc;
   if (pid < 0) return RC_INVALID_PID; 
 
-  // seek to the location of the page
-  if ((rc = seek(pid)) < 0) return rc;
+  // a memory-mapped file is read-only
+  if (mapped) return RC_INVALID_FILE_MODE;
+
+  // a background read of the page must not overwrite it later
+  await(pid);
+
+  // the free-space map read when the file was opened is out of date now
+  if (freeSaved) {
+    RC rc;
+    lock_guard<mutex> guard(freeLock);
+    if ((rc = dropFreeMap()) < 0) return rc;
+  }
+
+  // with write-back caching, keep the page dirty in the cache. the page
+  // is written directly only when there is no room for it in the cache
+  if (writeBack && cache->put(fid, block(pid), buffer, fd)) {
+    extend(pid);
+    return 0;
+  }
 
   // write the buffer to the disk page
-  if (::write(fd, buffer, PAGE_SIZE) < 0) return RC_FILE_WRITE_FAILED;
-
-  // if the page is in read cache, invalidate it
-  for (int i = 0; i < CACHE_COUNT; i++) {
-    if (readCache[i].fd == fd && readCache[i].pid == pid &&
-        readCache[i].lastAccessed != 0) {
-       readCache[i].fd = 0;
-       readCache[i].pid = 0;
-       readCache[i].lastAccessed = 0;
-       break;
-    }
+  if (!writeFully(fd, buffer, pageSize, (off_t)block(pid) * pageSize)) {
+    return RC_FILE_WRITE_FAILED;
   }
 
+  // keep the cached copy of the page up to date
+  cache->put(fid, block(pid), buffer);
+
   // if the written pid >= end pid, update the end pid
-  if (pid >= epid) epid = pid + 1;
+  extend(pid);
 
   // increase page write count
   writeCount++;
@@ -134,47 +540,194 @@ RC PageFile::write(PageId pid, const void* buffer)
 RC PageFile::read(PageId pid, void* buffer) const
 {
   RC rc;
+  const char* page;
 
   if (pid < 0 || pid >= epid) return RC_INVALID_PID; 
 
+  // a page of a memory-mapped file is just an address. the OS pages it
+  // in behind our back, so it is not counted as a page read
+  if (mapped) {
+    memcpy(buffer, map + (size_t)block(pid) * pageSize, pageSize);
+    return 0;
+  }
+
+  // read the page through the cache
+  if ((rc = pin(pid, page)) == 0) {
+    memcpy(buffer, page, pageSize);
+    unpin(pid);
+    return 0;
+  }
+  if (rc != RC_BUFFER_FULL) return rc;
+
   //
-  // if the page is in cache, read it from there
+  // every page in the cache is pinned. read the page directly
   //
-  for (int i = 0; i < CACHE_COUNT; i++) {
-    if (readCache[i].fd == fd && readCache[i].pid == pid && 
-        readCache[i].lastAccessed != 0) {
-       memcpy(buffer, readCache[i].buffer, PAGE_SIZE);
-       readCache[i].lastAccessed = ++cacheClock;
-       return 0;
-    }
+
+  if (!readFully(fd, buffer, pageSize, (off_t)block(pid) * pageSize)) {
+    return RC_FILE_READ_FAILED;
   }
 
-  // seek to the page
-  if ((rc = seek(pid)) < 0) return rc;
-  
-  // find the cache slot to evict
-  int toEvict = 0; 
-  for (int i = 0; i < CACHE_COUNT; i++) {
-    if (readCache[i].lastAccessed == 0) {
-      toEvict = i;
-      break;
-    }
-    if (readCache[i].lastAccessed < readCache[toEvict].lastAccessed) {
-      toEvict = i;
-    }
+  // increase the page read count
+  readCount++;
+
+  return 0;
+}
+
+RC PageFile::pin(PageId pid, const char*& page) const
+{
+  bool  cached;
+  char* frame;
+
+  if (pid < 0 || pid >= epid) return RC_INVALID_PID; 
+
+  // a page of a memory-mapped file is pinned by the mapping itself
+  if (mapped) {
+    page = map + (size_t)block(pid) * pageSize;
+    readAhead(pid);
+    return 0;
   }
-  readCache[toEvict].fd = fd;
-  readCache[toEvict].pid = pid;
-  readCache[toEvict].lastAccessed = ++cacheClock;
- 
-  // read the page to cache first and copy it to the buffer
-  if (::read(fd, readCache[toEvict].buffer, PAGE_SIZE) < 0) {
+
+  // the page may be on its way into the cache
+  await(pid);
+
+  // if the page is in cache, use it from there
+  if ((frame = cache->pin(fid, block(pid), cached)) == NULL) return RC_BUFFER_FULL;
+  if (cached) {
+    page = frame;
+    readAhead(pid);
+    return 0;
+  }
+
+  // otherwise read the page into the frame reserved for it
+  if (!readFully(fd, frame, pageSize, (off_t)block(pid) * pageSize)) {
+    cache->discard(fid, block(pid));
     return RC_FILE_READ_FAILED;
   }
-  memcpy(buffer, readCache[toEvict].buffer, PAGE_SIZE);
+  cache->loaded(fid, block(pid));
 
   // increase the page read count
   readCount++;
 
+  page = frame;
+  readAhead(pid);
   return 0;
 }
+
+void PageFile::unpin(PageId pid) const
+{
+  if (!mapped) cache->unpin(fid, block(pid));
+}
+
+RC PageFile::prefetch(const PageId* pids, int n) const
+{
+  RC rc = startReads(pids, n);
+  return (rc == RC_FILE_READ_FAILED) ? 0 : rc;
+}
+
+RC PageFile::startReads(const PageId* pids, int n) const
+{
+  bool cached;
+  char* frame;
+
+  if (fd < 0 || mapped) return RC_FILE_READ_FAILED;
+
+  lock_guard<mutex> guard(ioLock);
+
+  if (!ringTried) {
+    ringTried = true;
+    ring = new IoRing(IO_DEPTH);
+    if (!ring->ok()) {
+      delete ring;
+      ring = NULL;
+    }
+  }
+  if (ring == NULL) return RC_FILE_READ_FAILED;
+
+  // the frames of pages being read stay pinned. leave most of the
+  // buffer pool to the pages that are actually used
+  unsigned limit = cache->getCapacity() / 4;
+  if (limit > ring->capacity()) limit = ring->capacity();
+
+  for (int i = 0; i < n && reading.size() < limit; i++) {
+    PageId pid = pids[i];
+    if (pid < 0 || pid >= epid || reading.count(pid) > 0) continue;
+
+    if ((frame = cache->reserve(fid, block(pid), cached)) == NULL) {
+      if (cached) continue;
+      break;
+    }
+
+    ring->read(fd, frame, pageSize, (off_t)block(pid) * pageSize, pid);
+    reading[pid] = frame;
+    nreading++;
+  }
+
+  if (ring->submit() < 0) {
+    // the reads could not be started. give the frames back
+    while (!reading.empty() && reap(true));
+    return RC_FILE_READ_FAILED;
+  }
+
+  return 0;
+}
+
+void PageFile::await(PageId pid) const
+{
+  if (nreading == 0) return;
+
+  lock_guard<mutex> guard(ioLock);
+  while (reap(false));
+  while (reading.count(pid) > 0 && reap(true));
+}
+
+bool PageFile::reap(bool wait) const
+{
+  unsigned long tag;
+  int res;
+
+  if (!ring->complete(tag, res, wait)) {
+    // the ring is broken. give up on the reads that did not finish
+    if (wait) {
+      for (std::unordered_map<PageId, char*>::iterator it = reading.begin(); it != reading.end(); ++it) {
+        cache->finished(fid, block(it->first), it->second, false);
+      }
+      reading.clear();
+      nreading = 0;
+    }
+    return false;
+  }
+
+  // a failed or short read leaves the page to be read again by readFully()
+  PageId pid = (PageId) tag;
+  cache->finished(fid, block(pid), reading[pid], res == pageSize);
+  if (res == pageSize) readCount++;
+
+  reading.erase(pid);
+  nreading--;
+  return true;
+}
+
+void PageFile::readAhead(PageId pid) const
+{
+  PageId start;
+  int n;
+
+  if (!sequence.access(pid, start, n)) return;
+  if (start + n > epid) n = epid - start;
+  if (n <= 0) return;
+
+  // the OS reads the pages of a mapping ahead by itself when asked to
+  if (mapped) {
+    ::madvise(map + (size_t)block(start) * pageSize, (size_t)n * pageSize, MADV_WILLNEED);
+    return;
+  }
+
+  // read the pages into the buffer pool in the background if possible
+  PageId pids[ReadAhead::MAX_WINDOW + 1];
+  if (n > ReadAhead::MAX_WINDOW + 1) n = ReadAhead::MAX_WINDOW + 1;
+  for (int i = 0; i < n; i++) pids[i] = start + i;
+  if (startReads(pids, n) != RC_FILE_READ_FAILED) return;
+
+  // otherwise let the OS read them into its page cache
+  ::posix_fadvise(fd, (off_t)block(start) * pageSize, (off_t)n * pageSize, POSIX_FADV_WILLNEED);
+}
@@ -10,36 +10,75 @@
 #ifndef PAGEFILE_H
 #define PAGEFILE_H
 
+#include <atomic>
+#include <mutex>
+#include <set>
 #include <string>
+#include <unordered_map>
 #include "Bruinbase.h"
+#include "BufferPool.h"
+#include "IoRing.h"
+#include "ReadAhead.h"
 
 typedef int PageId;
 
 /**
- * read/write a file in the unit of a page
+ * read/write a file in the unit of a page.
+ * the page size is chosen when a file is created and kept in a header
+ * page at the start of the file, before page 0. files written before
+ * there was a choice have no header and 1KB pages.
  */
 class PageFile {
  public:
 
-  static const int PAGE_SIZE = 1024;    // the size of a page is 1KB
+  static const int PAGE_SIZE = 1024;      // the size of a page of a file without a header, and the default
+  static const int MAX_PAGE_SIZE = 65536; // the largest page size
+  static const int IO_DEPTH = 64;         // max # of background reads per file
+
+  // expected access patterns for advise()
+  enum Access { NORMAL, SEQUENTIAL, RANDOM };
 
   PageFile();
   PageFile(const std::string& filename, char mode);
+  ~PageFile();
 
   /**
-   * open a file in read or write mode.
-   * when opened in 'w' mode, if the file does not exist, it is created.
+   * open a file in read, write or memory-mapped mode.
+   * when opened in 'w' mode, if the file does not exist, it is created
+   * with the page size set by setDefaultPageSize().
+   * when opened in 'm' mode, the whole file is mapped read-only into
+   * memory. pages are then read from the OS page cache without going
+   * through the buffer pool or issuing system calls, and write() fails.
    * @param filename[IN] the name of the file to open
-   * @param mode[IN] 'r' for read, 'w' for write
+   * @param mode[IN] 'r' for read, 'w' for write, 'm' for memory-mapped read
    * @return error code. 0 if no error
    */
   RC open(const std::string& filename, char mode);
 
   /**
-   * close the file.
+   * close the file. dirty pages of the file are written to the disk first.
+   * free pages at the end of a file opened in 'w' mode are cut off.
    * @return error code. 0 if no error
    */
   RC close();
+
+  /**
+   * turn write-back caching on or off for a file opened in 'w' mode.
+   * with write-back caching, write() only updates the page in the buffer
+   * pool and marks it dirty. dirty pages are written to the disk in pid
+   * order when they are evicted, by flush(), or when the file is closed.
+   * turning write-back caching off flushes the dirty pages.
+   * @param on[IN] true to turn write-back caching on
+   * @return error code. 0 if no error
+   */
+  RC setWriteBack(bool on);
+
+  /**
+   * write all dirty pages of the file, and its free-space map, to the disk.
+   * consecutive pages are written together by a single system call.
+   * @return error code. 0 if no error
+   */
+  RC flush();
   
   /**
    * read a disk page into memory buffer.
@@ -49,6 +88,41 @@ class PageFile {
    */
   RC read(PageId pid, void *buffer) const;
   
+  /**
+   * pin a disk page in the buffer pool and get a read-only pointer to it,
+   * avoiding the copy made by read(). the page stays at the same address
+   * until it is released with unpin(). pages written in the meantime by
+   * write() are updated in place.
+   * when consecutive pages are pinned (or read), the pages following them
+   * are read ahead: with prefetch() if io_uring is available, and with
+   * posix_fadvise() or madvise() WILLNEED otherwise.
+   * @param pid[IN] the page to pin
+   * @param page[OUT] pointer to the content of the page
+   * @return error code. RC_BUFFER_FULL if every page in the pool is pinned
+   */
+  RC pin(PageId pid, const char*& page) const;
+
+  /**
+   * release a page pinned by pin().
+   * @param pid[IN] the page to unpin
+   */
+  void unpin(PageId pid) const;
+
+  /**
+   * start reading pages into the buffer pool in the background, so that
+   * a later read() or pin() of them does not wait for the disk.
+   * the reads are submitted together through io_uring and run in parallel.
+   * pages that are cached, already being read, or beyond the end of the
+   * file are skipped, and at most IO_DEPTH pages (and never more than a
+   * quarter of the buffer pool) are read at a time. when io_uring is not
+   * available, and in 'm' mode, this does nothing and the pages are read
+   * by pread() when they are used.
+   * @param pids[IN] the pages to read
+   * @param n[IN] the # of pages
+   * @return error code. 0 if no error
+   */
+  RC prefetch(const PageId* pids, int n) const;
+
   /**
    * write the memory buffer to the disk page.
    * if (pid >= endPid()), the file is expanded such that
@@ -59,6 +133,66 @@ class PageFile {
    */
   RC write(PageId pid, const void *buffer);
     
+  /**
+   * take a page to write new data to, for a file opened in 'w' mode.
+   * of the pages given back by freePage(), the one closest to hint is
+   * taken, so that data written together stays close together on the
+   * disk. without free pages, the file is expanded by a page of zeros,
+   * without writing it.
+   * @param pid[OUT] the page taken
+   * @param hint[IN] the page the new one should be close to. -1 for the
+   *                 free page with the smallest pid
+   * @return error code. 0 if no error
+   */
+  RC allocatePage(PageId& pid, PageId hint = -1);
+
+  /**
+   * give back a page that is no longer used, to be taken again by
+   * allocatePage(). the content of the page is left as it is.
+   * the free pages are kept in a free-space map next to the file
+   * (the file name followed by ".fsm"), written by flush() and close()
+   * and read again when the file is opened in 'w' mode. the map is
+   * removed when the file first changes after that, so that a file that
+   * is not closed is never opened again with a map that is out of date.
+   * @param pid[IN] the page to give back
+   * @return error code. 0 if no error
+   */
+  RC freePage(PageId pid);
+
+  /**
+   * @return the # of pages given back by freePage() and not taken again
+   */
+  int getFreePageCount() const;
+
+  /**
+   * tell the OS how the pages of the file are going to be accessed:
+   * SEQUENTIAL for table scans, RANDOM for index probes.
+   * this is madvise() on the mapping in 'm' mode and posix_fadvise()
+   * on the file otherwise.
+   * @param pattern[IN] the expected access pattern
+   * @return error code. 0 if no error
+   */
+  RC advise(Access pattern) const;
+
+  /**
+   * @return the size of a page of the file. read() and write() take
+   *         buffers of this size
+   */
+  int getPageSize() const { return pageSize; }
+
+  /**
+   * choose the page size of files created from now on.
+   * existing files keep the page size they were created with.
+   * @param size[IN] a power of 2 from PAGE_SIZE to MAX_PAGE_SIZE
+   * @return error code. 0 if no error
+   */
+  static RC setDefaultPageSize(int size);
+
+  /**
+   * @return the page size of files created from now on
+   */
+  static int getDefaultPageSize() { return defaultPageSize; }
+
   /**
    * note the +1 part. The last page id in the file is actually endPid()-1.
    * that is, the last page can be read by "read(endPid()-1, buffer)".
@@ -67,46 +201,161 @@ class PageFile {
   PageId endPid() const;
 
   /**
-   * @return the total # of disk reads
+   * @return the total # of disk reads. pages of memory-mapped files
+   *         are read by the OS and not counted
    */
   static int getPageReadCount()  { return readCount; }
   
   /**
    * @return the total # of disk writes
    */
-  static int getPageWriteCount() { return writeCount; }
+  static int getPageWriteCount();
 
- protected:
   /**
-   * move the file cursor to the beginning of a page.
-   * this is an internal function not exposed to public.
-   * @param pid[IN] page to seek to
+   * set the size of the buffer pools shared by all PageFiles, one for
+   * each page size. each pool takes the memory of the given # of
+   * PAGE_SIZE pages, and at least one page.
+   * all cached pages are dropped, so call it before any file is used.
+   * @param pages[IN] the # of PAGE_SIZE pages to cache
+   * @param shards[IN] the # of independently locked parts of a pool
    * @return error code. 0 if no error
    */
-  RC seek(PageId pid) const;
+  static RC setCacheSize(int pages, int shards = BufferPool::DEFAULT_SHARDS);
+
+  /**
+   * @return the # of PAGE_SIZE pages kept in a buffer pool
+   */
+  static int getCacheSize() { return cachePages; }
 
  private:
-  int     fd;     // file descriptor of the associated unix file
-  PageId  epid;   // (last page id + 1) of the file
+  /**
+   * read the header page of a file just opened and set the page size,
+   * or write it if the file is new and opened in 'w' mode.
+   * @param size[IN] the size of the file
+   * @return error code. 0 if no error
+   */
+  RC readHeader(off_t size);
+
+  /**
+   * @param pid[IN] a page of the file
+   * @return the page of the unix file holding it, counting the header page
+   */
+  PageId block(PageId pid) const { return pid + first; }
+
+  /**
+   * @return the buffer pool for pages of the size, made on first use
+   */
+  static BufferPool* poolFor(int pageSize);
+
+  /**
+   * raise the end pid to (pid + 1) unless it is already beyond pid.
+   * @param pid[IN] the page that was written
+   */
+  void extend(PageId pid);
+
+  /**
+   * read the free-space map of a file opened in 'w' mode. a map that
+   * was not written together with the file as it is now is ignored.
+   * @param filename[IN] the name of the file
+   */
+  void loadFreeMap(const std::string& filename);
+
+  /**
+   * write the free-space map if it changed since it was last written,
+   * and remove it when no page is free.
+   * @return error code. 0 if no error
+   */
+  RC saveFreeMap();
+
+  /**
+   * remove the free-space map from the disk on the first change of the
+   * file after the map was read or written. saveFreeMap() writes it again.
+   * freeLock must be held.
+   * @return error code. 0 if no error
+   */
+  RC dropFreeMap();
+
+  /**
+   * cut the free pages at the end of the file off.
+   * @return error code. 0 if no error
+   */
+  RC trimFreePages();
+
+  /**
+   * collect the finished background reads. if pid is being read,
+   * wait until it is in the buffer pool.
+   * @param pid[IN] the page about to be used. -1 not to wait for any page
+   */
+  void await(PageId pid) const;
+
+  /**
+   * the body of prefetch().
+   * @return RC_FILE_READ_FAILED if the pages cannot be read in the background
+   */
+  RC startReads(const PageId* pids, int n) const;
+
+  /**
+   * record an access to a page and read ahead if it continues a scan.
+   * @param pid[IN] the page accessed
+   */
+  void readAhead(PageId pid) const;
+
+  /**
+   * collect one finished background read and release its frame.
+   * ioLock must be held.
+   * @param wait[IN] block until a read finishes
+   * @return true if a read was collected
+   */
+  bool reap(bool wait) const;
 
   //
-  // the following set of members implement LRU caching 
+  // pages are read and written with positional I/O (pread/pwrite), so
+  // the file offset is never moved and one PageFile can be shared by
+  // concurrent queries. open() and close() must not race with other calls.
   //
-  static const int CACHE_COUNT = 10;
+  int     fd;     // file descriptor of the associated unix file
+  std::atomic<PageId> epid;   // (last page id + 1) of the file
+  int     pageSize;   // the size of a page of the file
+  int     first;      // the page of the unix file holding page 0. 1 after the header, 0 without
+  FileId  fid;    // identity of the file in the buffer pool
+  bool    writable;   // was the file opened in 'w' mode?
+  bool    writeBack;  // are written pages kept dirty in the buffer pool?
+  bool    mapped;     // was the file opened in 'm' mode?
+  char*   map;        // the mapping of the file in 'm' mode. NULL if empty
+
+  // pages given back by freePage(), in 'w' mode
+  std::string        freeName;   // the file keeping them
+  std::set<PageId>   freePages;  // ordered, to find the one closest to a hint
+  bool               freeDirty;  // has freePages changed since it was written?
+  std::atomic<bool>  freeSaved;  // is there a map on the disk for the file as it is?
+  mutable std::mutex freeLock;   // serializes allocatePage() and freePage()
+
+  // background reads, set up by the first prefetch()
+  mutable IoRing*    ring;      // NULL if not set up or not available
+  mutable bool       ringTried; // has the ring been set up?
+  mutable std::mutex ioLock;    // serializes the use of the ring
+  mutable std::unordered_map<PageId, char*> reading;  // pages being read -> their frames
+  mutable std::atomic<int> nreading;           // reading.size()
+  mutable ReadAhead  sequence;  // detects sequential accesses
 
-  static int cacheClock; // clock tick counter for LRU policy
+  //
+  // pages read from and written to the disk are kept in the buffer pool
+  // for their size. a pool is keyed on the file identity rather than the
+  // descriptor, so the pages of a file stay cached after it is closed and
+  // are found again when it is reopened by a later query. the pages are
+  // keyed on their place in the unix file, block(pid).
+  //
+  BufferPool* cache;  // the pool for pageSize
 
-  // the actual cache data structure
-  static struct cacheStruct {
-    int    fd;              // file id of the cached page
-    PageId pid;             // page id of the cached page
-    int    lastAccessed;    // the last time the cached page was accessed
-                            //   (lastAccessed == 0) means that the buffer is empty
-    char buffer[PAGE_SIZE]; // the buffer used for caching
-  } readCache[CACHE_COUNT];
+  static BufferPool* pools[];  // by log2(page size / PAGE_SIZE). NULL until used
+  static std::mutex poolLock;  // serializes making and resizing pools
+  static int cachePages;       // the memory of a pool, in PAGE_SIZE pages
+  static int cacheShards;      // the # of shards of a pool
+  static int defaultPageSize;  // the page size of new files
 
-  static int readCount;  // total # of page reads 
-  static int writeCount; // total # of page writes 
+  static std::atomic<int> readCount;  // total # of page reads
+  static std::atomic<int> writeCount; // total # of page writes (dirty pages
+                                      // written back are counted by the pool)
 };
   
 #endif // PAGEFILE_H
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2008 by The Regents of the University of California
+ * Redistribution of this file is permitted under the terms of the GNU
+ * Public License (GPL).
+ */
+
+#include "ReadAhead.h"
+
+using std::mutex;
+using std::lock_guard;
+
+ReadAhead::ReadAhead()
+{
+  reset();
+}
+
+void ReadAhead::reset()
+{
+  lock_guard<mutex> guard(lock);
+  last = -2;
+  next = 0;
+  run = 0;
+  window = MIN_WINDOW;
+}
+
+bool ReadAhead::access(PageId pid, PageId& start, int& n)
+{
+  lock_guard<mutex> guard(lock);
+
+  // the same page again, e.g., the next record in it
+  if (pid == last) return false;
+
+  if (pid == last + 1) {
+    run++;
+  } else {
+    // a jump. start over
+    run = 1;
+    window = MIN_WINDOW;
+    next = pid + 1;
+  }
+  last = pid;
+
+  if (run < TRIGGER) return false;
+  if (next <= pid) next = pid + 1;
+
+  // wait until half of the pages requested so far have been used
+  if (next - pid > window / 2) return false;
+
+  start = next;
+  n = pid + window + 1 - next;
+  next += n;
+  if (window < MAX_WINDOW) window *= 2;
+  return true;
+}
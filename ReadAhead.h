@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2008 by The Regents of the University of California
+ * Redistribution of this file is permitted under the terms of the GNU
+ * Public License (GPL).
+ */
+
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include <mutex>
+
+typedef int PageId;
+
+/**
+ * detects sequential page accesses to a file and decides which pages
+ * to read ahead of them. once a few consecutive pages have been
+ * accessed, the pages following them are requested in a window that
+ * doubles on every request up to MAX_WINDOW pages. the next request is
+ * made when the accesses have consumed half of the pages read ahead,
+ * so that reading keeps ahead of the scan. any other access pattern
+ * resets the window.
+ */
+class ReadAhead {
+ public:
+
+  static const int TRIGGER = 2;      // # consecutive accesses to start
+  static const int MIN_WINDOW = 4;   // # pages read ahead at first
+  static const int MAX_WINDOW = 32;  // max # pages read ahead
+
+  ReadAhead();
+
+  /**
+   * forget the access history, e.g., when the file is reopened.
+   */
+  void reset();
+
+  /**
+   * record an access to a page.
+   * @param pid[IN] the page accessed
+   * @param start[OUT] the first page to read ahead
+   * @param n[OUT] the # of pages to read ahead from start
+   * @return true if pages should be read ahead
+   */
+  bool access(PageId pid, PageId& start, int& n);
+
+ private:
+  std::mutex lock;
+  PageId last;    // the last page accessed
+  PageId next;    // the first page not requested yet
+  int    run;     // # consecutive pages accessed up to last
+  int    window;  // # pages to keep requested ahead of last
+};
+
+#endif /* READAHEAD_H */
@@ -9,10 +9,33 @@
 
 #include "Bruinbase.h"
 #include "RecordFile.h"
+#include <algorithm>
 #include <cstring>
 
 using std::string;
 
+//
+// the slotted format, see RecordFile.h.
+// a page of records starts with its kind, # records and the offset where
+// the records start. the directory follows, two unsigned shorts for the
+// offset and length of each record. a record is the key and the value,
+// or, when its length is OVERFLOW_SLOT, the key, the length of the value
+// and the first page of the value. an overflow page starts with its
+// kind, the next page of the value (-1 for the last) and the # bytes of
+// the value it holds.
+// the kinds are negative, so they cannot be mistaken for # records in a
+// page of the fixed format.
+//
+static const int SLOTTED_DATA = -1;         // a page of records
+static const int SLOTTED_OVERFLOW = -2;     // a page of a long value
+static const int SLOTTED_HEADER = 3 * sizeof(int);
+static const int SLOT_SIZE = 2 * sizeof(unsigned short);
+static const int OVERFLOW_SLOT = 0xFFFF;
+static const int OVERFLOW_RECORD = 2 * sizeof(int) + sizeof(PageId);
+static const int OVERFLOW_HEADER = 3 * sizeof(int);
+
+RecordFormat RecordFile::defaultFormat = RECORD_FIXED;
+
 //
 // helper functions for page manipultation
 //
@@ -20,9 +43,6 @@ using std::string;
 // compute the pointer to the n'th slot in a page
 static char* slotPtr(char* page, int n);
 
-// read the record in the n'th slot in the page
-static void readSlot(const char* page, int n, int& key, std::string& value);
-
 // write the record to the n'th slot in the page
 static void writeSlot(char* page, int n, int key, const std::string& value);
 
@@ -32,6 +52,17 @@ static int getRecordCount(const char* page);
 // update # records stored in the page
 static void setRecordCount(char* page, int count);
 
+// read/write the int at an offset of a page
+static int getInt(const char* page, int offset);
+static void setInt(char* page, int offset, int value);
+
+// the longest value kept in a page of records in the slotted format
+static int maxInlineLength(int pageSize);
+
+// find the offset and length of the n'th record in a slotted page.
+// return false if the page has no such record
+static bool findRecord(const char* page, int pageSize, int n, int& offset, int& length);
+
 
 //
 // helper functions for RecordId manipulation
@@ -107,20 +138,35 @@ RecordFile::RecordFile()
 {
   erid.pid = 0;
   erid.sid = 0;
+  format = RECORD_FIXED;
+  recordsPerPage = RECORDS_PER_PAGE;
+  countPid = -1;
 }
 
 RecordFile::RecordFile(const string& filename, char mode)
 {
+  format = RECORD_FIXED;
+  recordsPerPage = RECORDS_PER_PAGE;
+  countPid = -1;
   open(filename, mode);
 }
 
 RC RecordFile::open(const string& filename, char mode)
 {
   RC   rc;
-  char page[PageFile::PAGE_SIZE];
 
   // open the page file
   if ((rc = pf.open(filename, mode)) < 0) return rc;
+
+  // the slots of a page depend on the page size of the file
+  recordsPerPage = getRecordsPerPage(pf.getPageSize());
+  tail.assign(pf.getPageSize(), 0);
+  countPid = -1;
+
+  // appended records are kept in the buffer pool until the page is full
+  // and evicted or the file is closed, instead of writing the page for
+  // every record
+  if (mode == 'w' || mode == 'W') pf.setWriteBack(true);
   
   //
   // in the rest of this function, we set the end record id
@@ -133,13 +179,37 @@ RC RecordFile::open(const string& filename, char mode)
   // set the end record id to (0, 0).
   if (erid.pid == 0) {
     erid.sid = 0;
+    format = defaultFormat;
+    return 0;
+  }
+
+  // the first page is a page of records in either format.
+  // it starts with the kind of the page or with # records in it
+  if ((rc = pf.read(0, &tail[0])) < 0) {
+    erid.pid = erid.sid = 0;
+    pf.close();
+    return rc;
+  }
+  format = (getRecordCount(&tail[0]) < 0) ? RECORD_SLOTTED : RECORD_FIXED;
+
+  if (format == RECORD_SLOTTED) {
+    // the records are appended to the last page of records, which may
+    // be followed by the overflow pages of its values
+    do {
+      if ((rc = pf.read(--erid.pid, &tail[0])) < 0) {
+        erid.pid = erid.sid = 0;
+        pf.close();
+        return rc;
+      }
+    } while (erid.pid > 0 && getRecordCount(&tail[0]) != SLOTTED_DATA);
+    erid.sid = getInt(&tail[0], sizeof(int));
     return 0;
   }
 
   // obtain # records in the last page to set sid of the end record id.
   // read the last page of the file and get # records in the page.
   // remeber that the id of the last page is endPid()-1 not endPid().
-  if ((rc = pf.read(--erid.pid, page)) < 0) {
+  if ((rc = pf.read(--erid.pid, &tail[0])) < 0) {
     // an error occurred during page read
     erid.pid = erid.sid = 0;
     pf.close();
@@ -147,8 +217,8 @@ RC RecordFile::open(const string& filename, char mode)
   }
 
   // get # records in the last page
-  erid.sid = getRecordCount(page);
-  if (erid.sid >= RECORDS_PER_PAGE) {
+  erid.sid = getRecordCount(&tail[0]);
+  if (erid.sid >= recordsPerPage) {
     // the last page is full. advance the end record id to the next page.
     erid.pid++;
     erid.sid = 0;
@@ -168,18 +238,151 @@ RC RecordFile::close()
 RC RecordFile::read(const RecordId& rid, int& key, string& value) const
 {
   RC   rc;
-  char page[PageFile::PAGE_SIZE];
+  const char* page;
   
   // check whether the rid is in the valid range
   if (rid.pid < 0 || rid.pid > erid.pid) return RC_INVALID_RID;
-  if (rid.sid < 0 || rid.sid >= RecordFile::RECORDS_PER_PAGE) return RC_INVALID_RID;
+  if (rid.sid < 0) return RC_INVALID_RID;
+  if (format == RECORD_FIXED && rid.sid >= recordsPerPage) return RC_INVALID_RID;
   if (rid >= erid) return RC_INVALID_RID;
   
-  // read the page containing the record
-  if ((rc = pf.read(rid.pid, page)) < 0) return rc;
+  // pin the page containing the record and read the record 
+  // from the slot in the page without copying the whole page
+  if ((rc = pf.pin(rid.pid, page)) == 0) {
+    rc = readRecord(page, rid.sid, key, value);
+    pf.unpin(rid.pid);
+    return rc;
+  }
+  if (rc != RC_BUFFER_FULL) return rc;
+
+  // every page in the buffer pool is pinned. read a copy of the page
+  std::vector<char> copy(pf.getPageSize());
+  if ((rc = pf.read(rid.pid, &copy[0])) < 0) return rc;
 
-  // read the record from the slot in the page
-  readSlot(page, rid.sid, key, value);
+  return readRecord(&copy[0], rid.sid, key, value);
+}
+
+RC RecordFile::read(const RecordId& rid, int& key, std::string_view& value, RecordPage& page) const
+{
+  RC   rc;
+
+  // check whether the rid is in the valid range
+  if (rid.pid < 0 || rid.pid > erid.pid) return RC_INVALID_RID;
+  if (rid.sid < 0) return RC_INVALID_RID;
+  if (rid >= erid) return RC_INVALID_RID;
+
+  // the page stays pinned for the next record
+  if ((rc = readPage(rid.pid, page)) < 0) return rc;
+
+  return page.read(rid.sid, key, value);
+}
+
+RC RecordFile::readPage(PageId pid, RecordPage& page) const
+{
+  RC   rc;
+
+  if (page.rf == this && page.pid == pid) return 0;
+
+  page.release();
+  if (pid < 0 || pid >= pf.endPid()) return RC_INVALID_PID;
+
+  if ((rc = pf.pin(pid, page.page)) == 0) {
+    page.pinned = true;
+  } else if (rc == RC_BUFFER_FULL) {
+    // every page in the buffer pool is pinned. read a copy of the page
+    page.copy.resize(pf.getPageSize());
+    if ((rc = pf.read(pid, &page.copy[0])) < 0) return rc;
+    page.page = &page.copy[0];
+  } else {
+    return rc;
+  }
+
+  page.rf = this;
+  page.pid = pid;
+  page.count = pageRecordCount(page.page);
+
+  return 0;
+}
+
+int RecordFile::pageRecordCount(const char* page) const
+{
+  int count = getRecordCount(page);
+
+  if (format == RECORD_FIXED) return std::max(0, std::min(count, recordsPerPage));
+
+  // in the slotted format, the first four bytes are the kind of the page
+  return (count == SLOTTED_DATA) ? getInt(page, sizeof(int)) : 0;
+}
+
+RC RecordFile::viewRecord(const char* page, int sid, int& key, std::string_view& value,
+                          int& size, PageId& overflow) const
+{
+  int offset, length;
+
+  overflow = -1;
+  if (format == RECORD_FIXED) {
+    // the value in a slot ends with a null character
+    const char* ptr = slotPtr(const_cast<char*>(page), sid);
+    memcpy(&key, ptr, sizeof(int));
+    value = std::string_view(ptr + sizeof(int), strnlen(ptr + sizeof(int), MAX_VALUE_LENGTH));
+    return 0;
+  }
+
+  // a slotted page. the rid may point to an overflow page
+  if (!findRecord(page, pf.getPageSize(), sid, offset, length)) return RC_INVALID_RID;
+
+  memcpy(&key, page + offset, sizeof(int));
+  if (length != OVERFLOW_SLOT) {
+    value = std::string_view(page + offset + sizeof(int), length - sizeof(int));
+    return 0;
+  }
+
+  // the value is in overflow pages
+  value = std::string_view();
+  memcpy(&size, page + offset + sizeof(int), sizeof(int));
+  memcpy(&overflow, page + offset + 2 * sizeof(int), sizeof(PageId));
+  return 0;
+}
+
+RC RecordFile::readRecord(const char* page, int sid, int& key, string& value) const
+{
+  RC   rc;
+  std::string_view view;
+  int  size;
+  PageId overflow;
+
+  if ((rc = viewRecord(page, sid, key, view, size, overflow)) < 0) return rc;
+  if (overflow < 0) {
+    value.assign(view);
+    return 0;
+  }
+
+  return readOverflow(overflow, size, value);
+}
+
+RC RecordFile::readOverflow(PageId pid, int size, string& value) const
+{
+  RC   rc;
+  int  pageSize = pf.getPageSize();
+  std::vector<char> page(pageSize);
+
+  value.clear();
+  value.reserve(size);
+
+  // follow the chain until the whole value is read
+  while ((int)value.size() < size) {
+    if (pid < 0 || pid >= pf.endPid()) return RC_INVALID_FILE_FORMAT;
+    if ((rc = pf.read(pid, &page[0])) < 0) return rc;
+
+    int n = getInt(&page[0], 2 * sizeof(int));
+    if (getRecordCount(&page[0]) != SLOTTED_OVERFLOW || n <= 0 ||
+        n > pageSize - OVERFLOW_HEADER || n > size - (int)value.size()) {
+      return RC_INVALID_FILE_FORMAT;
+    }
+
+    value.append(&page[OVERFLOW_HEADER], n);
+    pid = getInt(&page[0], sizeof(int));
+  }
 
   return 0;
 }
@@ -187,7 +390,9 @@ RC RecordFile::read(const RecordId& rid, int& key, string& value) const
 RC RecordFile::append(int key, const std::string& value, RecordId& rid)
 {
   RC   rc;
-  char page[PageFile::PAGE_SIZE];
+  char* page = &tail[0];
+
+  if (format == RECORD_SLOTTED) return appendSlotted(key, value, rid);
 
   // unless we are writing to the the first slot of an empty page,
   // we have to read the page first
@@ -196,7 +401,7 @@ RC RecordFile::append(int key, const std::string& value, RecordId& rid)
   } else {
     // if this is the first slot of an empty page
     // we can simply initialize the page with zeros
-    memset(page, 0, PageFile::PAGE_SIZE);
+    memset(page, 0, tail.size());
   }
     
   // write the record to the first empty slot 
@@ -213,11 +418,143 @@ RC RecordFile::append(int key, const std::string& value, RecordId& rid)
   rid = erid;
 
   // advance the end record id by one to the next empty slot
-  ++erid;
+  next(erid);
+
+  return 0;
+}
+
+RC RecordFile::appendSlotted(int key, const std::string& value, RecordId& rid)
+{
+  RC   rc;
+  char* page = &tail[0];
+  int  pageSize = tail.size();
+  int  count, start;
+
+  // a value too long to share the page with a few other records is
+  // written to overflow pages, and the page only keeps where it is
+  bool overflow = ((int)value.size() > maxInlineLength(pageSize));
+  int  length = overflow ? OVERFLOW_RECORD : (int)(sizeof(int) + value.size());
+
+  // read the last page of records. when the record does not fit in it,
+  // start a new page after the last page of the file
+  if (erid.sid > 0) {
+    if ((rc = pf.read(erid.pid, page)) < 0) return rc;
+    count = getInt(page, sizeof(int));
+    start = getInt(page, 2 * sizeof(int));
+    if (start - (SLOTTED_HEADER + count * SLOT_SIZE) < length + SLOT_SIZE) {
+      erid.pid = pf.endPid();
+      erid.sid = 0;
+    }
+  }
+
+  if (erid.sid == 0) {
+    memset(page, 0, pageSize);
+    setInt(page, 0, SLOTTED_DATA);
+    setInt(page, sizeof(int), 0);
+    setInt(page, 2 * sizeof(int), pageSize);
+
+    // write the empty page first, so that the overflow pages of the
+    // value come after it
+    if (overflow && (rc = pf.write(erid.pid, page)) < 0) return rc;
+  }
+
+  // store the record below the others, and its slot after theirs
+  count = getInt(page, sizeof(int));
+  start = getInt(page, 2 * sizeof(int)) - length;
+  memcpy(page + start, &key, sizeof(int));
+  if (overflow) {
+    PageId first;
+    int size = value.size();
+    if ((rc = writeOverflow(value, first)) < 0) return rc;
+    memcpy(page + start + sizeof(int), &size, sizeof(int));
+    memcpy(page + start + 2 * sizeof(int), &first, sizeof(PageId));
+  } else {
+    memcpy(page + start + sizeof(int), value.data(), value.size());
+  }
+
+  unsigned short slot[2] = { (unsigned short) start,
+                             (unsigned short) (overflow ? OVERFLOW_SLOT : length) };
+  memcpy(page + SLOTTED_HEADER + count * SLOT_SIZE, slot, SLOT_SIZE);
+  setInt(page, sizeof(int), count + 1);
+  setInt(page, 2 * sizeof(int), start);
+
+  // write the page to the disk
+  if ((rc = pf.write(erid.pid, page)) < 0) return rc;
+
+  // we need to output the rid of the record slot
+  rid = erid;
+  erid.sid++;
 
   return 0;
 }
 
+RC RecordFile::writeOverflow(const std::string& value, PageId& first)
+{
+  RC   rc;
+  int  pageSize = pf.getPageSize();
+  int  room = pageSize - OVERFLOW_HEADER;
+  std::vector<char> page(pageSize);
+
+  // the pages of the value are appended to the file one after another
+  first = pf.endPid();
+  for (int done = 0; done < (int)value.size(); done += room) {
+    int n = std::min(room, (int)value.size() - done);
+    PageId pid = pf.endPid();
+
+    memset(&page[0], 0, pageSize);
+    setInt(&page[0], 0, SLOTTED_OVERFLOW);
+    setInt(&page[0], sizeof(int), (done + n < (int)value.size()) ? pid + 1 : -1);
+    setInt(&page[0], 2 * sizeof(int), n);
+    memcpy(&page[OVERFLOW_HEADER], value.data() + done, n);
+
+    if ((rc = pf.write(pid, &page[0])) < 0) return rc;
+  }
+
+  return 0;
+}
+
+void RecordFile::next(RecordId& rid) const
+{
+  if (format == RECORD_FIXED) {
+    // if the end of a page is reached, move to the next page
+    if (++rid.sid >= recordsPerPage) {
+      rid.pid++;
+      rid.sid = 0;
+    }
+    return;
+  }
+
+  // the pages of records hold different numbers of records, and the
+  // overflow pages between them hold none
+  if (++rid.sid >= slotCount(rid.pid)) {
+    rid.sid = 0;
+    while (++rid.pid < erid.pid && slotCount(rid.pid) == 0);
+  }
+}
+
+int RecordFile::slotCount(PageId pid) const
+{
+  const char* page;
+  int  count;
+
+  // the last page of records is still being filled by append()
+  if (pid == erid.pid) return erid.sid;
+  if (pid == countPid) return countValue;
+
+  if (pf.pin(pid, page) == 0) {
+    count = pageRecordCount(page);
+    pf.unpin(pid);
+  } else {
+    std::vector<char> copy(pf.getPageSize());
+    if (pf.read(pid, &copy[0]) < 0) return 0;
+    count = pageRecordCount(&copy[0]);
+  }
+
+  countPid = pid;
+  countValue = count;
+  return countValue;
+}
+
 const RecordId& RecordFile::endRid() const
 {
   return erid;
@@ -238,6 +575,39 @@ static void setRecordCount(char* page, int count)
   memcpy(page, &count, sizeof(int));
 }
 
+static int getInt(const char* page, int offset)
+{
+  int value;
+  memcpy(&value, page + offset, sizeof(int));
+  return value;
+}
+
+static void setInt(char* page, int offset, int value)
+{
+  memcpy(page + offset, &value, sizeof(int));
+}
+
+static int maxInlineLength(int pageSize)
+{
+  // at least four records fit in a page
+  return (pageSize - SLOTTED_HEADER) / 4 - SLOT_SIZE - sizeof(int);
+}
+
+static bool findRecord(const char* page, int pageSize, int n, int& offset, int& length)
+{
+  unsigned short slot[2];
+
+  if (getRecordCount(page) != SLOTTED_DATA) return false;
+  if (n >= getInt(page, sizeof(int))) return false;
+
+  memcpy(slot, page + SLOTTED_HEADER + n * SLOT_SIZE, SLOT_SIZE);
+  offset = slot[0];
+  length = slot[1];
+
+  int size = (length == OVERFLOW_SLOT) ? OVERFLOW_RECORD : length;
+  return (size >= (int)sizeof(int) && offset + size <= pageSize);
+}
+
 static char* slotPtr(char* page, int n) 
 {
   // compute the location of the n'th slot in a page.
@@ -247,18 +617,6 @@ static char* slotPtr(char* page, int n)
   return (page+sizeof(int)) + (sizeof(int)+RecordFile::MAX_VALUE_LENGTH)*n;
 }
 
-static void readSlot(const char* page, int n, int& key, std::string& value)
-{
-  // compute the location of the record
-  char *ptr = slotPtr(const_cast<char*>(page), n);
-
-  // read the key 
-  memcpy(&key, ptr, sizeof(int));
-
-  // read the value
-  value.assign(ptr + sizeof(int));
-}
-
 static void writeSlot(char* page, int n, int key, const std::string& value)
 {
   // compute the location of the record
@@ -276,3 +634,99 @@ static void writeSlot(char* page, int n, int key, const std::string& value)
     strcpy(ptr + sizeof(int), value.c_str());
   }
 }
+
+
+RecordPage::RecordPage()
+{
+  rf = NULL;
+  pid = -1;
+  page = NULL;
+  pinned = false;
+  count = 0;
+}
+
+RecordPage::~RecordPage()
+{
+  release();
+}
+
+RC RecordPage::read(int sid, int& key, std::string_view& value) const
+{
+  RC   rc;
+  int  size;
+  PageId overflow;
+
+  if (sid < 0 || sid >= count) return RC_INVALID_RID;
+  if ((rc = rf->viewRecord(page, sid, key, value, size, overflow)) < 0) return rc;
+  if (overflow < 0) return 0;
+
+  // the value is in overflow pages. keep a copy of it with the page
+  spilled.emplace_back();
+  if ((rc = rf->readOverflow(overflow, size, spilled.back())) < 0) return rc;
+  value = spilled.back();
+
+  return 0;
+}
+
+RC RecordPage::readKey(int sid, int& key) const
+{
+  std::string_view value;
+  int  size;
+  PageId overflow;
+
+  if (sid < 0 || sid >= count) return RC_INVALID_RID;
+  return rf->viewRecord(page, sid, key, value, size, overflow);
+}
+
+void RecordPage::release()
+{
+  if (pinned) rf->pf.unpin(pid);
+  rf = NULL;
+  pid = -1;
+  page = NULL;
+  pinned = false;
+  count = 0;
+  spilled.clear();
+}
+
+RecordFile::Scanner::Scanner(const RecordFile& file, bool values)
+  : rf(file)
+{
+  withValues = values;
+  pid = 0;
+}
+
+RC RecordFile::Scanner::next()
+{
+  RC   rc;
+  int  npages = 0;
+  int  key;
+  std::string_view value;
+
+  // the pages of the last batch are not needed any more
+  release();
+
+  // overflow pages hold no records and are skipped
+  for (; npages < BATCH_PAGES && pid < rf.pf.endPid(); pid++) {
+    RecordPage& page = pages[npages];
+    if ((rc = rf.readPage(pid, page)) < 0) return rc;
+    if (page.getRecordCount() == 0) continue;
+
+    for (int sid = 0; sid < page.getRecordCount(); sid++) {
+      rc = withValues ? page.read(sid, key, value) : page.readKey(sid, key);
+      if (rc < 0) return rc;
+      keys.push_back(key);
+      if (withValues) values.push_back(value);
+    }
+    npages++;
+  }
+
+  return (npages > 0) ? 0 : RC_END_OF_FILE;
+}
+
+void RecordFile::Scanner::release()
+{
+  for (int i = 0; i < BATCH_PAGES; i++) pages[i].release();
+  keys.clear();
+  values.clear();
+}
@@ -10,7 +10,10 @@
 #ifndef RECORDFILE_H
 #define RECORDFILE_H
 
+#include <deque>
 #include <string>
+#include <string_view>
+#include <vector>
 #include "PageFile.h"
 
 /**
@@ -26,7 +29,8 @@ typedef struct {
 // helper functions for RecordId
 // 
 
-// RecordId iterators
+// RecordId iterators, for files of PageFile::PAGE_SIZE pages.
+// RecordFile::next() steps through the records of any file
 RecordId& operator++ (RecordId& rid);
 RecordId  operator++ (RecordId& rid, int);
 
@@ -38,28 +42,113 @@ bool operator<= (const RecordId& r1, const RecordId& r2);
 bool operator== (const RecordId& r1, const RecordId& r2);
 bool operator!= (const RecordId& r1, const RecordId& r2);
 
+/**
+ * the layout of the records in the pages of a RecordFile.
+ * RECORD_FIXED: every record takes a slot of MAX_VALUE_LENGTH bytes, and
+ *   longer values are truncated. the first four bytes of a page store
+ *   # records in the page.
+ * RECORD_SLOTTED: a record takes only the space of its key and value.
+ *   a page starts with a header and a directory of the offset and length
+ *   of each record, and the records fill the page from its end. a value
+ *   too long to share a page with a few others is kept in a chain of
+ *   overflow pages, which record ids skip.
+ */
+enum RecordFormat { RECORD_FIXED = 0, RECORD_SLOTTED = 1 };
+
+class RecordFile;
+
+/**
+ * a page of a RecordFile pinned in the buffer pool, to read its records
+ * without copying them. see RecordFile::readPage() and RecordFile::Scanner.
+ */
+class RecordPage {
+ public:
+  RecordPage();
+  ~RecordPage();
+
+  /**
+   * @return the page held, -1 if none
+   */
+  PageId getPid() const { return pid; }
+
+  /**
+   * @return the # of records in the page
+   */
+  int getRecordCount() const { return count; }
+
+  /**
+   * read a record of the page without copying it. the value points into
+   * the page, or for a value kept in overflow pages into a copy made
+   * with the page, and stays valid until the page is released.
+   * @param sid[IN] the slot of the record
+   * @param key[OUT] the record key
+   * @param value[OUT] the record value
+   * @return error code. 0 if no error
+   */
+  RC read(int sid, int& key, std::string_view& value) const;
+
+  /**
+   * read only the key of a record of the page.
+   * @param sid[IN] the slot of the record
+   * @param key[OUT] the record key
+   * @return error code. 0 if no error
+   */
+  RC readKey(int sid, int& key) const;
+
+  /**
+   * unpin the page. the page must be released before its file is closed.
+   */
+  void release();
+
+ private:
+  friend class RecordFile;
+
+  RecordPage(const RecordPage&);
+  RecordPage& operator=(const RecordPage&);
+
+  const RecordFile* rf;     // the file of the page
+  PageId      pid;          // the page held, -1 if none
+  const char* page;         // the content of the page
+  bool        pinned;       // is the page pinned in the buffer pool?
+  int         count;        // the # of records in the page
+  std::vector<char> copy;   // a copy of the page when every page of the pool is pinned
+  mutable std::deque<std::string> spilled;  // values read from overflow pages
+};
+
 /**
  * read/write a record to a file
  */
 class RecordFile {
  public:
 
-  // maximum length of the value field
+  // maximum length of the value field in the fixed format
   static const int MAX_VALUE_LENGTH = 100;  
 
-  // number of record slots per page
+  // number of record slots per page of PageFile::PAGE_SIZE bytes in the fixed format
   static const int RECORDS_PER_PAGE = (PageFile::PAGE_SIZE - sizeof(int))/ (sizeof(int) + MAX_VALUE_LENGTH);  
     // Note that we subtract sizeof(int) from PAGE_SIZE because the first
     // four bytes in the page is used to store # records in the page.
 
+  /**
+   * @param pageSize[IN] the size of a page
+   * @return the number of record slots in a page of the size in the fixed format
+   */
+  static int getRecordsPerPage(int pageSize)
+    { return (pageSize - sizeof(int)) / (sizeof(int) + MAX_VALUE_LENGTH); }
+
   RecordFile();
   RecordFile(const std::string& filename, char mode);
   
   /**
    * open a file in read or write mode.
-   * when opened in 'w' mode, if the file does not exist, it is created.
+   * the record format is found from the first page of the file.
+   * when opened in 'w' mode, if the file does not exist, it is created
+   * with the format set by setDefaultFormat(),
+   * and appended records reach the disk only when the page holding them
+   * is evicted from the buffer pool or the file is closed.
+   * when opened in 'm' mode, the file is memory-mapped for reading.
    * @param filename[IN] the name of the file to open
-   * @param mode[IN] 'r' for read, 'w' for write
+   * @param mode[IN] 'r' for read, 'w' for write, 'm' for memory-mapped read
    * @return error code. 0 if no error
    */
   RC open(const std::string& filename, char mode);
@@ -79,6 +168,84 @@ class RecordFile {
    */
   RC read(const RecordId& rid, int& key, std::string& value) const;
 
+  /**
+   * read a record from the file without copying the value. the page of
+   * the record is pinned in page, and the value stays valid until the
+   * page is released. records read one after another from the same page
+   * pin it once.
+   * @param rid[IN] the id of the record to read
+   * @param key[OUT] the record key
+   * @param value[OUT] the record value
+   * @param page[IN/OUT] the page of the record
+   * @return error code. 0 if no error
+   */
+  RC read(const RecordId& rid, int& key, std::string_view& value, RecordPage& page) const;
+
+  /**
+   * pin a page of the file to read its records without copying them.
+   * @param pid[IN] the page to pin
+   * @param page[OUT] the pinned page. the page it held before is released
+   * @return error code. 0 if no error
+   */
+  RC readPage(PageId pid, RecordPage& page) const;
+
+  /**
+   * reads a RecordFile from the start a batch of pages at a time, and
+   * gives the records of a batch as an array of keys and an array of
+   * values, so that a condition can be checked on the whole batch at
+   * once. the pages of a batch are pinned like a RecordPage, and the
+   * values point into them until the next batch is read.
+   */
+  class Scanner {
+   public:
+    static const int BATCH_PAGES = 8;   // max # of pages in a batch
+
+    /**
+     * @param file[IN] the file to scan. it must stay open while scanning
+     * @param values[IN] false if only the keys are needed
+     */
+    Scanner(const RecordFile& file, bool values = true);
+
+    /**
+     * read the next batch of pages.
+     * @return error code. RC_END_OF_FILE after the last page
+     */
+    RC next();
+
+    /**
+     * @return the # of records in the batch
+     */
+    int getCount() const { return (int) keys.size(); }
+
+    /**
+     * @return the keys of the records in the batch
+     */
+    const int* getKeys() const { return keys.data(); }
+
+    /**
+     * @return the values of the records in the batch. NULL if the
+     *         scanner does not read values
+     */
+    const std::string_view* getValues() const { return withValues ? values.data() : NULL; }
+
+    /**
+     * unpin the pages of the batch. this is done by the destructor too,
+     * and must be done before the file is closed.
+     */
+    void release();
+
+   private:
+    Scanner(const Scanner&);
+    Scanner& operator=(const Scanner&);
+
+    const RecordFile& rf;
+    bool   withValues;    // are the values read?
+    PageId pid;           // the page the next batch starts from
+    RecordPage pages[BATCH_PAGES];  // the pages of the batch
+    std::vector<int> keys;                  // the keys of the batch
+    std::vector<std::string_view> values;   // the values of the batch
+  };
+
   /**
    * append a new record at the end of the file.
    * note that RecordFile does not have write() function.
@@ -90,6 +257,47 @@ class RecordFile {
    */
   RC append(int key, const std::string& value, RecordId& rid);
 
+  /**
+   * choose the record format of files created from now on.
+   * existing files keep the format they were created with.
+   * @param format[IN] the layout of the records
+   */
+  static void setDefaultFormat(RecordFormat format) { defaultFormat = format; }
+
+  /**
+   * @return the record format of the open file
+   */
+  RecordFormat getFormat() const { return format; }
+
+  /**
+   * tell the OS how the records are going to be read: SEQUENTIAL for
+   * a table scan, RANDOM when following rids from an index.
+   * @param pattern[IN] the expected access pattern
+   * @return error code. 0 if no error
+   */
+  RC advise(PageFile::Access pattern) const { return pf.advise(pattern); }
+
+  /**
+   * start reading the given pages in the background, e.g., the pages of
+   * the records a scan will read next. see PageFile::prefetch().
+   * @param pids[IN] the pages to read
+   * @param n[IN] the # of pages
+   * @return error code. 0 if no error
+   */
+  RC prefetch(const PageId* pids, int n) const { return pf.prefetch(pids, n); }
+
+  /**
+   * move a record id to the next slot, which is on the next page
+   * of records after the last slot of a page.
+   * @param rid[IN/OUT] the record id to move
+   */
+  void next(RecordId& rid) const;
+
+  /**
+   * @return the number of record slots in a page of the file in the fixed format
+   */
+  int getRecordsPerPage() const { return recordsPerPage; }
+
   /**
    * note the +1 part. The rid of the last record is endRid()-1.
    * @return (last record id + 1) of the RecordFile
@@ -97,8 +305,82 @@ class RecordFile {
   const RecordId& endRid() const;
 
  private:
+  friend class RecordPage;
+
+  /**
+   * find a record in a page of the file without copying it.
+   * a value kept in overflow pages is not read; its length and first
+   * page are returned instead.
+   * @param page[IN] the page holding the record
+   * @param sid[IN] the slot of the record
+   * @param key[OUT] the record key
+   * @param value[OUT] the record value, if it is in the page
+   * @param size[OUT] the length of a value in overflow pages
+   * @param overflow[OUT] the first overflow page of the value. -1 if the
+   *                      value is in the page
+   * @return error code. 0 if no error
+   */
+  RC viewRecord(const char* page, int sid, int& key, std::string_view& value,
+                int& size, PageId& overflow) const;
+
+  /**
+   * @param page[IN] a page of the file
+   * @return the # of records in the page
+   */
+  int pageRecordCount(const char* page) const;
+
+  /**
+   * read a record from a page of the file.
+   * @param page[IN] the page holding the record
+   * @param sid[IN] the slot of the record
+   * @param key[OUT] the record key
+   * @param value[OUT] the record value
+   * @return error code. 0 if no error
+   */
+  RC readRecord(const char* page, int sid, int& key, std::string& value) const;
+
+  /**
+   * append a record to a file in the slotted format.
+   * @param key[IN] the record key
+   * @param value[IN] the record value
+   * @param rid[OUT] the location of the stored record
+   * @return error code. 0 if no error
+   */
+  RC appendSlotted(int key, const std::string& value, RecordId& rid);
+
+  /**
+   * write a value to a chain of overflow pages at the end of the file.
+   * @param value[IN] the value to write
+   * @param first[OUT] the first page of the chain
+   * @return error code. 0 if no error
+   */
+  RC writeOverflow(const std::string& value, PageId& first);
+
+  /**
+   * read a value from a chain of overflow pages.
+   * @param pid[IN] the first page of the chain
+   * @param size[IN] the length of the value
+   * @param value[OUT] the value
+   * @return error code. 0 if no error
+   */
+  RC readOverflow(PageId pid, int size, std::string& value) const;
+
+  /**
+   * @param pid[IN] a page of a file in the slotted format
+   * @return the number of records in the page. 0 for an overflow page
+   */
+  int slotCount(PageId pid) const;
+
   PageFile pf;     // the PageFile used to store the records
   RecordId erid;   // the last record id of the file + 1
+  RecordFormat format;      // the layout of the records
+  int recordsPerPage;       // the number of record slots in a page of the file
+  std::vector<char> tail;   // a copy of the last page, for append()
+
+  mutable PageId countPid;  // the page slotCount() looked at last
+  mutable int countValue;   // its number of records
+
+  static RecordFormat defaultFormat;  // the record format of new files
 };
 
 #endif // RECORDFILE_H
@@ -7,6 +7,7 @@
  * @date 3/24/2008
  */
 
+#include <climits>
 #include <cstdio>
 #include <cstring>
 #include <cstdlib>
@@ -22,6 +23,33 @@ using namespace std;
 extern FILE* sqlin;
 int sqlparse(void); 
 
+bool SqlEngine::mmapMode = false;
+
+// # of index entries whose tuples are fetched from the table together
+static const int FETCH_BATCH = 64;
+
+// read up to FETCH_BATCH entries with keys up to stopkey (INT_MAX for no
+// limit) from the index and, if rf is not NULL, start reading the table
+// pages of their tuples all at once. done is set when stopkey is passed
+static int readBatch(BTreeIndex& bindex, IndexCursor& cursor, int stopkey,
+                     IndexEntry* batch, const RecordFile* rf, bool& done);
+
+// check the conditions of a select on a tuple. keys[i] is the value of
+// cond[i] as an integer
+static bool matchConds(const vector<SelCond>& cond, const int* keys, int key, string_view value);
+
+// check the conditions of a select on a batch of n tuples, one condition
+// at a time over the whole batch. match[i] is set to whether tuple i meets
+// them all. values may be NULL if no condition is on the value
+static void matchBatch(const vector<SelCond>& cond, const int* condKeys, const int* keys,
+                       const string_view* values, int n, unsigned char* match);
+
+// does the difference diff between a tuple and a condition value meet comp?
+static bool meets(SelCond::Comparator comp, int diff);
+
+// print a tuple of the result of a select on attr
+static void printTuple(int attr, int key, string_view value);
+
 
 RC SqlEngine::run(FILE* commandline)
 {
@@ -42,14 +70,15 @@ RC SqlEngine::select(int attr, const string& table, const vector<SelCond>& cond)
 	BTreeIndex bindex;
 	IndexCursor cursor;
 	
+  RecordPage page; // the table page of the last tuple fetched through the index
+	
   RC     rc;
   int    key;     
-  string value;
+  string_view value;
   int    count;
-  int    diff;
 
   // open the table file
-  if ((rc = rf.open(table + ".tbl", 'r')) < 0) {
+  if ((rc = rf.open(table + ".tbl", mmapMode ? 'm' : 'r')) < 0) {
     fprintf(stderr, "Error: table %s does not exist\n", table.c_str());
     return rc;
   }
@@ -57,11 +86,20 @@ RC SqlEngine::select(int attr, const string& table, const vector<SelCond>& cond)
   // scan the table file from the beginning
   rid.pid = rid.sid = 0;
   count = 0;
+
+  // the keys in the conditions are converted once, not for every tuple,
+  // and the values are only read when a condition or the output needs them
+  vector<int> condKeys(cond.size());
+  vector<unsigned char> match;  // the tuples of a batch that meet the conditions
+  bool needValue = (attr == 2) || (attr == 3);
+  for (unsigned i = 0; i < cond.size(); i++) {
+    condKeys[i] = atoi(cond[i].value);
+    if (cond[i].attr == 2) needValue = true;
+  }
   
-  if((bindex.open(table + ".idx", 'r')) == 0)  //index file can be opened, use the index to select
+  if((bindex.open(table + ".idx", mmapMode ? 'm' : 'r')) == 0)  //index file can be opened, use the index to select
   	{
-  		int locatekey=-1;
-  		int stopkey=-1;
+  		long long lo=INT_MIN, hi=INT_MAX;  //the range of keys the conditions allow, empty if lo>hi
   		int num_of_ne=0;  //count the number of non-equal conditions
   		int flag_count_value=0;   //if select count(*) from table where value, flag=1
 
@@ -80,38 +118,38 @@ RC SqlEngine::select(int attr, const string& table, const vector<SelCond>& cond)
   			if(cond[i].attr != 1)  //this condition is not about the key, so we do not need to use index
   				continue;
   			
-  			if(cond[i].comp == SelCond::EQ) //this condition is key equals to a value, we just need to check this condtion
-  			{
-  				locatekey = atoi(cond[i].value);
-				stopkey = atoi(cond[i].value);
-  				break;
-  			}
+  			//every condition on the key narrows the range. as long long, key > INT_MAX and
+  			//key < INT_MIN leave it empty instead of wrapping around
+  			long long v=condKeys[i];
+  			if(cond[i].comp == SelCond::EQ) //this condition is key equals to a value
+  				{
+  					if(lo<v) lo=v;
+  					if(hi>v) hi=v;
+  				}
   			
-  			if(cond[i].comp == SelCond::GT) //we need to make sure that the locatekey is larger than the key 
+  			if(cond[i].comp == SelCond::GT) //we need to make sure that lo is larger than the key 
   				{
-  					if(locatekey<=atoi(cond[i].value))
-  						locatekey=atoi(cond[i].value)+1;
+  					if(lo<v+1)
+  						lo=v+1;
   				}
   				
-  			if(cond[i].comp == SelCond::GE) //we need to make sure that the locatekey is not smaller than the key
+  			if(cond[i].comp == SelCond::GE) //we need to make sure that lo is not smaller than the key
   				{
-  					if(locatekey<atoi(cond[i].value))
-  						locatekey=atoi(cond[i].value);
+  					if(lo<v)
+  						lo=v;
   				}
   				
-  			if(cond[i].comp == SelCond::LT) //we need to set up stopkey to stop the readForward function
+  			if(cond[i].comp == SelCond::LT) //hi stops the readForward function
   				{
-  					if((stopkey>=atoi(cond[i].value)||(stopkey==-1)))
-  						stopkey=atoi(cond[i].value)-1;
+  					if(hi>v-1)
+  						hi=v-1;
   				}   
   				
-  			if(cond[i].comp == SelCond::LE) //we need to set up stopkey to stop the readForward function
+  			if(cond[i].comp == SelCond::LE) //hi stops the readForward function
   				{
-  					if((stopkey>atoi(cond[i].value)||(stopkey==-1)))
-  						stopkey=atoi(cond[i].value);
+  					if(hi>v)
+  						hi=v;
   				}
-  			
-  			 			
        }
         
        
@@ -120,73 +158,31 @@ RC SqlEngine::select(int attr, const string& table, const vector<SelCond>& cond)
         if((num_of_ne==cond.size())&&(cond.size()!=0))
       			{
       				//no index file, read normally
-		while (rid < rf.endRid())
+		//the table is read a batch of pages at a time. the conditions are
+		//checked on the keys and values of the whole batch at once, and the
+		//values are looked at in the pinned pages, without copying them
+		rf.advise(PageFile::SEQUENTIAL);
 		{
-			// read the tuple
-			if ((rc = rf.read(rid, key, value)) < 0) 
+			RecordFile::Scanner scan(rf, needValue);
+			while ((rc = scan.next()) == 0)
 			{
-				fprintf(stderr, "Error: while reading a tuple from table %s\n", table.c_str());
-				goto exit_select3;
-			}
-			// check the conditions on the tuple
-			for (unsigned i = 0; i < cond.size(); i++) 
-			{
-				// compute the difference between the tuple value and the condition value
-				switch (cond[i].attr) 
-				{
-					case 1:
-						diff = key - atoi(cond[i].value);
-						break;
-					case 2:
-						diff = strcmp(value.c_str(), cond[i].value);
-						break;
-				}
+				int n = scan.getCount();
+				match.resize(n);
+				matchBatch(cond, condKeys.data(), scan.getKeys(), scan.getValues(), n, match.data());
 
-				// skip the tuple if any condition is not met
-				switch (cond[i].comp) 
+				// the tuples that meet the conditions
+				for (int i = 0; i < n; i++)
 				{
-					case SelCond::EQ:
-						if (diff != 0) goto next_tuple1;
-						break;
-					case SelCond::NE:
-						if (diff == 0) goto next_tuple1;
-						break;
-					case SelCond::GT:
-						if (diff <= 0) goto next_tuple1;
-						break;
-					case SelCond::LT:
-						if (diff >= 0) goto next_tuple1;
-						break;
-					case SelCond::GE:
-						if (diff < 0) goto next_tuple1;
-						break;
-					case SelCond::LE:
-						if (diff > 0) goto next_tuple1;
-						break;
+					if (!match[i]) continue;
+					count++;
+					printTuple(attr, scan.getKeys()[i], needValue ? scan.getValues()[i] : string_view());
 				}
 			}
-
-			// the condition is met for the tuple. 
-			// increase matching tuple counter
-			count++;
-
-			// print the tuple 
-			switch (attr) 
-			{
-				case 1:  // SELECT key
-					fprintf(stdout, "%d\n", key);
-					break;
-				case 2:  // SELECT value
-					fprintf(stdout, "%s\n", value.c_str());
-					break;
-				case 3:  // SELECT *
-					fprintf(stdout, "%d '%s'\n", key, value.c_str());
-					break;
-			}
-
-			// move to the next tuple
-			next_tuple1:
-				++rid;
+		}
+		if (rc != RC_END_OF_FILE)
+		{
+			fprintf(stderr, "Error: while reading a tuple from table %s\n", table.c_str());
+			goto exit_select3;
 		}
 
 		 // print matching tuple count if "select count(*)"
@@ -202,88 +198,68 @@ RC SqlEngine::select(int attr, const string& table, const vector<SelCond>& cond)
 	  }
 	
 	
-	 //For other conditions, i.e. there is at least 1 not non-equal condition, continue using index
-        if(locatekey == -1)  //the conditions are not about the key, cannot use btreeindex, just locate(0,cursor);
-      	{
-      			bindex.locate(0,cursor);
-      	}
-        else
-		{
-			bindex.locate(locatekey,cursor);
+	 //select count(*) with conditions on the key alone is answered by the counts in the index,
+	 //without reading the entries, over the same key range the entries would be read from
+	 if (attr == 4) {
+		bool keyonly = true;
+		for (unsigned i = 0; i < cond.size(); i++) {
+			if ((cond[i].attr != 1) || (cond[i].comp == SelCond::NE)) {
+				keyonly = false;
+				break;
+			}
+		}
+		//an index whose nodes do not count entries (bruinbase -n) cannot count them, and is scanned
+		if (keyonly && ((lo > hi) || (bindex.countRange((int) lo, (int) hi, count) == 0))) {
+			if (lo > hi) count = 0;
+			fprintf(stdout, "%d\n", count);
+			rf.close();
+			return 0;
 		}
+	 }
+
+	 //For other conditions, i.e. there is at least 1 not non-equal condition, continue using index
+	 //the tuples are fetched in key order, not in the order they are stored
+	 rf.advise(PageFile::RANDOM);
+        if(lo<=hi)  //without conditions on the key, lo is INT_MIN and every entry is read
+			bindex.locate((int)lo,cursor);
   	  
-  	    while(bindex.readForward(cursor,key,rid) == 0)
+  	    //the entries are taken from the index in batches, so that the table pages of a batch are read in parallel
+  	    IndexEntry batch[FETCH_BATCH];
+  	    int nbatch=0, ibatch=0;
+  	    bool fetch=(attr!=4)||(flag_count_value==1);  //do we need to read the tuples?
+  	    bool done=(lo>hi);  //no key meets the conditions
+  	    for(;;)
   	    { 
-			if((key>stopkey)&&(stopkey!=-1))  //do not need to read the entry after this node, break the loop
-  				break;
+  		if(ibatch==nbatch)
+  			{
+  				if(done)
+  					break;
+  				nbatch=readBatch(bindex,cursor,(int)hi,batch,fetch ? &rf : NULL,done);
+  				ibatch=0;
+  				if(nbatch==0)
+  					break;
+  			}
+  		key=batch[ibatch].key;
+  		rid=batch[ibatch].rid;
+  		ibatch++;
   			
-  		if((attr!=4)||(flag_count_value==1))
+  		if(fetch)
   			{	
-				if ((rc = rf.read(rid, key, value)) < 0) 
+				if ((rc = rf.read(rid, key, value, page)) < 0) 
   				{
   					fprintf(stderr, "Error: while reading a tuple from table %s\n", table.c_str());
   					goto exit_select;
   				}
   			}
 			
-  			//check each condition
-  			int error_cond=0;  //show if there is an error, unnecessary
+  			//check each condition, skip the tuple if any condition is not met
+  			if(!matchConds(cond, condKeys.data(), key, value))
+  				continue;
   			
-  			for(int i=0;i<cond.size();i++)
-  			{
-  				// compute the difference between the tuple value and the condition value
-  				switch (cond[i].attr) {
-  				case 1:
-  					diff = key - atoi(cond[i].value);
-  					break;
-  				case 2:
-  					diff = strcmp(value.c_str(), cond[i].value);
-  					break;
-  					}
-  				// skip the tuple if any condition is not met
-  				switch (cond[i].comp) {
-  				case SelCond::EQ:
-  					if (diff != 0) {error_cond=1;continue;}   	//error_cond=1 means that this key does not meet the requirement, go to next key
-  						break;
-  				case SelCond::NE:  //non-equal is special, it devides the interval to 2 parts
-  					if (diff == 0) {error_cond=1;continue;}
-  						break;
-  				case SelCond::GT:
-  					if (diff <= 0) {error_cond=1;continue;}
-  						break;
-  				case SelCond::LT:
-  					if (diff >= 0) {error_cond=1;continue;}
-  						break;
-  				case SelCond::GE:
-  					if (diff < 0) {error_cond=1;continue;}
-  						break;
-  				case SelCond::LE:
-  					if (diff > 0) {error_cond=1;continue;}
-  						break;
-  				}
-  			}
   			// the condition is met for the tuple. 
   			// increase matching tuple counter
-  			if(error_cond==1) //the condition is non-equal, we need to skip this key
-  				goto do_nothing_this_key;
-  			
   			count++;
-  			
-  			// print the tuple 
-  			switch (attr) {
-				case 1:  // SELECT key
-					fprintf(stdout, "%d\n", key);
-					break;
-				case 2:  // SELECT value
-					fprintf(stdout, "%s\n", value.c_str());
-					break;
-				case 3:  // SELECT *
-					fprintf(stdout, "%d '%s'\n", key, value.c_str());
-					break;
-    		}
-    		do_nothing_this_key:  //simply skip this key
-    			if(error_cond==1)
-    				error_cond=0;   //the error_cond is set back to 0 and can be used for the judgement of following key   				
+  			printTuple(attr, key, value);
     	}
   		if (attr == 4)
 		{
@@ -293,6 +269,7 @@ RC SqlEngine::select(int attr, const string& table, const vector<SelCond>& cond)
 
 		// close the table file and return
 		exit_select:
+		page.release();
 		rf.close();
 		return rc;				
   	}
@@ -300,73 +277,31 @@ RC SqlEngine::select(int attr, const string& table, const vector<SelCond>& cond)
   else
   	{
   		//no index file, read normally
-		while (rid < rf.endRid())
+		//the table is read a batch of pages at a time. the conditions are
+		//checked on the keys and values of the whole batch at once, and the
+		//values are looked at in the pinned pages, without copying them
+		rf.advise(PageFile::SEQUENTIAL);
 		{
-			// read the tuple
-			if ((rc = rf.read(rid, key, value)) < 0) 
-			{
-				fprintf(stderr, "Error: while reading a tuple from table %s\n", table.c_str());
-				goto exit_select2;
-			}
-			// check the conditions on the tuple
-			for (unsigned i = 0; i < cond.size(); i++) 
+			RecordFile::Scanner scan(rf, needValue);
+			while ((rc = scan.next()) == 0)
 			{
-				// compute the difference between the tuple value and the condition value
-				switch (cond[i].attr) 
-				{
-					case 1:
-						diff = key - atoi(cond[i].value);
-						break;
-					case 2:
-						diff = strcmp(value.c_str(), cond[i].value);
-						break;
-				}
+				int n = scan.getCount();
+				match.resize(n);
+				matchBatch(cond, condKeys.data(), scan.getKeys(), scan.getValues(), n, match.data());
 
-				// skip the tuple if any condition is not met
-				switch (cond[i].comp) 
+				// the tuples that meet the conditions
+				for (int i = 0; i < n; i++)
 				{
-					case SelCond::EQ:
-						if (diff != 0) goto next_tuple;
-						break;
-					case SelCond::NE:
-						if (diff == 0) goto next_tuple;
-						break;
-					case SelCond::GT:
-						if (diff <= 0) goto next_tuple;
-						break;
-					case SelCond::LT:
-						if (diff >= 0) goto next_tuple;
-						break;
-					case SelCond::GE:
-						if (diff < 0) goto next_tuple;
-						break;
-					case SelCond::LE:
-						if (diff > 0) goto next_tuple;
-						break;
+					if (!match[i]) continue;
+					count++;
+					printTuple(attr, scan.getKeys()[i], needValue ? scan.getValues()[i] : string_view());
 				}
 			}
-
-			// the condition is met for the tuple. 
-			// increase matching tuple counter
-			count++;
-
-			// print the tuple 
-			switch (attr) 
-			{
-				case 1:  // SELECT key
-					fprintf(stdout, "%d\n", key);
-					break;
-				case 2:  // SELECT value
-					fprintf(stdout, "%s\n", value.c_str());
-					break;
-				case 3:  // SELECT *
-					fprintf(stdout, "%d '%s'\n", key, value.c_str());
-					break;
-			}
-
-			// move to the next tuple
-			next_tuple:
-				++rid;
+		}
+		if (rc != RC_END_OF_FILE)
+		{
+			fprintf(stderr, "Error: while reading a tuple from table %s\n", table.c_str());
+			goto exit_select2;
 		}
 
 		 // print matching tuple count if "select count(*)"
@@ -389,6 +324,7 @@ RC SqlEngine::load(const string& table, const string& loadfile, bool index)
 	//open table
 	RecordFile lf;   // RecordFile containing the table
 	RecordId   rid;  // record cursor for table scanning
+	EntrySorter entries;  // (key, rid) pairs to build the index from
 	int num;
 	num=0;
 	RC lc;
@@ -420,20 +356,31 @@ RC SqlEngine::load(const string& table, const string& loadfile, bool index)
 		if(parseLoadLine(line, key, value) == 0)
 		{
 			lf.append(key, value, rid);      //add file to the table
-			if(index == 1)   //insert (key,rid) pair to the index
+			if(index == 1)   //keep the (key,rid) pair for the index
 				{
-					BTreeIndex bindex;
-					if ((lc = bindex.open(table + ".idx", 'w')) < 0) 
+					if ((lc = entries.add(key, rid)) < 0)
 					{
-						fprintf(stderr, "Error: index %s cannot be accessed\n", loadfile.c_str());
+						fprintf(stderr, "Error: index %s cannot be built\n", table.c_str());
 						goto exit_load;
 					}
-					bindex.insert(key,rid);
 					num++;
-					bindex.close();
 				}
-			rid++;
+			lf.next(rid);
+		}
+	}
+
+	//build the index from all pairs at once instead of inserting them one by one
+	if(index == 1)
+	{
+		BTreeIndex bindex;
+		if ((lc = bindex.open(table + ".idx", 'w')) < 0) 
+		{
+			fprintf(stderr, "Error: index %s cannot be accessed\n", table.c_str());
+			goto exit_load;
 		}
+		if ((lc = bindex.bulkLoad(entries)) < 0)
+			fprintf(stderr, "Error: index %s cannot be built\n", table.c_str());
+		bindex.close();
 	}
 		
 	//close file and table
@@ -451,6 +398,127 @@ RC SqlEngine::load(const string& table, const string& loadfile, bool index)
   return 0;
 }
 
+static int readBatch(BTreeIndex& bindex, IndexCursor& cursor, int stopkey,
+                     IndexEntry* batch, const RecordFile* rf, bool& done)
+{
+  PageId pids[FETCH_BATCH];
+  int n = 0, npids = 0;
+
+  // the entries after stopkey are not needed
+  if (bindex.readForward(cursor, stopkey, batch, FETCH_BATCH, n) < 0) {
+    done = true;
+    return 0;
+  }
+  if (n < FETCH_BATCH) done = true;
+
+  // tuples of neighboring keys are often on the same page
+  for (int i = 0; i < n; i++) {
+    if (npids == 0 || pids[npids - 1] != batch[i].rid.pid) {
+      pids[npids++] = batch[i].rid.pid;
+    }
+  }
+
+  if (rf != NULL && npids > 0) rf->prefetch(pids, npids);
+  return n;
+}
+
+static bool matchConds(const vector<SelCond>& cond, const int* keys, int key, string_view value)
+{
+  int diff = 0;
+
+  for (unsigned i = 0; i < cond.size(); i++) {
+    // compute the difference between the tuple value and the condition value
+    switch (cond[i].attr) {
+    case 1:
+      diff = (key > keys[i]) - (key < keys[i]);
+      break;
+    case 2:
+      diff = value.compare(cond[i].value);
+      break;
+    }
+
+    // fail if the condition is not met
+    if (!meets(cond[i].comp, diff)) return false;
+  }
+
+  return true;
+}
+
+static void matchBatch(const vector<SelCond>& cond, const int* condKeys, const int* keys,
+                       const string_view* values, int n, unsigned char* match)
+{
+  memset(match, 1, n);
+
+  // the conditions on the key first. each is a comparison of every key
+  // in the batch, without branches, that the compiler can vectorize
+  for (unsigned c = 0; c < cond.size(); c++) {
+    if (cond[c].attr != 1) continue;
+    int v = condKeys[c];
+    switch (cond[c].comp) {
+    case SelCond::EQ:
+      for (int i = 0; i < n; i++) match[i] &= (keys[i] == v);
+      break;
+    case SelCond::NE:
+      for (int i = 0; i < n; i++) match[i] &= (keys[i] != v);
+      break;
+    case SelCond::GT:
+      for (int i = 0; i < n; i++) match[i] &= (keys[i] > v);
+      break;
+    case SelCond::LT:
+      for (int i = 0; i < n; i++) match[i] &= (keys[i] < v);
+      break;
+    case SelCond::GE:
+      for (int i = 0; i < n; i++) match[i] &= (keys[i] >= v);
+      break;
+    case SelCond::LE:
+      for (int i = 0; i < n; i++) match[i] &= (keys[i] <= v);
+      break;
+    }
+  }
+
+  // the values are only compared for the tuples left
+  for (unsigned c = 0; c < cond.size(); c++) {
+    if (cond[c].attr != 2) continue;
+    for (int i = 0; i < n; i++) {
+      if (match[i]) match[i] = meets(cond[c].comp, values[i].compare(cond[c].value));
+    }
+  }
+}
+
+static bool meets(SelCond::Comparator comp, int diff)
+{
+  switch (comp) {
+  case SelCond::EQ:
+    return diff == 0;
+  case SelCond::NE:
+    return diff != 0;
+  case SelCond::GT:
+    return diff > 0;
+  case SelCond::LT:
+    return diff < 0;
+  case SelCond::GE:
+    return diff >= 0;
+  case SelCond::LE:
+    return diff <= 0;
+  }
+  return false;
+}
+
+static void printTuple(int attr, int key, string_view value)
+{
+  switch (attr) {
+  case 1:  // SELECT key
+    fprintf(stdout, "%d\n", key);
+    break;
+  case 2:  // SELECT value
+    fprintf(stdout, "%.*s\n", (int) value.size(), value.data());
+    break;
+  case 3:  // SELECT *
+    fprintf(stdout, "%d '%.*s'\n", key, (int) value.size(), value.data());
+    break;
+  }
+}
+
 RC SqlEngine::parseLoadLine(const string& line, int& key, string& value)
 {
     const char *s;
@@ -67,6 +67,16 @@ class SqlEngine {
    * @return error code. 0 if no error
    */
   static RC parseLoadLine(const std::string& line, int& key, std::string& value);
+
+  /**
+   * make select() read tables and indexes through read-only memory
+   * mappings ('m' mode of PageFile) instead of the buffer pool.
+   * @param on[IN] true to use memory mappings
+   */
+  static void setMmap(bool on) { mmapMode = on; }
+
+ private:
+  static bool mmapMode;  // does select() open files in 'm' mode?
 };
 
 #endif /* SQLENGINE_H */
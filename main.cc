@@ -9,10 +9,87 @@
  
 #include "Bruinbase.h"
 #include "SqlEngine.h"
+#include "PageFile.h"
+#include "RecordFile.h"
+#include "BTreeIndex.h"
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
 
-int main()
+static void usage(const char* prog)
 {
+  fprintf(stderr, "usage: %s [-c cache_pages] [-m] [-f node_format] [-p] [-n]\n"
+          "       [-s page_size] [-r record_format]\n", prog);
+  fprintf(stderr, "  -c cache_pages  memory of the buffer pool, in %d-byte pages (default %d)\n",
+          PageFile::PAGE_SIZE, BufferPool::DEFAULT_CAPACITY);
+  fprintf(stderr, "  -m              read tables and indexes through memory mappings\n");
+  fprintf(stderr, "  -f node_format  node layout of new indexes: interleaved (default), soa\n"
+          "                  or packed (compressed leaf nodes)\n");
+  fprintf(stderr, "  -p              keep the non-leaf nodes of indexes in memory\n");
+  fprintf(stderr, "  -n              count the entries in the non-leaf nodes of new indexes,\n"
+          "                  so that COUNT(*) on a key range reads no entries\n");
+  fprintf(stderr, "  -s page_size    page size of new tables and indexes: a power of 2\n"
+          "                  from %d (default) to %d\n", PageFile::PAGE_SIZE, PageFile::MAX_PAGE_SIZE);
+  fprintf(stderr, "  -r record_format record layout of new tables: fixed (default) or slotted\n"
+          "                  (variable-length records)\n");
+}
+
+int main(int argc, char* argv[])
+{
+  int opt;
+
+  while ((opt = getopt(argc, argv, "c:mf:pns:r:")) != -1) {
+    switch (opt) {
+    case 'c':
+      if (atoi(optarg) <= 0 || PageFile::setCacheSize(atoi(optarg)) < 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'm':
+      SqlEngine::setMmap(true);
+      break;
+    case 'f':
+      if (strcmp(optarg, "interleaved") == 0) {
+        BTreeIndex::setDefaultFormat(NODE_INTERLEAVED);
+      } else if (strcmp(optarg, "soa") == 0) {
+        BTreeIndex::setDefaultFormat(NODE_SOA);
+      } else if (strcmp(optarg, "packed") == 0) {
+        BTreeIndex::setDefaultFormat(NODE_PACKED);
+      } else {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'p':
+      BTreeIndex::setPinInnerLevels(true);
+      break;
+    case 'n':
+      BTreeIndex::setCountEntries(true);
+      break;
+    case 's':
+      if (PageFile::setDefaultPageSize(atoi(optarg)) < 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'r':
+      if (strcmp(optarg, "fixed") == 0) {
+        RecordFile::setDefaultFormat(RECORD_FIXED);
+      } else if (strcmp(optarg, "slotted") == 0) {
+        RecordFile::setDefaultFormat(RECORD_SLOTTED);
+      } else {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
   // run the SQL engine taking user commands from standard input (console).
   SqlEngine::run(stdin);
 
@@ -0,0 +1,84 @@
+#!/bin/sh
+#
+# load movie.del with an index at every page size and node format, with
+# counted non-leaf nodes (-n) and with slotted records (-r slotted), and
+# check that the queries give the same results as with 1KB pages. then
+# check that slotted records keep values longer than a page whole.
+# BRUINBASE may name another build to run, e.g. one with -fsanitize=address.
+#
+
+BRUINBASE=${BRUINBASE:-$(pwd)/bruinbase}
+DATA=$(pwd)/movie.del
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+cd "$DIR" || exit 1
+
+cat > query.sql <<EOF
+LOAD movie FROM '$DATA' WITH INDEX
+SELECT COUNT(*) FROM movie
+SELECT COUNT(*) FROM movie WHERE key > 100 AND key < 2000
+SELECT * FROM movie WHERE key > 4500
+SELECT * FROM movie WHERE key = 489
+SELECT key FROM movie WHERE value = 'Baby Take a Bow'
+SELECT value FROM movie WHERE key < 50
+EOF
+
+rm -f movie.tbl movie.idx
+"$BRUINBASE" < query.sql > expected.txt 2> /dev/null || exit 1
+
+status=0
+
+# run the queries with the options after the description, and compare
+check() {
+  what=$1
+  shift
+  rm -f movie.tbl movie.idx
+  if ! "$BRUINBASE" "$@" < query.sql > out.txt 2> err.txt ||
+     ! cmp -s out.txt expected.txt; then
+    echo "FAIL: $what"
+    cat err.txt
+    status=1
+  fi
+}
+
+for size in 1024 2048 4096 8192 16384 32768 65536; do
+  for format in interleaved soa packed; do
+    check "page size $size, $format nodes" -s $size -f $format
+  done
+  check "page size $size, counted nodes" -s $size -n
+  check "page size $size, slotted records" -s $size -r slotted
+done
+
+# a slotted page keeps values of up to (page size - 12) / 4 bytes in it, so
+# the 300-byte value goes to an overflow page at 1KB, and the 5000-byte one
+# to a chain of them at 1KB and 4KB and to one at 8KB. each value must be
+# read back whole through the index, and the table scan must step over them
+awk -v q="'" 'BEGIN {
+  for (i = 0; i < 5000; i++) long = long sprintf("%c", 97 + (i * 7) % 26)
+  v[1] = "short"; v[2] = substr(long, 1, 300); v[3] = long; v[4] = "last"
+  for (k = 1; k <= 4; k++) print k ",\"" v[k] "\"" > "long.del"
+  print 3 " " q v[3] q > "long_expected.txt"
+  for (r = 0; r < 2; r++)
+    for (k = 1; k <= 4; k++) print k " " q v[k] q > "long_expected.txt"
+}'
+
+cat > long.sql <<EOF
+LOAD long FROM 'long.del' WITH INDEX
+SELECT * FROM long WHERE key = 3
+SELECT * FROM long
+SELECT * FROM long WHERE key > 0
+EOF
+
+for size in 1024 4096 8192 65536; do
+  rm -f long.tbl long.idx
+  "$BRUINBASE" -s $size -r slotted < long.sql > out.txt 2> err.txt
+  if [ $? -ne 0 ] ||
+     ! sed -e 's/^\(Bruinbase> \)*//' -e '/^$/d' out.txt | cmp -s - long_expected.txt; then
+    echo "FAIL: page size $size, slotted records with long values"
+    cat err.txt
+    status=1
+  fi
+done
+
+[ $status -eq 0 ] && echo "page sizes: OK"
+exit $status